@@ -5,12 +5,31 @@ import os
 # endregion
 
 # region ---------- CONSTANTS ----------
+CLUSTER_BLOCKS_OFFSET = 468
+CLUSTER_BLOCKS_OPTIONS = (1, 2, 4, 8)
+
+REFCOUNT_LBA_OFFSET = 472
+REFCOUNT_BLOCKS_OFFSET = 476
+JOURNAL_LBA_OFFSET = 480
+JOURNAL_BLOCKS_OFFSET = 484
+
 EDENFS_BLOCK_COUNT_OFFSET = 488
 EDENFS_BLOCK_COUNT_LEN = 4
 
 EDENFS_SIGN_OFFSET = 492
 EDENFS_SIGN_LEN = 9
 EDENFS_SIGN = 'EDENFS100'
+EDENFS_SIGN_V2 = 'EDENFS200'
+EDENFS_SIGN_V3 = 'EDENFS300'
+
+VERSION_CHAINS = 1
+VERSION_EXTENTS = 2
+VERSION_WIDE = 3
+EDENFS_VERSIONS = {EDENFS_SIGN: VERSION_CHAINS, EDENFS_SIGN_V2: VERSION_EXTENTS, EDENFS_SIGN_V3: VERSION_WIDE}
+EDENFS_SIGNS = {VERSION_CHAINS: EDENFS_SIGN, VERSION_EXTENTS: EDENFS_SIGN_V2, VERSION_WIDE: EDENFS_SIGN_V3}
+
+ADDR_SHIFT_NARROW = 9
+ADDR_SHIFT_WIDE = 4
 
 BLOCK_SIZE_BYTES = 512
 BITMAP_SIZE_BITS = BLOCK_SIZE_BYTES * 8
@@ -24,17 +43,68 @@ DIR_ENTRIES_OFFSET = 2
 NAME_LEN = 12
 RESERVED_PART = 12
 NEXT_PART_OFFSET = DIR_ENTRIES_PER_PART * DIR_ENTRY_SIZE + RESERVED_PART
+ENTRY_COUNT_OFFSET = DIR_ENTRIES_OFFSET + DIR_ENTRIES_PER_PART * DIR_ENTRY_SIZE
+ENTRY_COUNT_VALID = 0x8000
+ENTRY_COUNT_MASK = 0x7FFF
+NAME_FILTER_OFFSET = ENTRY_COUNT_OFFSET + 2
+NAME_FILTER_LEN = 8
+NAME_FILTER_BITS = NAME_FILTER_LEN * 8
 
 FILE_DATA_PER_BLOCK = 506
 
+EXTENT_SIZE = 12
+EXTENTS_PER_PART = 41
+EXTENTS_OFFSET = 8
+FILE_SIZE_OFFSET = 4
+EXTENT_FLAGS_OFFSET = 2
+EXTENT_SHARED = 1 << 0
+EXTENT_COMPRESSED = 1 << 1
+FRAME_INDEX_OFFSET = EXTENTS_OFFSET + EXTENTS_PER_PART * EXTENT_SIZE
+FRAME_END_OFFSET = FRAME_INDEX_OFFSET + 4
+
+FRAME_SIZE = 4096
+FRAMES_PER_PART = 126
+FRAME_DEAD_OFFSET = 2
+FRAMES_OFFSET = 4
+FRAME_HEADER_SIZE = 2
+FRAME_BLOCKS_MASK = 0xF
+FRAME_STORED = 1 << 4
+FRAME_START_SHIFT = 5
+FRAME_DEAD_MAX = 0xFFFF
+
+LZ4_MIN_MATCH = 4
+LZ4_LAST_LITERALS = 5
+LZ4_MATCH_LIMIT = 12
+LZ4_MAX_OFFSET = 0xFFFF
+LZ4_RUN_MASK = 0xF
+LZ4_HASH_BITS = 11
+
 PRESENT = 1 << 0
 IS_DIR = 1 << 1
 NOT_EMPTY = 1 << 2
+INLINE = 1 << 3
+
+INLINE_OWNER_SHIFT = 4
+INLINE_INDEX_SHIFT = 9
+INLINE_OWNER_MASK = 0x1F
+INLINE_CHUNK = NAME_LEN
+INLINE_SLOTS = 8
+INLINE_MAX = INLINE_SLOTS * INLINE_CHUNK
 
 CURRENT_SEEK = 0
 START_SEEK = 1
 END_SEEK = 2
 
+JOURNAL_BLOCKS = 128
+JOURNAL_MIN_BLOCKS = 16
+JOURNAL_MAX_LOG = 255
+JOURNAL_MAGIC = 'EDENJRNL'
+JOURNAL_DESC_MAGIC = 'EDENDESC'
+JOURNAL_MAGIC_LEN = 8
+JOURNAL_DESC_LBAS = 123
+
+REFCOUNT_MAX = 255
+
 MAX_READ = 4096
 # endregion
 
@@ -48,7 +118,118 @@ def is_edenfs(dev):
     :return: whether the device contains EdenFS (boolean)
     """
 
-    return dev.read(EDENFS_SIGN_OFFSET, EDENFS_SIGN_LEN) == EDENFS_SIGN
+    return dev.read(EDENFS_SIGN_OFFSET, EDENFS_SIGN_LEN) in EDENFS_VERSIONS
+
+
+def lz4_compress(data, max_len):
+    """
+    Compresses data in the LZ4 block format, the way the kernel does.
+    :param data: the data to compress, up to 64 KB
+    :param max_len: the maximal size of the compressed data
+    :return: the compressed data, or None if it is larger than max_len (string)
+    """
+
+    table = {}
+    out = []
+    out_len = 0
+    ip = 0
+    anchor = 0
+    # The last match must start 12 bytes before the end, and end 5 bytes before it.
+    limit = len(data) - LZ4_MATCH_LIMIT
+    while ip < limit:
+        seq = data[ip:ip + LZ4_MIN_MATCH]
+        h = ((struct.unpack('<I', seq)[0] * 2654435761) & 0xFFFFFFFF) >> (32 - LZ4_HASH_BITS)
+        ref = table.get(h, 0)
+        table[h] = ip
+        if ref >= ip or ip - ref > LZ4_MAX_OFFSET or data[ref:ref + LZ4_MIN_MATCH] != seq:
+            ip += 1
+            continue
+        match = LZ4_MIN_MATCH
+        while ip + match < len(data) - LZ4_LAST_LITERALS and data[ref + match] == data[ip + match]:
+            match += 1
+        sequence = _lz4_sequence(data[anchor:ip], ip - ref, match - LZ4_MIN_MATCH)
+        out.append(sequence)
+        out_len += len(sequence)
+        if out_len > max_len:
+            return None
+        ip += match
+        anchor = ip
+
+    # The last sequence has literals alone.
+    out.append(_lz4_sequence(data[anchor:]))
+    out = ''.join(out)
+    return out if len(out) <= max_len else None
+
+
+def _lz4_sequence(literals, offset=None, match=0):
+    token = min(len(literals), LZ4_RUN_MASK) << 4
+    if offset is not None:
+        token |= min(match, LZ4_RUN_MASK)
+    sequence = chr(token) + _lz4_length(len(literals)) + literals
+    if offset is not None:
+        sequence += struct.pack('<H', offset) + _lz4_length(match)
+    return sequence
+
+
+def _lz4_length(length):
+    if length < LZ4_RUN_MASK:
+        return ''
+    length -= LZ4_RUN_MASK
+    return '\xFF' * (length / 0xFF) + chr(length % 0xFF)
+
+
+def lz4_decompress(data, out_len):
+    """
+    Decompresses data in the LZ4 block format. Decompression stops once out_len bytes are produced, so the
+    compressed data may be followed by padding.
+    :param data: the compressed data
+    :param out_len: the size of the data
+    :return: the data (string)
+    """
+
+    out = []
+    size = 0
+    ip = 0
+    while ip < len(data):
+        token = ord(data[ip])
+        ip += 1
+        lit = token >> 4
+        if lit == LZ4_RUN_MASK:
+            while True:
+                b = ord(data[ip])
+                ip += 1
+                lit += b
+                if b != 0xFF:
+                    break
+        if lit > out_len - size:
+            break
+        out.append(data[ip:ip + lit])
+        ip += lit
+        size += lit
+        if size == out_len:
+            return ''.join(out)
+
+        offset = struct.unpack('<H', data[ip:ip + 2])[0]
+        ip += 2
+        match = token & LZ4_RUN_MASK
+        if match == LZ4_RUN_MASK:
+            while True:
+                b = ord(data[ip])
+                ip += 1
+                match += b
+                if b != 0xFF:
+                    break
+        match += LZ4_MIN_MATCH
+        if not offset or offset > size or match > out_len - size:
+            break
+        out = [''.join(out)]
+        # The match may overlap the output it repeats.
+        while match:
+            piece = out[0][size - offset:size - offset + match]
+            out[0] += piece
+            size += len(piece)
+            match -= len(piece)
+    raise Exception('FS Error', 'Compressed data is corrupted!')
 # endregion
 
 # region ---------- CLASSES ----------
@@ -58,30 +239,64 @@ class EdenFS:
     def __init__(self, dev):
         self.dev = dev
         self.first_bitmap_lba = struct.unpack('I', self.dev.read(FIRST_BITMAP_LBA_OFFSET, 4))[0]
+        cluster_blocks = struct.unpack('I', self.dev.read(CLUSTER_BLOCKS_OFFSET, 4))[0]
+        self.cluster_blocks = cluster_blocks if cluster_blocks in CLUSTER_BLOCKS_OPTIONS else 1
+        self.__set_version(EDENFS_VERSIONS.get(self.dev.read(EDENFS_SIGN_OFFSET, EDENFS_SIGN_LEN), VERSION_CHAINS))
+        self.__count_levels()
+        self.open_files = []
+        if self.is_edenfs():
+            self.__replay_journal()
+
+    def is_edenfs(self):
+        return self.dev.read(EDENFS_SIGN_OFFSET, EDENFS_SIGN_LEN) in EDENFS_VERSIONS
+
+    def __set_version(self, version):
+        self.version = version
+        # The wide revision keeps only the flags below the LBA of an address.
+        self.addr_shift = ADDR_SHIFT_WIDE if version == VERSION_WIDE else ADDR_SHIFT_NARROW
+        self.attr_mask = (1 << self.addr_shift) - 1
 
-        cap = self.dev.size / BLOCK_SIZE_BYTES
+    def __count_levels(self):
+        # The bitmaps have a bit for every cluster.
+        cap = self.dev.size / BLOCK_SIZE_BYTES / self.cluster_blocks
         self.levels = 0
         self.levels_count = []
         while cap:
-            count = cap / BITMAP_SIZE_BITS
+            if self.version == VERSION_WIDE:
+                # Partial bitmap blocks cover the tail of the device, up to a single top block.
+                count = (cap + BITMAP_SIZE_BITS - 1) / BITMAP_SIZE_BITS if cap > 1 else 0
+            else:
+                count = cap / BITMAP_SIZE_BITS
             if count:
                 self.levels += 1
                 self.levels_count.append(count)
             cap = count
         self.levels_count.reverse()
+        # The root directory starts the first cluster after the bitmaps.
         self.root_lba = self.first_bitmap_lba + sum(self.levels_count)
-        self.open_files = []
-
-    def is_edenfs(self):
-        return self.dev.read(EDENFS_SIGN_OFFSET, EDENFS_SIGN_LEN) == EDENFS_SIGN
+        self.root_lba = (self.root_lba + self.cluster_blocks - 1) / self.cluster_blocks * self.cluster_blocks
+
+    def format_edenfs(self, version=VERSION_EXTENTS, cluster_blocks=1):
+        if cluster_blocks not in CLUSTER_BLOCKS_OPTIONS:
+            raise Exception('FS Error', 'Illegal cluster size!')
+        self.cluster_blocks = cluster_blocks
+        self.__set_version(version)
+        self.__count_levels()
+        if not self.levels:
+            raise Exception('FS Error', 'The device is too small for the cluster size!')
+        block_count = self.dev.size / BLOCK_SIZE_BYTES
+        if self.dev.size % BLOCK_SIZE_BYTES:
+            block_count += 1
+        # The LBAs of the addresses have the bits above the flags.
+        if block_count >> (32 - self.addr_shift):
+            raise Exception('FS Error', 'The device is too large for this version!')
 
-    def format_edenfs(self):
         print 'Writing filesystem...'
         prog = UI.Progress(0)
         total_blocks = sum(self.levels_count)
         done_blocks = 0
 
-        total_allocated = self.first_bitmap_lba + sum(self.levels_count)
+        total_allocated = self.root_lba / cluster_blocks
         allocated_block = '\xFF' * BLOCK_SIZE_BYTES
         free_block = '\x00' * BLOCK_SIZE_BYTES
         for level in xrange(self.levels):
@@ -112,16 +327,46 @@ class EdenFS:
                 prog.update(done_blocks * 100 / total_blocks)
             total_allocated /= BITMAP_SIZE_BITS
         prog.done()
+        if version == VERSION_WIDE:
+            self.__mark_bitmap_tails()
+
         self.root_lba = self.balloc()
+        journal_lba = self.__balloc_run(JOURNAL_BLOCKS, clear=False)
+        header = JOURNAL_MAGIC + struct.pack('I', 1)
+        header += '\x00' * (BLOCK_SIZE_BYTES - len(header))
+        self.dev.write_blocks(lba=journal_lba, data=header, block_size=BLOCK_SIZE_BYTES)
+        refcount_lba = 0
+        refcount_blocks = 0
+        if version >= VERSION_EXTENTS:
+            # One byte for every block, counting the owners of shared blocks.
+            refcount_blocks = (block_count + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES
+            refcount_lba = self.__balloc_run(refcount_blocks)
         print
 
-        block_count = self.dev.size / BLOCK_SIZE_BYTES
-        if self.dev.size % BLOCK_SIZE_BYTES:
-            block_count += 1
         self.dev.write(EDENFS_BLOCK_COUNT_OFFSET, struct.pack('I', block_count))
+        self.dev.write(CLUSTER_BLOCKS_OFFSET, struct.pack('I', cluster_blocks))
         self.dev.write(LEVELS_OFFSET, struct.pack('B', self.levels))
         self.dev.write(FIRST_SECT_LBA_OFFSET, struct.pack('I', self.root_lba))
-        self.dev.write(EDENFS_SIGN_OFFSET, EDENFS_SIGN)
+        self.dev.write(JOURNAL_LBA_OFFSET, struct.pack('II', journal_lba, JOURNAL_BLOCKS))
+        self.dev.write(REFCOUNT_LBA_OFFSET, struct.pack('II', refcount_lba, refcount_blocks))
+        self.dev.write(EDENFS_SIGN_OFFSET, EDENFS_SIGNS[version])
+
+    def __mark_bitmap_tails(self):
+        # The last block of every level has bits past the clusters or the blocks it covers. They are marked as
+        # allocated, so the search never goes past the end of the device.
+        children = self.dev.size / BLOCK_SIZE_BYTES / self.cluster_blocks
+        for level in xrange(self.levels):
+            count = self.levels_count[self.levels - level - 1]
+            bitmap_lba = self.first_bitmap_lba + sum(self.levels_count[:-(level + 1)]) + count - 1
+            used = children - (count - 1) * BITMAP_SIZE_BITS
+            bitmap = self.dev.read_blocks(lba=bitmap_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+            if used % 8:
+                bitmap = bitmap[:used / 8] + chr(ord(bitmap[used / 8]) | (0xFF << (used % 8)) & 0xFF) + \
+                    bitmap[used / 8 + 1:]
+            first = (used + 7) / 8
+            bitmap = bitmap[:first] + '\xFF' * (BLOCK_SIZE_BYTES - first)
+            self.dev.write_blocks(lba=bitmap_lba, data=bitmap, block_size=BLOCK_SIZE_BYTES)
+            children = count
 
     def list_dir(self, path, tree=False, put_type=False, put_size=False):
         cur_lba = self.root_lba
@@ -157,13 +402,23 @@ class EdenFS:
             if first_lba is not None:
                 attr = self.__get_entry_attr(found[0], found[1])
                 self.__delete_part_chain(first_lba, attr)
+            elif EdenFS.__has_attr(self.__get_entry_attr(found[0], found[1]), INLINE):
+                self.__clear_inline(found[0], found[1])
             self.__set_entry_lba(found[0], found[1], 0, 0)
             dir_size = self.__get_part_size(found[0])
             self.__set_part_size(found[0], dir_size - 1)
+            self.__update_name_filter(found[0])
+            path_parts = EdenFS.path_parts(path)
+            if len(path_parts) > 1:
+                parent = self.__find_path(path_parts[:-1], IS_DIR)
+                dir_lba = self.__get_entry_lba(parent[0], parent[1])
+            else:
+                dir_lba = self.root_lba
+            self.__update_entry_count(dir_lba, -1)
 
-    def import_file(self, ex_path, in_path):
+    def import_file(self, ex_path, in_path, compress=False):
         if os.path.isfile(ex_path):
-            in_f = self.open(in_path, 'w')
+            in_f = self.open(in_path, 'z' if compress else 'w')
             ex_f = open(ex_path)
             data = ex_f.read(MAX_READ)
             while data:
@@ -203,7 +458,7 @@ class EdenFS:
                 raise Exception('FS Error', 'Path does not exist!')
             found_attr = self.__get_entry_attr(found[0], found[1])
             if not EdenFS.__has_attr(found_attr, NOT_EMPTY):
-                self.__set_entry_lba(found[0], found[1], self.balloc(), PRESENT, IS_DIR, NOT_EMPTY)
+                self.__set_entry_lba(found[0], found[1], self.balloc(goal=found[0]), PRESENT, IS_DIR, NOT_EMPTY)
             cur_lba = self.__get_entry_lba(found[0], found[1])
         else:
             cur_lba = self.root_lba
@@ -217,6 +472,8 @@ class EdenFS:
             pre_attr = self.__get_entry_attr(found[0], found[1])
             if EdenFS.__has_attr(pre_attr, NOT_EMPTY):
                 self.__delete_part_chain(pre_lba, pre_attr)
+            elif EdenFS.__has_attr(pre_attr, INLINE):
+                self.__clear_inline(found[0], found[1])
         else:
             raise Exception('FS Error', 'File or directory already exist!')
         base_lba = found[0]
@@ -226,15 +483,37 @@ class EdenFS:
             attr.append(IS_DIR)
         self.__set_entry_name(base_lba, entry_offset, path_parts[-1])
         self.__set_entry_attr(base_lba, entry_offset, *attr)
+        self.__update_name_filter(base_lba)
         return base_lba, entry_offset
 
-    def balloc(self, clear=True):
-        lba = self.__find_in_level(0, self.first_bitmap_lba, 0)
+    def balloc(self, clear=True, goal=0):
+        # Blocks related to the goal are taken from its bitmap block or the ones next to it when possible.
+        cluster = self.__find_near(goal / self.cluster_blocks) if goal else None
+        if cluster is None:
+            cluster = self.__find_in_level(0, self.first_bitmap_lba, 0)
+        lba = cluster * self.cluster_blocks
         if clear:
-            self.dev.write_blocks(lba=lba, data='\x00' * BLOCK_SIZE_BYTES, block_size=BLOCK_SIZE_BYTES)
+            self.dev.write_blocks(lba=lba, data='\x00' * BLOCK_SIZE_BYTES * self.cluster_blocks,
+                                  block_size=BLOCK_SIZE_BYTES)
+        return lba
+
+    def __balloc_after(self, lba):
+        # The parts of a chain fill the cluster of the last part first.
+        lba += 1
+        if not lba % self.cluster_blocks:
+            return self.balloc(goal=lba)
+        self.dev.write_blocks(lba=lba, data='\x00' * BLOCK_SIZE_BYTES, block_size=BLOCK_SIZE_BYTES)
+        return lba
+
+    def __balloc_run(self, blocks, clear=True):
+        # The clusters of a new file-system are allocated one after the other.
+        lba = self.balloc(clear)
+        for i in xrange((blocks + self.cluster_blocks - 1) / self.cluster_blocks - 1):
+            self.balloc(clear)
         return lba
 
     def bfree(self, lba):
+        lba /= self.cluster_blocks
         for level in range(self.levels):
             base_lba = self.first_bitmap_lba + sum(self.levels_count[:self.levels - level - 1])
             offset = lba / BITMAP_SIZE_BITS
@@ -255,12 +534,23 @@ class EdenFS:
         found_attr = self.__get_entry_attr(found[0], found[1])
         if EdenFS.__has_attr(found_attr, IS_DIR):
             raise Exception('FS Error', 'The target is a directory!')
+        if EdenFS.__has_attr(found_attr, INLINE):
+            # Move the data out of the directory part before writing.
+            inline_data = self.__get_inline(found[0], found[1])
+            self.__clear_inline(found[0], found[1])
+            self.__set_entry_lba(found[0], found[1], 0, PRESENT)
+            self.write_to_file(entry_data, inline_data)
+            found_attr = self.__get_entry_attr(found[0], found[1])
         if not EdenFS.__has_attr(found_attr, NOT_EMPTY):
-            cur_lba = self.balloc()
+            # The first part of the file is placed next to its directory.
+            cur_lba = self.balloc(goal=found[0])
             self.__set_entry_lba(found[0], found[1], cur_lba, PRESENT, NOT_EMPTY)
         else:
             cur_lba = self.__get_entry_lba(found[0], found[1])
-        self.write_to_parts(cur_lba, data, seek)
+        if self.version >= VERSION_EXTENTS:
+            self.write_to_extents(cur_lba, data, seek)
+        else:
+            self.write_to_parts(cur_lba, data, seek)
 
     def write_to_parts(self, part_lba, data, seek):
         seek_parts = seek / FILE_DATA_PER_BLOCK
@@ -270,7 +560,7 @@ class EdenFS:
             self.__set_part_size(part_lba, FILE_DATA_PER_BLOCK)
             next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
             if next_lba is None:
-                next_lba = self.balloc()
+                next_lba = self.__balloc_after(part_lba)
                 self.__set_next_part_lba(part_lba, next_lba, PRESENT, NOT_EMPTY)
             part_lba = next_lba
             seek_parts -= 1
@@ -290,7 +580,7 @@ class EdenFS:
                 self.__set_part_size(part_lba, FILE_DATA_PER_BLOCK)
                 next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
                 if next_lba is None:
-                    next_lba = self.balloc()
+                    next_lba = self.__balloc_after(part_lba)
                     self.__set_next_part_lba(part_lba, next_lba, PRESENT, NOT_EMPTY)
                 part_lba = next_lba
                 data = data[size_in_part:]
@@ -303,9 +593,14 @@ class EdenFS:
         found_attr = self.__get_entry_attr(found[0], found[1])
         if EdenFS.__has_attr(found_attr, IS_DIR):
             raise Exception('FS Error', 'The target is a directory!')
+        if EdenFS.__has_attr(found_attr, INLINE):
+            inline_data = self.__get_inline(found[0], found[1])[seek:]
+            return inline_data if count is None else inline_data[:count]
         if not EdenFS.__has_attr(found_attr, NOT_EMPTY):
             return ''
         cur_lba = self.__get_entry_lba(found[0], found[1])
+        if self.version >= VERSION_EXTENTS:
+            return self.read_from_extents(cur_lba, count, seek)
         return self.read_from_parts(cur_lba, count, seek)
 
     def read_from_parts(self, part_lba, count=None, seek=0):
@@ -316,7 +611,7 @@ class EdenFS:
             self.__set_part_size(part_lba, FILE_DATA_PER_BLOCK)
             next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
             if next_lba is None:
-                next_lba = self.balloc()
+                next_lba = self.__balloc_after(part_lba)
                 self.__set_next_part_lba(part_lba, next_lba, PRESENT, NOT_EMPTY)
             part_lba = next_lba
             seek_parts -= 1
@@ -346,14 +641,250 @@ class EdenFS:
                     seek_in_part = 0
             part_lba = next_lba
 
+    def write_to_extents(self, header_lba, data, seek):
+        if self.__get_extent_flags(header_lba) & EXTENT_COMPRESSED:
+            self.__write_to_frames(header_lba, data, seek)
+            return
+        end = seek + len(data)
+        self.__extend_file(header_lba, (end + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES)
+        if self.__get_extent_flags(header_lba) & EXTENT_SHARED:
+            self.__unshare_blocks(header_lba, seek, end)
+        extents = self.__get_extents(header_lba)
+        while data:
+            lba, run = EdenFS.__map_block(extents, seek / BLOCK_SIZE_BYTES)
+            seek_in_block = seek % BLOCK_SIZE_BYTES
+            size = run * BLOCK_SIZE_BYTES - seek_in_block
+            addr = lba * BLOCK_SIZE_BYTES + seek_in_block
+            self.dev.write_blocks(lba=addr, data=data[:size], block_size=1)
+            seek += len(data[:size])
+            data = data[size:]
+        if end > self.__get_file_size(header_lba):
+            self.__set_file_size(header_lba, end)
+
+    def read_from_extents(self, header_lba, count=None, seek=0):
+        size = self.__get_file_size(header_lba)
+        if seek >= size:
+            return ''
+        if count is None or count > size - seek:
+            count = size - seek
+        if self.__get_extent_flags(header_lba) & EXTENT_COMPRESSED:
+            return self.__read_from_frames(header_lba, count, seek)
+        extents = self.__get_extents(header_lba)
+        data = ''
+        while count:
+            lba, run = EdenFS.__map_block(extents, seek / BLOCK_SIZE_BYTES)
+            seek_in_block = seek % BLOCK_SIZE_BYTES
+            size = min(run * BLOCK_SIZE_BYTES - seek_in_block, count)
+            addr = lba * BLOCK_SIZE_BYTES + seek_in_block
+            data += self.dev.read_blocks(lba=addr, count=size, block_size=1)
+            seek += size
+            count -= size
+        return data
+
+    def make_compressed(self, entry_data):
+        found = entry_data
+        if self.version < VERSION_EXTENTS:
+            return
+        # The file keeps the layout of its data.
+        if self.__get_entry_attr(found[0], found[1]) & (NOT_EMPTY | INLINE):
+            return
+        header_lba = self.balloc(goal=found[0])
+        offset = header_lba * BLOCK_SIZE_BYTES + EXTENT_FLAGS_OFFSET
+        self.dev.write_blocks(lba=offset, data=struct.pack('H', EXTENT_COMPRESSED), block_size=1)
+        self.__set_entry_lba(found[0], found[1], header_lba, PRESENT, NOT_EMPTY)
+
+    def __write_to_frames(self, header_lba, data, seek):
+        size = self.__get_file_size(header_lba)
+        end = seek + len(data)
+        while data:
+            frame = seek / FRAME_SIZE
+            seek_in_frame = seek % FRAME_SIZE
+            chunk = data[:FRAME_SIZE - seek_in_frame]
+            if len(chunk) < FRAME_SIZE and seek - seek_in_frame < size:
+                buff = self.__load_frame(header_lba, frame)
+            else:
+                buff = '\x00' * FRAME_SIZE
+            buff = buff[:seek_in_frame] + chunk + buff[seek_in_frame + len(chunk):]
+            # The frame holds the data up to the end of the file.
+            self.__store_frame(header_lba, frame, buff[:min(max(end, size) - (seek - seek_in_frame), FRAME_SIZE)])
+            seek += len(chunk)
+            data = data[len(chunk):]
+        if end > size:
+            self.__set_file_size(header_lba, end)
+
+    def __read_from_frames(self, header_lba, count, seek):
+        data = ''
+        while count:
+            seek_in_frame = seek % FRAME_SIZE
+            size = min(FRAME_SIZE - seek_in_frame, count)
+            data += self.__load_frame(header_lba, seek / FRAME_SIZE)[seek_in_frame:seek_in_frame + size]
+            seek += size
+            count -= size
+        return data
+
+    def __load_frame(self, header_lba, frame):
+        entry = self.__get_frame(header_lba, frame)
+        blocks = entry & FRAME_BLOCKS_MASK
+        if not blocks:
+            return '\x00' * FRAME_SIZE
+        payload = self.__read_frame_blocks(header_lba, entry >> FRAME_START_SHIFT, blocks)
+        if entry & FRAME_STORED:
+            return payload + '\x00' * (FRAME_SIZE - len(payload))
+        # The size of the data of the frame comes before the compressed data.
+        size = struct.unpack('H', payload[:FRAME_HEADER_SIZE])[0]
+        if size > FRAME_SIZE:
+            raise Exception('FS Error', 'Compressed data is corrupted!')
+        return lz4_decompress(payload[FRAME_HEADER_SIZE:], size) + '\x00' * (FRAME_SIZE - size)
+
+    def __store_frame(self, header_lba, frame, data):
+        # Compressing pays off only if it saves a block.
+        blocks = (len(data) + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES
+        packed = lz4_compress(data, (blocks - 1) * BLOCK_SIZE_BYTES - FRAME_HEADER_SIZE) if blocks > 1 else None
+        if packed is not None:
+            payload = struct.pack('H', len(data)) + packed
+            flags = 0
+        else:
+            payload = data
+            flags = FRAME_STORED
+        blocks = (len(payload) + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES
+        payload += '\x00' * (blocks * BLOCK_SIZE_BYTES - len(payload))
+
+        # Frames are packed one after the other: the last frame of the blocks may grow or shrink, a frame which
+        # still fits in its blocks stays in place, and any other frame moves to a hole left by other frames, or to
+        # the end if there is none.
+        entry = self.__get_frame(header_lba, frame)
+        old_start = entry >> FRAME_START_SHIFT
+        old_blocks = entry & FRAME_BLOCKS_MASK
+        offset = header_lba * BLOCK_SIZE_BYTES + FRAME_END_OFFSET
+        end = struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+        last = old_blocks and old_start + old_blocks == end
+        if last:
+            start, new_end = old_start, old_start + blocks
+        elif old_blocks >= blocks:
+            start, new_end = old_start, end
+        else:
+            start = None
+            if self.__get_dead_blocks(header_lba) + old_blocks >= blocks:
+                start = self.__find_frame_hole(header_lba, frame, blocks, end)
+            new_end = end
+            if start is None:
+                start, new_end = end, end + blocks
+        self.__extend_file(header_lba, new_end)
+        self.dev.write_blocks(lba=offset, data=struct.pack('I', new_end), block_size=1)
+        if self.__get_extent_flags(header_lba) & EXTENT_SHARED:
+            self.__unshare_blocks(header_lba, start * BLOCK_SIZE_BYTES, (start + blocks) * BLOCK_SIZE_BYTES)
+        extents = self.__get_extents(header_lba)
+        block = start
+        while payload:
+            lba, run = EdenFS.__map_block(extents, block)
+            self.dev.write_blocks(lba=lba, data=payload[:run * BLOCK_SIZE_BYTES], block_size=BLOCK_SIZE_BYTES)
+            block += run
+            payload = payload[run * BLOCK_SIZE_BYTES:]
+        self.__set_frame(header_lba, frame, (start << FRAME_START_SHIFT) | flags | blocks)
+        if not last:
+            self.__add_dead_blocks(header_lba, old_blocks, 0 if start == end else blocks)
+
+    def __get_dead_blocks(self, header_lba):
+        part_lba = self.__get_frame_index(header_lba)
+        if part_lba is None:
+            return 0
+        offset = part_lba * BLOCK_SIZE_BYTES + FRAME_DEAD_OFFSET
+        return struct.unpack('H', self.dev.read_blocks(lba=offset, count=2, block_size=1))[0]
+
+    def __add_dead_blocks(self, header_lba, freed, used):
+        # Once the amount of unused blocks is too large to keep, it stays at FRAME_DEAD_MAX.
+        part_lba = self.__get_frame_index(header_lba)
+        dead = self.__get_dead_blocks(header_lba)
+        if part_lba is None or dead == FRAME_DEAD_MAX:
+            return
+        dead = min(max(dead + freed - used, 0), FRAME_DEAD_MAX)
+        offset = part_lba * BLOCK_SIZE_BYTES + FRAME_DEAD_OFFSET
+        self.dev.write_blocks(lba=offset, data=struct.pack('H', dead), block_size=1)
+
+    def __find_frame_hole(self, header_lba, frame, blocks, end):
+        # The blocks of the frame itself count as unused.
+        ranges = []
+        part_lba = self.__get_frame_index(header_lba)
+        n = 0
+        while part_lba is not None:
+            for i in range(self.__get_part_size(part_lba)):
+                offset = part_lba * BLOCK_SIZE_BYTES + FRAMES_OFFSET + i * 4
+                entry = struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+                if n != frame and entry & FRAME_BLOCKS_MASK:
+                    ranges.append((entry >> FRAME_START_SHIFT, (entry >> FRAME_START_SHIFT) + (entry & FRAME_BLOCKS_MASK)))
+                n += 1
+            part_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+        hole = 0
+        for first, last in sorted(ranges) + [(end, end)]:
+            if first - hole >= blocks:
+                return hole
+            hole = max(hole, last)
+        return None
+
+    def __read_frame_blocks(self, header_lba, block, blocks):
+        extents = self.__get_extents(header_lba)
+        data = ''
+        while blocks:
+            lba, run = EdenFS.__map_block(extents, block)
+            run = min(run, blocks)
+            data += self.dev.read_blocks(lba=lba, count=run, block_size=BLOCK_SIZE_BYTES)
+            block += run
+            blocks -= run
+        return data
+
+    def __get_frame_index(self, header_lba):
+        offset = header_lba * BLOCK_SIZE_BYTES + FRAME_INDEX_OFFSET
+        index = struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+        if EdenFS.__has_attr(index, PRESENT, NOT_EMPTY):
+            return index >> self.addr_shift
+        return None
+
+    def __get_frame(self, header_lba, frame):
+        part_lba = self.__get_frame_index(header_lba)
+        while part_lba is not None and frame >= FRAMES_PER_PART:
+            part_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+            frame -= FRAMES_PER_PART
+        if part_lba is None or frame >= self.__get_part_size(part_lba):
+            return 0
+        offset = part_lba * BLOCK_SIZE_BYTES + FRAMES_OFFSET + frame * 4
+        return struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+
+    def __set_frame(self, header_lba, frame, entry):
+        part_lba = self.__get_frame_index(header_lba)
+        if part_lba is None:
+            # The first frame of the file is written, create its index.
+            part_lba = self.balloc(goal=header_lba)
+            offset = header_lba * BLOCK_SIZE_BYTES + FRAME_INDEX_OFFSET
+            index = (part_lba << self.addr_shift) | PRESENT | NOT_EMPTY
+            self.dev.write_blocks(lba=offset, data=struct.pack('I', index), block_size=1)
+        while frame >= FRAMES_PER_PART:
+            next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+            if next_lba is None:
+                # Every part of the index but the last one is full.
+                next_lba = self.__balloc_after(part_lba)
+                self.__set_part_size(part_lba, FRAMES_PER_PART)
+                self.__set_next_part_lba(part_lba, next_lba, PRESENT, NOT_EMPTY)
+            part_lba = next_lba
+            frame -= FRAMES_PER_PART
+        offset = part_lba * BLOCK_SIZE_BYTES + FRAMES_OFFSET + frame * 4
+        self.dev.write_blocks(lba=offset, data=struct.pack('I', entry), block_size=1)
+        if frame >= self.__get_part_size(part_lba):
+            self.__set_part_size(part_lba, frame + 1)
+
     def get_size(self, path):
         found = self.find_path(path)
         if found is None:
             raise Exception('FS Error', 'Path does not exist!')
         found_attr = self.__get_entry_attr(found[0], found[1])
+        if EdenFS.__has_attr(found_attr, INLINE):
+            return self.__get_entry_lba(found[0], found[1])
         if not EdenFS.__has_attr(found_attr, NOT_EMPTY):
             return 0
         lba = self.__get_entry_lba(found[0], found[1])
+        if EdenFS.__has_attr(found_attr, IS_DIR):
+            return self.__get_entry_count(lba)
+        if self.version >= VERSION_EXTENTS:
+            return self.__get_file_size(lba)
         return self.__get_size(lba)
 
     def __get_size(self, part_lba):
@@ -386,9 +917,16 @@ class EdenFS:
                 size_type = 'bytes'
                 if EdenFS.__has_attr(entry_attr, NOT_EMPTY):
                     entry_lba = self.__get_entry_lba(part_lba, entry_offset)
-                    size = self.__get_size(entry_lba)
+                    if EdenFS.__has_attr(entry_attr, IS_DIR):
+                        size = self.__get_entry_count(entry_lba)
+                    elif self.version >= VERSION_EXTENTS:
+                        size = self.__get_file_size(entry_lba)
+                    else:
+                        size = self.__get_size(entry_lba)
                     if EdenFS.__has_attr(entry_attr, IS_DIR):
                         size_type = 'entries'
+                elif EdenFS.__has_attr(entry_attr, INLINE):
+                    size = self.__get_entry_lba(part_lba, entry_offset)
 
                 if level:
                     output += '    |' * (level - 1) + '    +--- '
@@ -470,6 +1008,25 @@ class EdenFS:
                         self.dev.write_blocks(lba=lba, data=bitmap, block_size=BLOCK_SIZE_BYTES)
         return None
 
+    def __find_near(self, cluster):
+        leaf_lba = self.first_bitmap_lba + sum(self.levels_count[:self.levels - 1])
+        clusters = self.dev.size / BLOCK_SIZE_BYTES / self.cluster_blocks
+        leaf = cluster / BITMAP_SIZE_BITS
+        for near in (leaf, leaf - 1, leaf + 1):
+            if near < 0 or near >= self.levels_count[-1]:
+                continue
+            bitmap = self.dev.read_blocks(lba=leaf_lba + near, count=1, block_size=BLOCK_SIZE_BYTES)
+            start = cluster % BITMAP_SIZE_BITS if near == leaf else 0
+            for bit in range(start, BITMAP_SIZE_BITS) + range(start):
+                if near * BITMAP_SIZE_BITS + bit >= clusters:
+                    continue
+                n = ord(bitmap[bit / 8])
+                if not n & (1 << (bit % 8)):
+                    bitmap = bitmap[:bit / 8] + chr(n | (1 << (bit % 8))) + bitmap[bit / 8 + 1:]
+                    self.dev.write_blocks(lba=leaf_lba + near, data=bitmap, block_size=BLOCK_SIZE_BYTES)
+                    return near * BITMAP_SIZE_BITS + bit
+        return None
+
     def __find_in_dir(self, cur_lba, name, *attr):
         name += '\x00' * (NAME_LEN - len(name))
         while True:
@@ -483,7 +1040,7 @@ class EdenFS:
                 entry_name = self.__get_entry_name(cur_lba, entry_offset)
                 if EdenFS.__has_attr(entry_attr, PRESENT):
                     c += 1
-                if EdenFS.__has_attr(entry_attr, *attr) and name == entry_name:
+                if EdenFS.__has_attr(entry_attr, PRESENT, *attr) and name == entry_name:
                     return cur_lba, entry_offset
             next_part_lba = self.__get_next_part_lba(cur_lba, PRESENT, IS_DIR, NOT_EMPTY)
             if next_part_lba is None:
@@ -499,12 +1056,12 @@ class EdenFS:
         next_part = self.dev.read_blocks(lba=offset, count=4, block_size=1)
         next_part_lba = struct.unpack('I', next_part)[0]
         if EdenFS.__has_attr(next_part_lba, *attr):
-            return next_part_lba >> 9
+            return next_part_lba >> self.addr_shift
         return None
 
     def __set_next_part_lba(self, part_lba, lba, *attr):
         offset = part_lba * BLOCK_SIZE_BYTES + NEXT_PART_OFFSET
-        next_part_lba = (lba << 9) | (reduce(lambda x, y: x | y, attr) if attr else 0)
+        next_part_lba = (lba << self.addr_shift) | (reduce(lambda x, y: x | y, attr) if attr else 0)
         next_part = struct.pack('I', next_part_lba)
         self.dev.write_blocks(lba=offset, data=next_part, block_size=1)
 
@@ -518,22 +1075,60 @@ class EdenFS:
         offset = part_lba * BLOCK_SIZE_BYTES
         self.dev.write_blocks(lba=offset, data=size_data, block_size=1)
 
+    def __get_entry_count(self, dir_lba):
+        offset = dir_lba * BLOCK_SIZE_BYTES + ENTRY_COUNT_OFFSET
+        count = struct.unpack('H', self.dev.read_blocks(lba=offset, count=2, block_size=1))[0]
+        if count & ENTRY_COUNT_VALID:
+            return count & ENTRY_COUNT_MASK
+        count = self.__get_size(dir_lba)
+        self.dev.write_blocks(lba=offset, data=struct.pack('H', count | ENTRY_COUNT_VALID), block_size=1)
+        return count
+
+    def __update_entry_count(self, dir_lba, delta):
+        offset = dir_lba * BLOCK_SIZE_BYTES + ENTRY_COUNT_OFFSET
+        count = struct.unpack('H', self.dev.read_blocks(lba=offset, count=2, block_size=1))[0]
+        if count & ENTRY_COUNT_VALID:
+            count = ((count + delta) & ENTRY_COUNT_MASK) | ENTRY_COUNT_VALID
+            self.dev.write_blocks(lba=offset, data=struct.pack('H', count), block_size=1)
+
+    @staticmethod
+    def __name_hash(name):
+        h = 2166136261
+        for c in name[:NAME_LEN - 1].split('\x00')[0]:
+            h ^= ord(c)
+            h = (h * 16777619) & 0xFFFFFFFF
+        return h
+
+    def __update_name_filter(self, part_lba):
+        part = self.dev.read_blocks(lba=part_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+        bits = 0
+        for entry in xrange(0, DIR_ENTRIES_PER_PART):
+            entry_offset = entry * DIR_ENTRY_SIZE + DIR_ENTRIES_OFFSET
+            entry_attr = struct.unpack('I', part[entry_offset + NAME_LEN:entry_offset + DIR_ENTRY_SIZE])[0] & self.attr_mask
+            if not EdenFS.__has_attr(entry_attr, PRESENT):
+                continue
+            h = EdenFS.__name_hash(part[entry_offset:entry_offset + NAME_LEN])
+            bits |= 1 << (h % NAME_FILTER_BITS)
+            bits |= 1 << ((h / NAME_FILTER_BITS) % NAME_FILTER_BITS)
+        offset = part_lba * BLOCK_SIZE_BYTES + NAME_FILTER_OFFSET
+        self.dev.write_blocks(lba=offset, data=struct.pack('Q', bits), block_size=1)
+
     def __get_next_part_attr(self, part_lba):
         offset = part_lba * BLOCK_SIZE_BYTES + NEXT_PART_OFFSET
         next_part = self.dev.read_blocks(lba=offset, count=4, block_size=1)
         next_part_lba = struct.unpack('I', next_part)[0]
-        return next_part_lba & 0x1FF
+        return next_part_lba & self.attr_mask
 
     def __get_entry_lba(self, base_lba, entry_offset, *attr):
         offset = base_lba * BLOCK_SIZE_BYTES + entry_offset + NAME_LEN
         addr_data = self.dev.read_blocks(lba=offset, count=4, block_size=1)
         addr = struct.unpack('I', addr_data)[0]
         if EdenFS.__has_attr(addr, *attr):
-            return addr >> 9
+            return addr >> self.addr_shift
         return None
 
     def __set_entry_lba(self, base_lba, entry_offset, lba, *attr):
-        addr = (lba << 9) | reduce(lambda x, y: x | y, attr)
+        addr = (lba << self.addr_shift) | reduce(lambda x, y: x | y, attr)
         packed = struct.pack('I', addr)
         offset = base_lba * BLOCK_SIZE_BYTES + entry_offset + NAME_LEN
         self.dev.write_blocks(offset, data=packed, block_size=1)
@@ -541,7 +1136,7 @@ class EdenFS:
     def __get_entry_attr(self, base_lba, entry_offset):
         offset = base_lba * BLOCK_SIZE_BYTES + entry_offset + NAME_LEN
         addr = self.dev.read_blocks(lba=offset, count=4, block_size=1)
-        return struct.unpack('I', addr)[0] & 0x1FF
+        return struct.unpack('I', addr)[0] & self.attr_mask
 
     def __set_entry_attr(self, base_lba, entry_offset, *attr):
         lba = self.__get_entry_lba(base_lba, entry_offset)
@@ -559,24 +1154,251 @@ class EdenFS:
             self.dev.write_blocks(lba=offset, data=name, block_size=1)
 
     def __get_empty_entry(self, cur_lba):
+        dir_lba = cur_lba
         while True:
             dir_size = self.__get_part_size(cur_lba)
-            if dir_size < DIR_ENTRIES_PER_PART:
-                for entry in xrange(0, DIR_ENTRIES_PER_PART):
-                    entry_offset = entry * DIR_ENTRY_SIZE + DIR_ENTRIES_OFFSET
-                    entry_attr = self.__get_entry_attr(cur_lba, entry_offset)
-                    if not EdenFS.__has_attr(entry_attr, PRESENT):
-                        self.__set_part_size(cur_lba, dir_size + 1)
-                        return cur_lba, entry_offset
-            else:
-                next_part_lba = self.__get_next_part_lba(cur_lba, PRESENT, IS_DIR, NOT_EMPTY)
-                if next_part_lba is None:
-                    return None
-                next_part_lba = self.balloc()
+            for entry in xrange(0, DIR_ENTRIES_PER_PART):
+                entry_offset = entry * DIR_ENTRY_SIZE + DIR_ENTRIES_OFFSET
+                entry_attr = self.__get_entry_attr(cur_lba, entry_offset)
+                # Entries which hold the data of inline files are not empty.
+                if not entry_attr & (PRESENT | INLINE):
+                    self.__set_part_size(cur_lba, dir_size + 1)
+                    self.__update_entry_count(dir_lba, 1)
+                    return cur_lba, entry_offset
+            next_part_lba = self.__get_next_part_lba(cur_lba, PRESENT, IS_DIR, NOT_EMPTY)
+            if next_part_lba is None:
+                next_part_lba = self.__balloc_after(cur_lba)
                 self.__set_next_part_lba(cur_lba, next_part_lba, PRESENT, IS_DIR, NOT_EMPTY)
-                cur_lba = next_part_lba
+            cur_lba = next_part_lba
+
+    def __get_entry_addr(self, base_lba, entry_offset):
+        offset = base_lba * BLOCK_SIZE_BYTES + entry_offset + NAME_LEN
+        return struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+
+    def __get_inline(self, base_lba, entry_offset):
+        owner = (entry_offset - DIR_ENTRIES_OFFSET) / DIR_ENTRY_SIZE
+        chunks = [''] * INLINE_SLOTS
+        for entry in xrange(0, DIR_ENTRIES_PER_PART):
+            offset = entry * DIR_ENTRY_SIZE + DIR_ENTRIES_OFFSET
+            addr = self.__get_entry_addr(base_lba, offset)
+            if addr & (PRESENT | INLINE) == INLINE and (addr >> INLINE_OWNER_SHIFT) & INLINE_OWNER_MASK == owner \
+                    and addr >> INLINE_INDEX_SHIFT < INLINE_SLOTS:
+                chunks[addr >> INLINE_INDEX_SHIFT] = self.__get_entry_name(base_lba, offset)
+        size = self.__get_entry_lba(base_lba, entry_offset)
+        return ''.join(chunk or '\x00' * INLINE_CHUNK for chunk in chunks)[:size]
+
+    def __clear_inline(self, base_lba, entry_offset):
+        owner = (entry_offset - DIR_ENTRIES_OFFSET) / DIR_ENTRY_SIZE
+        for entry in xrange(0, DIR_ENTRIES_PER_PART):
+            offset = entry * DIR_ENTRY_SIZE + DIR_ENTRIES_OFFSET
+            addr = self.__get_entry_addr(base_lba, offset)
+            if addr & (PRESENT | INLINE) == INLINE and (addr >> INLINE_OWNER_SHIFT) & INLINE_OWNER_MASK == owner:
+                self.dev.write_blocks(base_lba * BLOCK_SIZE_BYTES + offset, data='\x00' * DIR_ENTRY_SIZE, block_size=1)
+
+    def __replay_journal(self):
+        journal_lba, journal_blocks = struct.unpack('II', self.dev.read(JOURNAL_LBA_OFFSET, 8))
+        if not journal_lba or journal_blocks < JOURNAL_MIN_BLOCKS:
+            return
+        log_blocks = min(journal_blocks - 1, JOURNAL_MAX_LOG)
+        header = self.dev.read_blocks(lba=journal_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+        if header[:JOURNAL_MAGIC_LEN] != JOURNAL_MAGIC:
+            return
+        first_seq = seq = struct.unpack('I', header[JOURNAL_MAGIC_LEN:JOURNAL_MAGIC_LEN + 4])[0]
+        pos = 0
+        while pos + 1 < log_blocks:
+            desc = self.dev.read_blocks(lba=journal_lba + 1 + pos, count=1, block_size=BLOCK_SIZE_BYTES)
+            desc_seq, count, checksum = struct.unpack('III', desc[JOURNAL_MAGIC_LEN:JOURNAL_MAGIC_LEN + 12])
+            if desc[:JOURNAL_MAGIC_LEN] != JOURNAL_DESC_MAGIC or desc_seq != seq or not count or \
+                    count > JOURNAL_DESC_LBAS or pos + 1 + count > log_blocks:
+                break
+            images = self.dev.read_blocks(lba=journal_lba + 2 + pos, count=count, block_size=BLOCK_SIZE_BYTES)
+            if self.__journal_checksum(images) != checksum:
+                break
+            lbas = struct.unpack('%dI' % count, desc[JOURNAL_MAGIC_LEN + 12:JOURNAL_MAGIC_LEN + 12 + count * 4])
+            for i, lba in enumerate(lbas):
+                self.dev.write_blocks(lba=lba, data=images[i * BLOCK_SIZE_BYTES:(i + 1) * BLOCK_SIZE_BYTES],
+                                      block_size=BLOCK_SIZE_BYTES)
+            pos += 1 + count
+            seq += 1
+        if seq != first_seq:
+            header = header[:JOURNAL_MAGIC_LEN] + struct.pack('I', seq) + header[JOURNAL_MAGIC_LEN + 4:]
+            self.dev.write_blocks(lba=journal_lba, data=header, block_size=BLOCK_SIZE_BYTES)
+
+    @staticmethod
+    def __journal_checksum(images):
+        h = 2166136261
+        for word in struct.unpack('%dI' % (len(images) / 4), images):
+            h = ((h ^ word) * 16777619) & 0xFFFFFFFF
+        return h
+
+    def __get_file_size(self, header_lba):
+        offset = header_lba * BLOCK_SIZE_BYTES + FILE_SIZE_OFFSET
+        return struct.unpack('I', self.dev.read_blocks(lba=offset, count=4, block_size=1))[0]
+
+    def __set_file_size(self, header_lba, size):
+        offset = header_lba * BLOCK_SIZE_BYTES + FILE_SIZE_OFFSET
+        self.dev.write_blocks(lba=offset, data=struct.pack('I', size), block_size=1)
+
+    def __get_extents(self, header_lba):
+        extents = []
+        part_lba = header_lba
+        while part_lba is not None:
+            part = self.dev.read_blocks(lba=part_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+            count = struct.unpack('H', part[:2])[0]
+            for i in xrange(count):
+                offset = EXTENTS_OFFSET + i * EXTENT_SIZE
+                extents.append(list(struct.unpack('III', part[offset:offset + EXTENT_SIZE])))
+            part_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+        return extents
+
+    @staticmethod
+    def __map_block(extents, block):
+        for logical, start, length in extents:
+            if logical <= block < logical + length:
+                return start + block - logical, logical + length - block
+        raise Exception('FS Error', 'Block is not mapped!')
+
+    def __extend_file(self, header_lba, blocks):
+        part_lba = header_lba
+        next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+        while next_lba is not None:
+            part_lba = next_lba
+            next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+        part = self.dev.read_blocks(lba=part_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+        count = struct.unpack('H', part[:2])[0]
+        if count:
+            offset = EXTENTS_OFFSET + (count - 1) * EXTENT_SIZE
+            last = list(struct.unpack('III', part[offset:offset + EXTENT_SIZE]))
+            allocated = last[0] + last[2]
+        else:
+            last = None
+            allocated = 0
+
+        changed = False
+        while allocated < blocks:
+            # Continue the file where it ends on the device.
+            lba = self.balloc(goal=last[1] + last[2] if last is not None else header_lba + 1)
+            changed = True
+            if last is not None and last[1] + last[2] == lba:
+                last[2] += self.cluster_blocks
+            else:
+                if count == EXTENTS_PER_PART:
+                    new_lba = self.__balloc_after(part_lba)
+                    self.dev.write_blocks(lba=part_lba, data=part, block_size=BLOCK_SIZE_BYTES)
+                    self.__set_next_part_lba(part_lba, new_lba, PRESENT, NOT_EMPTY)
+                    part_lba = new_lba
+                    part = self.dev.read_blocks(lba=part_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+                    count = 0
+                count += 1
+                last = [allocated, lba, self.cluster_blocks]
+            offset = EXTENTS_OFFSET + (count - 1) * EXTENT_SIZE
+            part = struct.pack('H', count) + part[2:offset] + struct.pack('III', *last) + part[offset + EXTENT_SIZE:]
+            allocated += self.cluster_blocks
+        if changed:
+            self.dev.write_blocks(lba=part_lba, data=part, block_size=BLOCK_SIZE_BYTES)
+
+    def __delete_extents(self, header_lba):
+        shared = self.__get_extent_flags(header_lba) & EXTENT_SHARED
+        for logical, start, length in self.__get_extents(header_lba):
+            for lba in xrange(start, start + length):
+                if shared and self.__get_refcount(lba):
+                    self.__add_refcount(lba, -1)
+                else:
+                    self.bfree(lba)
+        if self.__get_extent_flags(header_lba) & EXTENT_COMPRESSED:
+            self.__delete_extent_parts(self.__get_frame_index(header_lba))
+        self.__delete_extent_parts(header_lba)
+
+    def __get_extent_flags(self, header_lba):
+        offset = header_lba * BLOCK_SIZE_BYTES + EXTENT_FLAGS_OFFSET
+        return struct.unpack('H', self.dev.read_blocks(lba=offset, count=2, block_size=1))[0]
+
+    def __set_extents(self, header_lba, extents):
+        part_lba = header_lba
+        kept = set()
+        while True:
+            kept.add(part_lba / self.cluster_blocks)
+            part = self.dev.read_blocks(lba=part_lba, count=1, block_size=BLOCK_SIZE_BYTES)
+            chunk = extents[:EXTENTS_PER_PART]
+            extents = extents[EXTENTS_PER_PART:]
+            data = struct.pack('H', len(chunk)) + part[2:EXTENTS_OFFSET]
+            data += ''.join(struct.pack('III', *extent) for extent in chunk)
+            # The frame index of a compressed file follows the extents of its header.
+            data += '\x00' * (FRAME_INDEX_OFFSET - len(data)) + part[FRAME_INDEX_OFFSET:]
+            self.dev.write_blocks(lba=part_lba, data=data, block_size=BLOCK_SIZE_BYTES)
+            next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+            if not extents:
+                if next_lba is not None:
+                    self.__set_next_part_lba(part_lba, 0)
+                    self.__delete_extent_parts(next_lba, kept)
+                return
+            if next_lba is None:
+                next_lba = self.__balloc_after(part_lba)
+                self.__set_next_part_lba(part_lba, next_lba, PRESENT, NOT_EMPTY)
+            part_lba = next_lba
+
+    def __delete_extent_parts(self, part_lba, kept=()):
+        while part_lba is not None:
+            next_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
+            # A cluster which holds parts that are kept is not freed.
+            if part_lba / self.cluster_blocks not in kept:
+                self.bfree(part_lba)
+            part_lba = next_lba
+
+    def __unshare_blocks(self, header_lba, seek, end):
+        extents = self.__get_extents(header_lba)
+        changed = False
+        # Whole clusters are copied, so the blocks of a cluster always have the same owners.
+        first = seek / BLOCK_SIZE_BYTES / self.cluster_blocks * self.cluster_blocks
+        for block in xrange(first, (end + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES, self.cluster_blocks):
+            lba, run = EdenFS.__map_block(extents, block)
+            if not self.__get_refcount(lba):
+                continue
+            new_lba = self.balloc(clear=False, goal=lba)
+            data = self.dev.read_blocks(lba=lba, count=self.cluster_blocks, block_size=BLOCK_SIZE_BYTES)
+            self.dev.write_blocks(lba=new_lba, data=data, block_size=BLOCK_SIZE_BYTES)
+            for i in xrange(self.cluster_blocks):
+                self.__add_refcount(lba + i, -1)
+            extents = EdenFS.__remap_block(extents, block, new_lba, self.cluster_blocks)
+            changed = True
+        if changed:
+            self.__set_extents(header_lba, extents)
+
+    @staticmethod
+    def __remap_block(extents, block, lba, count=1):
+        remapped = []
+        for logical, start, length in extents:
+            if logical <= block < logical + length:
+                pieces = [[logical, start, block - logical], [block, lba, count],
+                          [block + count, start + block + count - logical, logical + length - block - count]]
+            else:
+                pieces = [[logical, start, length]]
+            for piece in pieces:
+                if not piece[2]:
+                    continue
+                if remapped and remapped[-1][0] + remapped[-1][2] == piece[0] and \
+                        remapped[-1][1] + remapped[-1][2] == piece[1]:
+                    remapped[-1][2] += piece[2]
+                else:
+                    remapped.append(piece)
+        return remapped
+
+    def __get_refcount(self, lba):
+        refcount_lba, refcount_blocks = struct.unpack('II', self.dev.read(REFCOUNT_LBA_OFFSET, 8))
+        if not refcount_lba or lba / BLOCK_SIZE_BYTES >= refcount_blocks:
+            return 0
+        return struct.unpack('B', self.dev.read_blocks(lba=refcount_lba * BLOCK_SIZE_BYTES + lba, count=1,
+                                                       block_size=1))[0]
+
+    def __add_refcount(self, lba, delta):
+        refcount_lba, refcount_blocks = struct.unpack('II', self.dev.read(REFCOUNT_LBA_OFFSET, 8))
+        count = min(max(self.__get_refcount(lba) + delta, 0), REFCOUNT_MAX)
+        self.dev.write_blocks(lba=refcount_lba * BLOCK_SIZE_BYTES + lba, data=struct.pack('B', count), block_size=1)
 
     def __delete_part_chain(self, part_lba, part_attr):
+        if self.version >= VERSION_EXTENTS and not EdenFS.__has_attr(part_attr, IS_DIR):
+            self.__delete_extents(part_lba)
+            return
         next_part_lba = self.__get_next_part_lba(part_lba, PRESENT, NOT_EMPTY)
         next_part_attr = self.__get_next_part_attr(part_lba)
         if next_part_lba is not None:
@@ -606,6 +1428,9 @@ class File:
 
         if fmt == 'w':
             self.entry_data = fs.create(path)
+        elif fmt == 'z':
+            self.entry_data = fs.create(path)
+            fs.make_compressed(self.entry_data)
         else:
             found = self.fs.find_path(path, PRESENT)
             if found is None:
@@ -17,7 +17,7 @@ READ_LEN = 1024
 BLOCK_SIZE = 512
 RECV_LEN = 1024
 
-EDENFS_DATA_START = 488
+EDENFS_DATA_START = 468
 EDENFS_DATA_END = 506
 EDENFS_DATA_LEN = EDENFS_DATA_END - EDENFS_DATA_START
 # endregion
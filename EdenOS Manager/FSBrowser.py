@@ -154,13 +154,15 @@ class FSBrowser:
             print 'import\tIMPORT A FILE'
             return
         if help:
-            print 'import -eEX_PATH -iIN_PATH\n' \
+            print 'import -eEX_PATH -iIN_PATH [-z]\n' \
                   '\tEX_PATH\t:\tTHE PATH OF THE FILE TO IMPORT (IN THE LOCAL FS)\n' \
-                  '\tIN_PATH\t:\tTHE PATH OF THE FILE IN EDENFS (IN EDENFS)'
+                  '\tIN_PATH\t:\tTHE PATH OF THE FILE IN EDENFS (IN EDENFS)\n' \
+                  '\t-z\t:\tKEEP THE FILE COMPRESSED'
             return
 
         ex_path = None
         in_path = None
+        compress = False
 
         for arg in args:
             if arg.startswith('-e'):
@@ -179,10 +181,12 @@ class FSBrowser:
                 if not self.fs.is_path(path, is_dir=True):
                     print 'EdenFS path does not exist!'
                     return
+            elif arg == '-z':
+                compress = True
         if ex_path is None or in_path is None:
             print 'Illegal format. Type "help import" for more information.'
 
-        self.fs.import_file(ex_path, in_path)
+        self.fs.import_file(ex_path, in_path, compress)
 
     def __cmd_export(self, args, desc=False, help=False):
         if desc:
@@ -223,11 +227,16 @@ class FSBrowser:
             print 'format\tFORMAT EDENFS'
             return
         if help:
-            print 'format [-rROOT]\n' \
-                  '\tROOT\t:\tTHE PATH OF THE DIRECTORY TO BE USED AS ROOT'
+            print 'format [-rROOT] [-v1 | -v3] [-cSIZE]\n' \
+                  '\tROOT\t:\tTHE PATH OF THE DIRECTORY TO BE USED AS ROOT\n' \
+                  '\t-v1\t:\tUSE THE CHAINED FILE LAYOUT OF OLDER KERNELS\n' \
+                  '\t-v3\t:\tUSE THE WIDE ADDRESSES OF DEVICES LARGER THAN 4 GB\n' \
+                  '\tSIZE\t:\tTHE CLUSTER SIZE IN BYTES (512, 1024, 2048 OR 4096)'
             return
 
         root_dir = None
+        version = None
+        cluster_blocks = 1
         for arg in args:
             if arg.startswith('-r'):
                 if os.path.isdir(arg[2:]):
@@ -235,8 +244,24 @@ class FSBrowser:
                 else:
                     print 'Root path does not exist!'
                     return
+            elif arg == '-v1':
+                version = VERSION_CHAINS
+            elif arg == '-v3':
+                version = VERSION_WIDE
+            elif arg.startswith('-c'):
+                if not arg[2:].isdigit() or int(arg[2:]) / BLOCK_SIZE_BYTES not in CLUSTER_BLOCKS_OPTIONS \
+                        or int(arg[2:]) % BLOCK_SIZE_BYTES:
+                    print 'Illegal cluster size!'
+                    return
+                cluster_blocks = int(arg[2:]) / BLOCK_SIZE_BYTES
 
-        self.fs.format_edenfs()
+        if version is None:
+            # Devices larger than the narrow addresses reach get the wide ones.
+            if self.fs.dev.size / BLOCK_SIZE_BYTES >> (32 - ADDR_SHIFT_NARROW):
+                version = VERSION_WIDE
+            else:
+                version = VERSION_EXTENTS
+        self.fs.format_edenfs(version=version, cluster_blocks=cluster_blocks)
         if root_dir:
             self.fs.import_dir(root_dir, '/')
 
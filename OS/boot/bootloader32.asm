@@ -87,6 +87,12 @@ pmode:
 
 
 ; -------------------- END ---------------------
+times 468-($-$$) db 0
+dd 0 ; Cluster size in blocks (set by the EdenFS format)
+dd 0 ; Reference count map LBA (set by the EdenFS format)
+dd 0 ; Reference count map blocks
+dd 0 ; Journal LBA (set by the EdenFS format)
+dd 0 ; Journal blocks
 times 506-($-$$) db 0
 dd 100
 dw 0xAA55
\ No newline at end of file
@@ -42,6 +42,8 @@
 
 #define BLOCK_LEN   512
 
+#define MAX_TRANSFER_TDS 124
+
 // STRUCTURES
 
 typedef struct command_block_wrapper {
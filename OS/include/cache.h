@@ -0,0 +1,49 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define PAGE_SIZE  4096
+
+#define CACHE_BLOCKS  64
+#define CACHE_HASH_SIZE  32
+#define CACHE_BLOCK_SIZE 512
+
+#define CACHE_VALID  (1 << 0)
+#define CACHE_DIRTY  (1 << 1)
+#define CACHE_JOURNALED  (1 << 2)
+
+#define CACHE_HASH(block) ((block) % CACHE_HASH_SIZE)
+
+// STRUCTURES
+
+typedef struct cache_entry {
+    UHCIDevice *dev;
+    uint32_t block;
+    uint32_t flags;
+    void *data;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    struct cache_entry *hash_next;
+} __attribute__((packed)) CacheEntry;
+
+// FUNCTION DECLARATIONS
+
+void init_cache(void);
+int read_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
+int write_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
+int prefetch_cache(UHCIDevice *dev, uint32_t block, uint32_t count);
+int sync_cache(void);
+int commit_cache(void);
+int checkpoint_cache(void);
+int write_back_cache(uint32_t mask);
+uint32_t count_dirty_cache(void);
+void print_cache_stats(void);
+CacheEntry *find_cache_entry(UHCIDevice *dev, uint32_t block);
+CacheEntry *get_cache_entry(UHCIDevice *dev, uint32_t block, int *status);
+int evict_cache_entry(CacheEntry *entry);
+void touch_cache_entry(CacheEntry *entry);
+
+#endif /* CACHE_H */
@@ -44,6 +44,11 @@ void change_dir_cmd(int argc, char **args, int call_type);
 void read_cmd(int argc, char **args, int call_type);
 void delete_cmd(int argc, char **args, int call_type);
 void make_dir_cmd(int argc, char **args, int call_type);
+void sync_cmd(int argc, char **args, int call_type);
+void cache_stats_cmd(int argc, char **args, int call_type);
+void move_cmd(int argc, char **args, int call_type);
+void clone_cmd(int argc, char **args, int call_type);
+void defrag_cmd(int argc, char **args, int call_type);
 
 // FUNCTION DECLARATIONS
 
@@ -0,0 +1,40 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define DCACHE_ENTRIES  64
+#define DCACHE_HASH_SIZE  32
+#define DENTRY_NAME_LEN  12
+
+#define DENTRY_VALID  (1 << 0)
+#define DENTRY_NEGATIVE  (1 << 1)
+
+// STRUCTURES
+
+typedef struct dentry {
+    uint32_t dir_lba;
+    char name[DENTRY_NAME_LEN];
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t flags;
+    struct dentry *hash_next;
+} __attribute__((packed)) Dentry;
+
+// FUNCTION DECLARATIONS
+
+void init_dcache(void);
+int find_dentry(uint32_t dir_lba, const char *name, Dentry *found);
+void add_dentry(uint32_t dir_lba, const char *name, uint32_t base_lba, uint32_t offset);
+void add_negative_dentry(uint32_t dir_lba, const char *name, uint32_t scan_stamp);
+uint32_t dcache_stamp(void);
+void drop_dentry_at(uint32_t base_lba, uint32_t offset);
+void flush_dcache(void);
+void print_dcache_stats(void);
+Dentry *get_dentry(uint32_t dir_lba, const char *name);
+void unlink_dentry(Dentry *dentry);
+uint32_t dentry_hash(uint32_t dir_lba, const char *name);
+
+#endif /* DCACHE_H */
@@ -6,17 +6,77 @@
 // DEFINITIONS
 
 #define EDENFS_SIGN_LEN  9
+#define EDENFS_SIGN_V1  "EDENFS100"
+#define EDENFS_SIGN_V2  "EDENFS200"
+#define EDENFS_SIGN_V3  "EDENFS300"
+
+#define FS_VERSION_CHAINS  1
+#define FS_VERSION_EXTENTS  2
+#define FS_VERSION_WIDE  3
 #define BITMAP_SIZE   4096
 
 #define BLOCK_SIZE   512
+#define PAGE_SIZE   4096
+#define FS_RUN_BLOCKS  (PAGE_SIZE / BLOCK_SIZE)
+#define CLUSTER_BLOCKS_MAX  FS_RUN_BLOCKS
+
+#define READ_AHEAD_MIN  FS_RUN_BLOCKS
+#define READ_AHEAD_MAX  (2 * FS_RUN_BLOCKS)
+
+#define FREE_UNKNOWN   0xFFFF
+#define COUNTS_PER_PAGE  (PAGE_SIZE / sizeof (uint16_t))
 
 #define PRESENT    (1 << 0)
 #define IS_DIR    (1 << 1)
 #define NOT_EMPTY    (1 << 2) 
+#define INLINE    (1 << 3)
+
+#define ADDR_SHIFT_NARROW  9
+#define ADDR_SHIFT_WIDE  4
+
+#define INLINE_OWNER_SHIFT  4
+#define INLINE_OWNER_MASK  0x1F
+#define INLINE_OWNER(addr)  (((addr) >> INLINE_OWNER_SHIFT) & INLINE_OWNER_MASK)
+#define INLINE_INDEX_SHIFT  9
+
+#define DIR_COUNT_VALID  0x8000
+#define DIR_COUNT_MASK  0x7FFF
+
+#define NAME_FILTER_LEN  8
+#define NAME_FILTER_BITS  (NAME_FILTER_LEN * 8)
 
 #define NAME_LEN    11
 #define DIR_ENTRIES_PER_PART 31
 #define FILE_DATA_PER_PART  506
+#define EXTENTS_PER_PART  41
+
+#define INLINE_CHUNK  (NAME_LEN + 1)
+#define INLINE_SLOTS  8
+#define INLINE_MAX  (INLINE_SLOTS * INLINE_CHUNK)
+
+#define EXTENT_SHARED  (1 << 0)
+#define EXTENT_COMPRESSED  (1 << 1)
+
+#define FRAME_SIZE  PAGE_SIZE
+#define FRAMES_PER_PART  126
+#define FRAME_HEADER_SIZE  2
+#define FRAME_BLOCKS_MASK  0xF
+#define FRAME_STORED  (1 << 4)
+#define FRAME_START_SHIFT  5
+#define FRAME_DEAD_MAX  0xFFFF
+#define FRAME_HOLE_WINDOW  (PAGE_SIZE * 8)
+
+#define DIR_WALK_DEPTH  32
+#define DEFRAG_WAIT_TICKS  64
+#define DEFRAG_AGAIN  2
+#define FS_EXCLUSIVE  3
+#define FREE_BATCH_RANGES  511
+
+#define DIR_LOCKS  32
+#define FILE_LOCKS  32
+#define LOCK_READ  0
+#define LOCK_WRITE  1
+#define FILE_LOCK_KEY(base_lba, offset)  (((base_lba) << 5) | (offset))
 
 #define TYPE_UNDEFINED   0
 #define TYPE_DIR    1
@@ -32,7 +92,8 @@ typedef struct dir_entry {
 typedef struct dir_part {
     uint16_t part_size;
     DirEntry entry[31];
-    uint8_t reserved[10];
+    uint16_t entry_count;
+    uint8_t name_filter[NAME_FILTER_LEN];
     uint32_t next_part;
 } __attribute__((packed)) DirPart;
 
@@ -42,8 +103,36 @@ typedef struct file_part {
     uint32_t next_part;
 } __attribute__((packed)) FilePart;
 
+typedef struct extent {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+} __attribute__((packed)) Extent;
+
+typedef struct extent_part {
+    uint16_t part_size;
+    uint16_t flags;
+    uint32_t size;
+    Extent extent[EXTENTS_PER_PART];
+    uint32_t frame_index;
+    uint32_t frame_end;
+    uint32_t next_part;
+} __attribute__((packed)) ExtentPart;
+
+typedef struct frame_part {
+    uint16_t part_size;
+    uint16_t dead_blocks;
+    uint32_t frame[FRAMES_PER_PART];
+    uint32_t next_part;
+} __attribute__((packed)) FramePart;
+
 typedef struct boot_sect {
-    uint8_t boot_code[488];
+    uint8_t boot_code[468];
+    uint32_t cluster_blocks;
+    uint32_t refcount_lba;
+    uint32_t refcount_blocks;
+    uint32_t journal_lba;
+    uint32_t journal_blocks;
     uint32_t block_count;
     char sign[EDENFS_SIGN_LEN];
     uint8_t levels;
@@ -57,45 +146,207 @@ typedef struct level_node {
     struct level_node *next;
 } __attribute__((packed)) LevelNode;
 
-typedef struct path_part {
-    char name[NAME_LEN + 1];
-    struct path_part *next;
-} __attribute__((packed)) PathPart;
-
 typedef struct file {
     uint32_t base_lba;
     uint32_t offset;
     uint32_t r_seek;
     uint32_t w_seek;
+    uint32_t r_lba;
+    uint32_t r_pos;
+    uint32_t w_lba;
+    uint32_t w_pos;
+    uint32_t m_block;
+    uint32_t m_lba;
+    uint32_t m_run;
+    uint32_t m_gen;
+    uint32_t ra_next;
+    uint32_t ra_window;
+    uint32_t ra_end;
+    char *w_buff;
+    uint32_t wb_seek;
+    uint32_t wb_len;
+    char mode;
+    uint32_t dir_lba;
+    LockSlot *lock;
 } __attribute__((packed)) File;
 
+typedef struct dir_level {
+    uint32_t part_lba;
+    uint32_t index;
+} __attribute__((packed)) DirLevel;
+
+typedef struct dir {
+    int tree;
+    uint32_t depth;
+    uint32_t descend;
+    uint32_t part_lba;
+    uint32_t index;
+    DirLevel stack[DIR_WALK_DEPTH];
+    DirPart part;
+} __attribute__((packed)) Dir;
+
+typedef struct free_range {
+    uint32_t start;
+    uint32_t count;
+} __attribute__((packed)) FreeRange;
+
+typedef struct free_batch {
+    uint32_t count;
+    uint32_t reserved;
+    FreeRange range[FREE_BATCH_RANGES];
+} __attribute__((packed)) FreeBatch;
+
+typedef struct frag_stats {
+    uint32_t files;
+    uint32_t fragmented;
+    uint32_t fragments;
+} __attribute__((packed)) FragStats;
+
+typedef struct dir_item {
+    char name[NAME_LEN + 1];
+    uint32_t addr;
+    uint32_t level;
+    uint32_t part_lba;
+    uint32_t offset;
+} __attribute__((packed)) DirItem;
+
 // FUNCTION DECLARATIONS
 
 void init_fs(UHCIDevice *dev);
 File *open(char *path, uint32_t len, char mode);
+int open_path(char *path, uint32_t len, File *f);
+int seek_to_end(File *f);
+int find_tail_part(uint32_t lba, uint32_t *tail_lba, uint32_t *tail_pos, uint32_t *size);
 void list(char *path, uint32_t len, int tree, int size);
-void _list(uint32_t lba, int tree, int size, uint32_t level);
+Dir *opendir(char *path, uint32_t len, int tree);
+int find_dir_lba(char *path, uint32_t len, uint32_t *lba);
+Dir *open_dir_at(uint32_t lba, int tree);
+int readdir(Dir *d, DirItem *item);
+void closedir(Dir *d);
+void print_dir_item(DirItem *item, int tree, int size);
 uint32_t get_size(uint32_t part_lba);
+uint32_t get_file_size(uint32_t lba);
+uint32_t get_dir_size(uint32_t lba);
+void update_dir_size(uint32_t lba, int delta);
+int find_parent_dir(char *path, uint32_t len, uint32_t *dir_lba);
+uint32_t get_parent_len(char *path, uint32_t len);
 int create(char *path, uint32_t len, int target_type);
+int create_path(char *path, uint32_t len, int target_type, File *f);
+int _create(char *path, uint32_t len, int target_type);
+int fill_parent_dir(char *path, uint32_t len);
 void delete(char *path, uint32_t len);
+int delete_path(char *path, uint32_t len);
+void _delete(char *path, uint32_t len);
+int rename(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int _rename(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int clone(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int _clone(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int share_extents(uint32_t lba, uint32_t *copy_lba);
 uint32_t read_from_file(File *f, uint32_t count,
         char *data);
+uint32_t read_from_parts(File *f, uint32_t count, char *data);
+void read_ahead(File *f, uint32_t count, uint32_t total);
 void write_to_file(File *f, char *data, uint32_t count);
+void write_through(File *f, char *data, uint32_t count);
+void flush(File *f);
+void close(File *f);
+int is_inline(File *f);
+uint32_t read_inline(File *f, uint32_t count, char *data);
+int write_inline(File *f, char *data, uint32_t count);
+void spill_inline(File *f);
+uint32_t load_inline(DirPart *dir, uint32_t offset, char *buff);
+int store_inline(DirPart *dir, uint32_t offset, char *buff, uint32_t size);
+void clear_inline(DirPart *dir, uint32_t offset);
+void copy_inline(uint32_t base_lba, uint32_t offset, char *buff, uint32_t size);
+void write_to_parts(File *f, char *data, uint32_t count);
+uint32_t read_from_extents(File *f, uint32_t count, char *data);
+void write_to_extents(File *f, char *data, uint32_t count);
+uint32_t get_file_lba(File *f);
+uint32_t map_file_block(File *f, uint32_t header_lba, uint32_t block, uint32_t *run);
+void check_cursors(File *f);
+uint32_t map_block(uint32_t header_lba, uint32_t block, uint32_t *run);
+int extend_file(uint32_t header_lba, uint32_t blocks, uint32_t keep_from, uint32_t keep_to);
+void zero_blocks(uint32_t lba, uint32_t logical, uint32_t count, uint32_t keep_from,
+        uint32_t keep_to);
+int unshare_blocks(uint32_t header_lba, uint32_t seek, uint32_t end);
+int remap_extent(uint32_t header_lba, uint32_t block, uint32_t count, uint32_t lba);
+int make_compressed(File *f);
+int is_compressed(uint32_t header_lba);
+uint32_t read_from_frames(File *f, uint32_t header_lba, uint32_t count, char *data);
+void write_to_frames(File *f, uint32_t header_lba, char *data, uint32_t count);
+int load_frame(File *f, uint32_t header_lba, uint32_t frame, char *buff);
+int store_frame(uint32_t header_lba, uint32_t frame, char *buff, uint32_t len);
+uint32_t get_frame(uint32_t header_lba, uint32_t frame);
+int set_frame(uint32_t header_lba, uint32_t frame, uint32_t entry);
+uint32_t get_dead_blocks(uint32_t header_lba);
+void add_dead_blocks(uint32_t header_lba, uint32_t freed, uint32_t used);
+uint32_t find_frame_hole(uint32_t header_lba, uint32_t frame, uint32_t blocks, uint32_t end);
+uint32_t copy_frame_index(uint32_t lba, uint32_t goal);
+uint32_t prefetch_frames(File *f, uint32_t header_lba, uint32_t frame, uint32_t count);
+void prefetch_blocks(File *f, uint32_t header_lba, uint32_t block, uint32_t count);
+void begin_fs_op(void);
+void end_fs_op(void);
+void mark_fs_changed(void);
+void hold_fs(void);
+void release_fs(void);
+void begin_excl_fs_op(void);
+LockSlot *lock_dir(uint32_t dir_lba, int write);
+void unlock_dir(LockSlot *slot, int write);
+int lock_parent_dir(char *path, uint32_t len, int write, uint32_t *dir_lba, LockSlot **slot);
+void lock_dir_pair(uint32_t first_lba, int first_write, uint32_t second_lba, int second_write,
+        LockSlot **first, LockSlot **second);
+void unlock_dir_pair(LockSlot *first, int first_write, LockSlot *second, int second_write);
+LockSlot *try_lock_file(uint32_t base_lba, uint32_t offset, int write);
+void wait_file(uint32_t base_lba, uint32_t offset, int write);
+int is_file_open(uint32_t base_lba, uint32_t offset);
+int is_tree_open(uint32_t lba);
+int is_path_open(char *path, uint32_t len);
+void unlock_file(LockSlot *slot, int write);
+int defrag(char *path, uint32_t len);
+int defrag_path(char *path, uint32_t len, FragStats *stats, int move);
+int defrag_tree(uint32_t lba, FragStats *stats, int move);
+int defrag_entry(uint32_t base_lba, uint32_t offset, FragStats *stats, int move);
+uint32_t count_chain_fragments(uint32_t lba, uint32_t *parts);
+uint32_t count_extent_fragments(uint32_t lba, uint32_t *blocks);
+int move_chain(uint32_t base_lba, uint32_t offset, uint32_t parts);
+int move_extents(uint32_t header_lba, uint32_t blocks);
+void print_frag_stats(FragStats *stats);
 
 int is_path(char *path, uint32_t len, int target_type, int not_empty);
+int sync_fs(void);
 int find_path(char *path, uint32_t len, int target_type, int not_empty,
         uint32_t *base_lba, uint32_t *offset);
 int find_in_dir(uint32_t cur_lba, const char *name, uint32_t len, int target_type, int not_empty,
         uint32_t *base_lba, uint32_t *offset);
-PathPart *to_path_parts(char *path, uint32_t len);
-void free_path_parts(PathPart *first);
+uint32_t next_path_part(char *path, uint32_t len, uint32_t *pos, char *name);
+uint32_t name_hash(const char *name);
+void update_name_filter(DirPart *dir);
+int may_contain_name(DirPart *dir, uint32_t hash);
 
 void find_empty_entry(uint32_t dir_lba,
         uint32_t *base_lba, uint32_t *offset);
-void delete_chain_parts(uint32_t lba);
-uint32_t balloc(void);
+void free_entry_parts(uint32_t addr);
+void collect_entry_blocks(FreeBatch *batch, uint32_t addr);
+void collect_tree_blocks(FreeBatch *batch, uint32_t lba);
+void collect_chain_blocks(FreeBatch *batch, uint32_t lba);
+void collect_extent_blocks(FreeBatch *batch, uint32_t lba);
+void collect_shared_blocks(FreeBatch *batch, uint32_t start, uint32_t count);
+void add_free_range(FreeBatch *batch, uint32_t start, uint32_t count);
+void apply_frees(FreeBatch *batch);
+uint32_t balloc(uint32_t goal);
+uint32_t balloc_after(uint32_t lba);
+uint32_t balloc_n(uint32_t count, uint32_t hint, uint32_t *allocated);
+uint32_t alloc_from_leaf(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len);
+uint32_t find_free_run(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len);
+uint32_t find_free_run_back(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len);
 void bfree(uint32_t lba);
-uint32_t find_in_level(uint8_t level, uint32_t base_lba, uint32_t offset, LevelNode *level_node);
+void load_bitmap_summary(void);
+uint32_t get_leaf_free(uint32_t leaf);
+void set_leaf_free(uint32_t leaf, uint32_t count);
+void update_upper_levels(uint32_t cluster, int full);
 
 char *join_path(char *first, char *second);
 char *get_full_path(char *s);
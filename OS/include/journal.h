@@ -0,0 +1,59 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define PAGE_SIZE  4096
+
+#define JOURNAL_BLOCK_SIZE  512
+#define JOURNAL_PAGE_BLOCKS  (PAGE_SIZE / JOURNAL_BLOCK_SIZE)
+#define JOURNAL_MAGIC_LEN  8
+#define JOURNAL_MAGIC  "EDENJRNL"
+#define JOURNAL_DESC_MAGIC  "EDENDESC"
+#define JOURNAL_DESC_LBAS  123
+
+#define JOURNAL_MIN_BLOCKS  16
+#define JOURNAL_MAX_LOG  255
+#define JOURNAL_COMMIT_DIRTY  32
+// A descriptor and every block of the cache.
+#define JOURNAL_MIN_LOG  65
+
+#define FNV_OFFSET_BASIS  2166136261u
+#define FNV_PRIME  16777619u
+
+// STRUCTURES
+
+typedef struct journal_header {
+    char magic[JOURNAL_MAGIC_LEN];
+    uint32_t seq;
+    uint8_t reserved[500];
+} __attribute__((packed)) JournalHeader;
+
+typedef struct journal_desc {
+    char magic[JOURNAL_MAGIC_LEN];
+    uint32_t seq;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t lba[JOURNAL_DESC_LBAS];
+} __attribute__((packed)) JournalDesc;
+
+// FUNCTION DECLARATIONS
+
+int init_journal(UHCIDevice *dev, uint32_t lba, uint32_t blocks);
+int journal_active(UHCIDevice *dev);
+uint32_t journal_room(void);
+int journal_commit(uint32_t count, uint32_t *lbas, void **images);
+int journal_reset(void);
+int journal_logged(UHCIDevice *dev, uint32_t block, uint32_t count);
+uint32_t journal_image(uint32_t block);
+void journal_begin(void);
+void journal_end(void);
+void journal_hold(void);
+int journal_try_hold(void);
+void journal_release(void);
+int replay_journal(UHCIDevice *dev, JournalHeader *header);
+uint32_t journal_checksum(uint32_t hash, void *image);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,38 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define LOCK_WAIT_TICKS  1
+
+// STRUCTURES
+
+typedef struct rw_lock {
+    uint32_t readers;
+    uint32_t writers;
+    struct thread_node *owner;
+    uint32_t depth;
+} __attribute__((packed)) RWLock;
+
+typedef struct lock_slot {
+    uint32_t key;
+    uint32_t users;
+    RWLock lock;
+} __attribute__((packed)) LockSlot;
+
+// FUNCTION DECLARATIONS
+
+void init_rwlock(RWLock *l);
+void read_lock(RWLock *l);
+void read_unlock(RWLock *l);
+void write_lock(RWLock *l);
+void write_unlock(RWLock *l);
+int try_read_lock(RWLock *l);
+int try_write_lock(RWLock *l);
+LockSlot *pin_lock(LockSlot *table, uint32_t count, uint32_t key);
+LockSlot *try_pin_lock(LockSlot *table, uint32_t count, uint32_t key);
+void unpin_lock(LockSlot *slot);
+
+#endif /* LOCK_H */
@@ -0,0 +1,24 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define LZ4_MIN_MATCH  4
+#define LZ4_LAST_LITERALS  5
+#define LZ4_MATCH_LIMIT  12
+#define LZ4_MAX_OFFSET  0xFFFF
+#define LZ4_RUN_MASK  0xF
+#define LZ4_HASH_BITS  11
+#define LZ4_TABLE_SIZE  ((1 << LZ4_HASH_BITS) * sizeof (uint16_t))
+
+// FUNCTION DECLARATIONS
+
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max);
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len);
+uint32_t lz4_put_length(uint8_t *dst, uint32_t pos, uint32_t max, uint32_t len);
+uint32_t lz4_read32(const uint8_t *p);
+uint32_t lz4_hash(uint32_t seq);
+
+#endif /* LZ4_H */
@@ -0,0 +1,19 @@
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#include <system.h>
+
+// DEFINITIONS
+
+#define REFCOUNT_BLOCK_SIZE  512
+#define REFCOUNT_MAX  255
+
+// FUNCTION DECLARATIONS
+
+void init_refcount(UHCIDevice *dev, uint32_t lba, uint32_t blocks);
+int refcount_active(void);
+uint32_t refcount_run(uint32_t lba, uint32_t count, int *shared);
+int refcount_full(uint32_t lba, uint32_t count);
+int add_refcount(uint32_t lba, uint32_t count, int delta);
+
+#endif /* REFCOUNT_H */
@@ -26,7 +26,8 @@
 enum ERR_TYPE {
     KERNEL_INTERNAL_PARAMS = 0x01,
     UNSUPPORTED = 0x02,
-    USB_TD_ERROR = 0x10
+    USB_TD_ERROR = 0x10,
+    CACHE_FULL = 0x20
 };
 
 enum BASE {
@@ -139,6 +140,7 @@ uint32_t dup_dir(uint32_t new_dir, uint32_t ori_dir);
 #endif
 
 #ifndef PROCESSING_H
+typedef struct thread_node ThreadNode;
 void init_processing(void);
 unsigned int switch_proc(void);
 int new_thread(const char *name, uint32_t **status);
@@ -147,9 +149,34 @@ void wait(uint32_t *status);
 void print_proc_data(int with_pid, int with_ppid, int with_status, int with_threads, int with_tid, int with_tstatus);
 void set_idle(void);
 void set_active(void);
+ThreadNode *get_current_thread(void);
 void kill_th(uint32_t pid, uint32_t tid);
 #endif
 
+#ifndef LOCK_H
+typedef struct rw_lock {
+    uint32_t readers;
+    uint32_t writers;
+    struct thread_node *owner;
+    uint32_t depth;
+} __attribute__((packed)) RWLock;
+typedef struct lock_slot {
+    uint32_t key;
+    uint32_t users;
+    RWLock lock;
+} __attribute__((packed)) LockSlot;
+void init_rwlock(RWLock *l);
+void read_lock(RWLock *l);
+void read_unlock(RWLock *l);
+void write_lock(RWLock *l);
+void write_unlock(RWLock *l);
+int try_read_lock(RWLock *l);
+int try_write_lock(RWLock *l);
+LockSlot *pin_lock(LockSlot *table, uint32_t count, uint32_t key);
+LockSlot *try_pin_lock(LockSlot *table, uint32_t count, uint32_t key);
+void unpin_lock(LockSlot *slot);
+#endif
+
 #ifndef PCI_H
 void pci_cfg_write_b(uint8_t bus_num, uint8_t dev_num, uint8_t func_num, uint8_t reg_num, uint8_t val);
 void pci_cfg_write_w(uint8_t bus_num, uint8_t dev_num, uint8_t func_num, uint8_t reg_num, uint16_t val);
@@ -241,6 +268,69 @@ int read_bbb(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
 int write_bbb(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
 #endif
 
+#ifndef CACHE_H
+void init_cache(void);
+int read_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
+int write_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr);
+int prefetch_cache(UHCIDevice *dev, uint32_t block, uint32_t count);
+int sync_cache(void);
+int commit_cache(void);
+int checkpoint_cache(void);
+uint32_t count_dirty_cache(void);
+void print_cache_stats(void);
+#endif
+
+#ifndef JOURNAL_H
+#define JOURNAL_DESC_LBAS  123
+int init_journal(UHCIDevice *dev, uint32_t lba, uint32_t blocks);
+int journal_active(UHCIDevice *dev);
+uint32_t journal_room(void);
+int journal_commit(uint32_t count, uint32_t *lbas, void **images);
+int journal_reset(void);
+int journal_logged(UHCIDevice *dev, uint32_t block, uint32_t count);
+uint32_t journal_image(uint32_t block);
+void journal_begin(void);
+void journal_end(void);
+void journal_hold(void);
+int journal_try_hold(void);
+void journal_release(void);
+#endif
+
+#ifndef REFCOUNT_H
+void init_refcount(UHCIDevice *dev, uint32_t lba, uint32_t blocks);
+int refcount_active(void);
+uint32_t refcount_run(uint32_t lba, uint32_t count, int *shared);
+int refcount_full(uint32_t lba, uint32_t count);
+int add_refcount(uint32_t lba, uint32_t count, int delta);
+#endif
+
+#ifndef LZ4_H
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max);
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len);
+#endif
+
+#ifndef DCACHE_H
+#define DENTRY_NAME_LEN  12
+#define DENTRY_VALID  (1 << 0)
+#define DENTRY_NEGATIVE  (1 << 1)
+typedef struct dentry {
+    uint32_t dir_lba;
+    char name[DENTRY_NAME_LEN];
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t flags;
+    struct dentry *hash_next;
+} __attribute__((packed)) Dentry;
+void init_dcache(void);
+int find_dentry(uint32_t dir_lba, const char *name, Dentry *found);
+void add_dentry(uint32_t dir_lba, const char *name, uint32_t base_lba, uint32_t offset);
+void add_negative_dentry(uint32_t dir_lba, const char *name, uint32_t scan_stamp);
+uint32_t dcache_stamp(void);
+void drop_dentry_at(uint32_t base_lba, uint32_t offset);
+void flush_dcache(void);
+void print_dcache_stats(void);
+#endif
+
 #ifndef SCSI_H
 void create_read12_packet(void *ptr, uint32_t block, uint32_t len);
 void create_write12_packet(void *ptr, uint32_t block, uint32_t len);
@@ -252,16 +342,52 @@ typedef struct file {
     uint32_t offset;
     uint32_t r_seek;
     uint32_t w_seek;
+    uint32_t r_lba;
+    uint32_t r_pos;
+    uint32_t w_lba;
+    uint32_t w_pos;
+    uint32_t m_block;
+    uint32_t m_lba;
+    uint32_t m_run;
+    uint32_t m_gen;
+    uint32_t ra_next;
+    uint32_t ra_window;
+    uint32_t ra_end;
+    char *w_buff;
+    uint32_t wb_seek;
+    uint32_t wb_len;
+    char mode;
+    uint32_t dir_lba;
+    struct lock_slot *lock;
 } __attribute__((packed)) File;
+#define NAME_LEN  11
+typedef struct dir_item {
+    char name[NAME_LEN + 1];
+    uint32_t addr;
+    uint32_t level;
+    uint32_t part_lba;
+    uint32_t offset;
+} __attribute__((packed)) DirItem;
+typedef struct dir Dir;
 void init_fs(UHCIDevice *dev);
 File *open(char *path, uint32_t len, char mode);
 void list(char *path, uint32_t len, int tree, int size);
+Dir *opendir(char *path, uint32_t len, int tree);
+int readdir(Dir *d, DirItem *item);
+void closedir(Dir *d);
 uint32_t get_size(uint32_t part_lba);
+uint32_t get_dir_size(uint32_t lba);
 int create(char *path, uint32_t len, int target_type);
 void delete(char *path, uint32_t len);
+int rename(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int clone(char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+int defrag(char *path, uint32_t len);
 uint32_t read_from_file(File *f, uint32_t count, char *data);
 void write_to_file(File *f, char *data, uint32_t count);
+void flush(File *f);
+void close(File *f);
 int is_path(char *path, uint32_t len, int target_type, int not_empty);
+int sync_fs(void);
 char *join_path(char *first, char *second);
 char *get_full_path(char *s);
 #endif
@@ -111,6 +111,19 @@ int read_bbb(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr) {
     CBW *cbw;
     CSW *csw;
     int result;
+    uint32_t max;
+
+    // A single command can only transfer as many blocks as the TDs of the
+    // data page can hold; split bigger transfers.
+    max = MAX_TRANSFER_TDS / (BLOCK_LEN / dev->in_maxp);
+    while (count > max) {
+        result = read_bbb(dev, block, max, ptr);
+        if (result)
+            return result;
+        block += max;
+        count -= max;
+        ptr += max * BLOCK_LEN;
+    }
 
     cbw_ptr = malloc(CBW_LEN);
     csw_ptr = malloc(CSW_LEN);
@@ -182,6 +195,19 @@ int write_bbb(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr) {
     CBW *cbw;
     CSW *csw;
     int result;
+    uint32_t max;
+
+    // A single command can only transfer as many blocks as the TDs of the
+    // data page can hold; split bigger transfers.
+    max = MAX_TRANSFER_TDS / (BLOCK_LEN / dev->out_maxp);
+    while (count > max) {
+        result = write_bbb(dev, block, max, ptr);
+        if (result)
+            return result;
+        block += max;
+        count -= max;
+        ptr += max * BLOCK_LEN;
+    }
 
     cbw_ptr = malloc(CBW_LEN);
     csw_ptr = malloc(CSW_LEN);
@@ -0,0 +1,756 @@
+// -----------------------------------------------------------------------------
+// Block Cache Module
+// ------------------
+//
+// General      :   The module keeps recently used device blocks in memory, so
+//                  repeated accesses to the same block do not cost a USB
+//                  transfer.
+//
+// Input        :   None
+//
+// Process      :   Serves reads from memory when the block is cached, delays
+//                  writes until the block is evicted or the cache is synced,
+//                  and evicts the least recently used block when full. Dirty
+//                  blocks of a journaled device are committed to its journal
+//                  together, and written in place later. The cache and the
+//                  transfers it makes are used by a single thread at a time:
+//                  even a read moves its block in the LRU list and may evict
+//                  another, so only counting the dirty blocks shares the lock
+//                  of the cache. The lock is the last one a thread takes; the
+//                  cache takes no other lock while it holds it.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <cache.h>
+
+
+static CacheEntry entries[CACHE_BLOCKS];
+static CacheEntry *hash[CACHE_HASH_SIZE];
+static CacheEntry *lru_head;
+static CacheEntry *lru_tail;
+static uint32_t hits;
+static uint32_t misses;
+static uint32_t write_backs;
+static uint32_t commits;
+static uint32_t prefetches;
+static RWLock cache_lock;
+
+
+// -----------------------------------------------------------------------------
+// init_cache
+// ----------
+//
+// General      :   The function initializes the block cache.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void init_cache(void) {
+    uint32_t i;
+    void *page;
+
+    page = 0;
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (!(i % (PAGE_SIZE / CACHE_BLOCK_SIZE)))
+            // Every page holds the data of several blocks.
+            page = palloc();
+        entries[i].dev = 0;
+        entries[i].block = 0;
+        entries[i].flags = 0;
+        entries[i].data = page + (i % (PAGE_SIZE / CACHE_BLOCK_SIZE)) * CACHE_BLOCK_SIZE;
+        entries[i].hash_next = 0;
+        // Chain all the entries in the LRU list.
+        entries[i].prev = i ? &entries[i - 1] : 0;
+        entries[i].next = i < CACHE_BLOCKS - 1 ? &entries[i + 1] : 0;
+    }
+    for (i = 0; i < CACHE_HASH_SIZE; i++)
+        hash[i] = 0;
+    lru_head = &entries[0];
+    lru_tail = &entries[CACHE_BLOCKS - 1];
+
+    hits = 0;
+    misses = 0;
+    write_backs = 0;
+    commits = 0;
+    prefetches = 0;
+    init_rwlock(&cache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// read_cache
+// ----------
+//
+// General      :   The function reads blocks through the cache. A single block
+//                  is kept in the cache once read; runs of uncached blocks of a
+//                  multi-block read are transferred with a single command
+//                  straight to the buffer, so streamed data does not push the
+//                  metadata out of the cache.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the first block to read (In)
+//              count   -   The amount of blocks to read (In)
+//              ptr     -   A pointer to the address in memory to write the data
+//                          to (Out)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int read_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr) {
+    CacheEntry *entry;
+    uint32_t run;
+    int status;
+
+    write_lock(&cache_lock);
+    if (count == 1) {
+        entry = find_cache_entry(dev, block);
+        if (entry)
+            hits++;
+        else {
+            misses++;
+            // Take a free entry for the block and fill it from the device.
+            entry = get_cache_entry(dev, block, &status);
+            if (status == CACHE_FULL) {
+                // Every block is changed by an open operation, so the block
+                // is read past the cache.
+                status = read_bbb(dev, block, 1, ptr);
+                write_unlock(&cache_lock);
+                return status;
+            }
+            if (status) {
+                write_unlock(&cache_lock);
+                return status;
+            }
+            status = read_bbb(dev, block, 1, entry->data);
+            if (status) {
+                write_unlock(&cache_lock);
+                return status;
+            }
+            entry->flags = CACHE_VALID;
+        }
+        memcpy(ptr, entry->data, CACHE_BLOCK_SIZE);
+        touch_cache_entry(entry);
+        write_unlock(&cache_lock);
+        return 0;
+    }
+
+    while (count) {
+        entry = find_cache_entry(dev, block);
+        if (entry) {
+            // The cached copy may be newer than the one on the device.
+            hits++;
+            memcpy(ptr, entry->data, CACHE_BLOCK_SIZE);
+            touch_cache_entry(entry);
+            run = 1;
+        } else {
+            // Find the run of uncached blocks and read it at once.
+            run = 1;
+            while (run < count && !find_cache_entry(dev, block + run))
+                run++;
+            misses += run;
+            status = read_bbb(dev, block, run, ptr);
+            if (status) {
+                write_unlock(&cache_lock);
+                return status;
+            }
+        }
+        ptr += run * CACHE_BLOCK_SIZE;
+        block += run;
+        count -= run;
+    }
+
+    write_unlock(&cache_lock);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// write_cache
+// -----------
+//
+// General      :   The function writes blocks to the cache. A single block
+//                  reaches the device when it is evicted or when the cache is
+//                  synced; the write fails if every block of the cache is
+//                  changed by an open operation. A multi-block write is
+//                  transferred to the device with a single command, and only
+//                  updates the blocks that are already cached. If the journal
+//                  holds an image of one of the blocks, the journal is
+//                  checkpointed first.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the first block to write (In)
+//              count   -   The amount of blocks to write (In)
+//              ptr     -   A pointer to the address in memory to read the data
+//                          from (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int write_cache(UHCIDevice *dev, uint32_t block, uint32_t count, void *ptr) {
+    CacheEntry *entry;
+    int status;
+
+    write_lock(&cache_lock);
+    if (count == 1) {
+        entry = find_cache_entry(dev, block);
+        if (!entry) {
+            // The whole block is overwritten, so there is no need to read it.
+            entry = get_cache_entry(dev, block, &status);
+            if (status) {
+                write_unlock(&cache_lock);
+                return status;
+            }
+        }
+        memcpy(entry->data, ptr, CACHE_BLOCK_SIZE);
+        // A committed block keeps its mark, since the log holds its image.
+        entry->flags |= CACHE_VALID | CACHE_DIRTY;
+        touch_cache_entry(entry);
+        write_unlock(&cache_lock);
+        return 0;
+    }
+
+    if (journal_logged(dev, block, count)) {
+        // Replaying the journal must not bring the old images back.
+        status = checkpoint_cache();
+        if (status) {
+            write_unlock(&cache_lock);
+            return status;
+        }
+    }
+    status = write_bbb(dev, block, count, ptr);
+    if (status) {
+        write_unlock(&cache_lock);
+        return status;
+    }
+    // Keep the cached copies up to date; they are now clean.
+    while (count--) {
+        entry = find_cache_entry(dev, block);
+        if (entry) {
+            memcpy(entry->data, ptr, CACHE_BLOCK_SIZE);
+            entry->flags = CACHE_VALID;
+        }
+        ptr += CACHE_BLOCK_SIZE;
+        block++;
+    }
+
+    write_unlock(&cache_lock);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// prefetch_cache
+// --------------
+//
+// General      :   The function reads blocks which are about to be needed into
+//                  the cache. Blocks that are already cached are skipped, and
+//                  each run of the others is read with a single command.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the first block to read (In)
+//              count   -   The amount of blocks to read (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int prefetch_cache(UHCIDevice *dev, uint32_t block, uint32_t count) {
+    CacheEntry *entry;
+    uint32_t run;
+    uint32_t i;
+    int status;
+    void *buff;
+
+    write_lock(&cache_lock);
+    buff = 0;
+    status = 0;
+    while (count && !status) {
+        if (find_cache_entry(dev, block)) {
+            block++;
+            count--;
+            continue;
+        }
+
+        // Find the run of uncached blocks and read it at once.
+        run = 1;
+        while (run < count && run < PAGE_SIZE / CACHE_BLOCK_SIZE && !find_cache_entry(dev, block + run))
+            run++;
+        if (!buff)
+            buff = palloc();
+        status = read_bbb(dev, block, run, buff);
+        for (i = 0; i < run && !status; i++) {
+            entry = get_cache_entry(dev, block + i, &status);
+            if (status)
+                break;
+            memcpy(entry->data, buff + i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE);
+            entry->flags = CACHE_VALID;
+            touch_cache_entry(entry);
+            prefetches++;
+        }
+        block += run;
+        count -= run;
+    }
+    if (buff)
+        pfree(buff);
+    if (status == CACHE_FULL)
+        // Nothing can leave the cache for now; the blocks are read when needed.
+        status = 0;
+
+    write_unlock(&cache_lock);
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// sync_cache
+// ----------
+//
+// General      :   The function writes all the dirty blocks to their devices.
+//                  The dirty blocks of a journaled device are committed to the
+//                  journal instead, which replays them if they are not written
+//                  in place before the device is detached. The function waits
+//                  until no operation is open, so it is not called inside one.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int sync_cache(void) {
+    int status;
+
+    journal_hold();
+    write_lock(&cache_lock);
+    status = commit_cache();
+    if (!status)
+        status = write_back_cache(CACHE_DIRTY);
+    write_unlock(&cache_lock);
+    journal_release();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// commit_cache
+// ------------
+//
+// General      :   The function commits the dirty blocks of the journaled
+//                  device to the journal, all of them in a single transaction.
+//                  The blocks are written in place later. It is called while
+//                  the journal is held, so no operation is half done.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int commit_cache(void) {
+    uint32_t i;
+    uint32_t count;
+    uint32_t *lbas;
+    void **images;
+    int status;
+
+    write_lock(&cache_lock);
+    lbas = (uint32_t *) malloc(CACHE_BLOCKS * sizeof (uint32_t));
+    images = (void **) malloc(CACHE_BLOCKS * sizeof (void *));
+
+    // Collect the dirty blocks of the journaled device; the cache never holds
+    // more of them than a transaction does.
+    count = 0;
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (!(entries[i].flags & CACHE_DIRTY) || !journal_active(entries[i].dev))
+            continue;
+        lbas[count] = entries[i].block;
+        images[count] = entries[i].data;
+        count++;
+    }
+
+    status = 0;
+    if (count > journal_room())
+        // The log is full; write the logged blocks in place to empty it.
+        status = checkpoint_cache();
+    if (!status && count)
+        status = journal_commit(count, lbas, images);
+    if (!status && count) {
+        commits++;
+        for (i = 0; i < CACHE_BLOCKS; i++)
+            if ((entries[i].flags & CACHE_DIRTY) && journal_active(entries[i].dev))
+                entries[i].flags = (entries[i].flags & ~CACHE_DIRTY) | CACHE_JOURNALED;
+    }
+
+    free((void *) images);
+    free((void *) lbas);
+
+    write_unlock(&cache_lock);
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// checkpoint_cache
+// ----------------
+//
+// General      :   The function writes the blocks committed to the journal in
+//                  place, and empties the journal. A committed block which
+//                  was changed again is written from its image in the log,
+//                  since its cached data is not committed yet.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int checkpoint_cache(void) {
+    uint32_t i;
+    int status;
+    void *image;
+
+    write_lock(&cache_lock);
+    image = 0;
+    status = 0;
+    for (i = 0; i < CACHE_BLOCKS && !status; i++) {
+        if ((entries[i].flags & (CACHE_DIRTY | CACHE_JOURNALED)) != (CACHE_DIRTY | CACHE_JOURNALED))
+            continue;
+        if (!image)
+            image = malloc(CACHE_BLOCK_SIZE);
+        status = read_bbb(entries[i].dev, journal_image(entries[i].block), 1, image);
+        if (!status)
+            status = write_bbb(entries[i].dev, entries[i].block, 1, image);
+        if (!status)
+            entries[i].flags &= ~CACHE_JOURNALED;
+    }
+    if (image)
+        free(image);
+    if (!status)
+        status = write_back_cache(CACHE_JOURNALED);
+    if (!status)
+        status = journal_reset();
+    write_unlock(&cache_lock);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// write_back_cache
+// ----------------
+//
+// General      :   The function writes the blocks which have any of the given
+//                  flags to their home locations. Blocks with consecutive LBAs
+//                  are written with a single command.
+//
+// Parameters   :
+//              mask    -   The flags of the blocks to write, which are cleared
+//                          once written (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int write_back_cache(uint32_t mask) {
+    uint32_t i;
+    uint32_t run;
+    int status;
+    int left;
+    void *buff;
+    CacheEntry *entry;
+    CacheEntry *prev;
+
+    write_lock(&cache_lock);
+    buff = palloc();
+    do {
+        left = 0;
+        for (i = 0; i < CACHE_BLOCKS; i++) {
+            if (!(entries[i].flags & mask))
+                continue;
+            prev = find_cache_entry(entries[i].dev, entries[i].block - 1);
+            if (entries[i].block && prev && (prev->flags & mask)) {
+                // The block is written as part of the run of a previous block,
+                // or in the next pass if that run is cut at the page size.
+                left = 1;
+                continue;
+            }
+
+            // Collect the run of blocks which starts with this block.
+            run = 0;
+            entry = &entries[i];
+            while (entry && (entry->flags & mask) && run < PAGE_SIZE / CACHE_BLOCK_SIZE) {
+                memcpy(buff + run * CACHE_BLOCK_SIZE, entry->data, CACHE_BLOCK_SIZE);
+                run++;
+                entry = find_cache_entry(entries[i].dev, entries[i].block + run);
+            }
+            status = write_bbb(entries[i].dev, entries[i].block, run, buff);
+            if (status) {
+                pfree(buff);
+                write_unlock(&cache_lock);
+                return status;
+            }
+            while (run--) {
+                entry = find_cache_entry(entries[i].dev, entries[i].block + run);
+                entry->flags &= ~mask;
+                write_backs++;
+            }
+        }
+    } while (left);
+    pfree(buff);
+
+    write_unlock(&cache_lock);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// count_dirty_cache
+// -----------------
+//
+// General      :   The function counts the dirty blocks in the cache.
+//
+// Parameters   :   None
+//
+// Return Value :   The amount of dirty blocks (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t count_dirty_cache(void) {
+    uint32_t i;
+    uint32_t dirty;
+
+    read_lock(&cache_lock);
+    dirty = 0;
+    for (i = 0; i < CACHE_BLOCKS; i++)
+        if (entries[i].flags & CACHE_DIRTY)
+            dirty++;
+    read_unlock(&cache_lock);
+    return dirty;
+}
+
+// -----------------------------------------------------------------------------
+// print_cache_stats
+// -----------------
+//
+// General      :   The function prints the statistics of the block cache.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void print_cache_stats(void) {
+    uint32_t i;
+    uint32_t journaled;
+    char *buff;
+
+    journaled = 0;
+    for (i = 0; i < CACHE_BLOCKS; i++)
+        if (entries[i].flags & CACHE_JOURNALED)
+            journaled++;
+
+    buff = malloc(16);
+    puts("Hits: ");
+    puts(uitoa(hits, buff, BASE10));
+    puts("\tMisses: ");
+    puts(uitoa(misses, buff, BASE10));
+    puts("\tPrefetched: ");
+    puts(uitoa(prefetches, buff, BASE10));
+    puts("\tWrite-backs: ");
+    puts(uitoa(write_backs, buff, BASE10));
+    puts("\nDirty: ");
+    puts(uitoa(count_dirty_cache(), buff, BASE10));
+    puts("\tJournaled: ");
+    puts(uitoa(journaled, buff, BASE10));
+    puts("\tCommits: ");
+    puts(uitoa(commits, buff, BASE10));
+    putc('\n');
+    free((void *) buff);
+}
+
+// -----------------------------------------------------------------------------
+// find_cache_entry
+// ----------------
+//
+// General      :   The function finds the cache entry of a block.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the block (In)
+//
+// Return Value :   A pointer to the entry, or 0 if the block is not cached
+//
+// -----------------------------------------------------------------------------
+
+CacheEntry *find_cache_entry(UHCIDevice *dev, uint32_t block) {
+    CacheEntry *entry;
+
+    entry = hash[CACHE_HASH(block)];
+    while (entry) {
+        if (entry->block == block && entry->dev == dev && (entry->flags & CACHE_VALID))
+            return entry;
+        entry = entry->hash_next;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// get_cache_entry
+// ---------------
+//
+// General      :   The function takes the least recently used entry and assigns
+//                  it to a block. Blocks of a journaled device which are not in
+//                  place yet are passed over while there are others, so the
+//                  journal is checkpointed rarely. A dirty block of a journaled
+//                  device leaves only once the dirty blocks are committed,
+//                  which is done only while no operation is open, so an
+//                  operation is never committed half done. The data of the
+//                  entry is not valid until the caller fills it.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the block (In)
+//              status  -   A pointer to an int, which will contain 0 if
+//                          successful, CACHE_FULL if every block is changed by
+//                          an open operation, otherwise an error specifier
+//                          (Out)
+//
+// Return Value :   A pointer to the entry, or 0 if no entry was taken
+//
+// -----------------------------------------------------------------------------
+
+CacheEntry *get_cache_entry(UHCIDevice *dev, uint32_t block, int *status) {
+    CacheEntry *entry;
+
+    entry = lru_tail;
+    while (entry && (entry->flags & (CACHE_DIRTY | CACHE_JOURNALED)) && journal_active(entry->dev))
+        entry = entry->prev;
+    if (!entry) {
+        // A committed block leaves once the journal is checkpointed.
+        entry = lru_tail;
+        while (entry && (entry->flags & CACHE_DIRTY) && journal_active(entry->dev))
+            entry = entry->prev;
+    }
+    if (!entry) {
+        if (journal_try_hold()) {
+            *status = CACHE_FULL;
+            return 0;
+        }
+        *status = commit_cache();
+        journal_release();
+        if (*status)
+            return 0;
+        entry = lru_tail;
+    }
+    // Write the old block back if needed, and remove it from the cache.
+    *status = evict_cache_entry(entry);
+    if (*status)
+        return entry;
+
+    entry->dev = dev;
+    entry->block = block;
+    entry->hash_next = hash[CACHE_HASH(block)];
+    hash[CACHE_HASH(block)] = entry;
+
+    return entry;
+}
+
+// -----------------------------------------------------------------------------
+// evict_cache_entry
+// -----------------
+//
+// General      :   The function removes a block from the cache, writing it to
+//                  the device first if it is dirty. A committed block of a
+//                  journaled device is written in place with all the other
+//                  committed blocks. A block of a journaled device which is
+//                  not committed yet is not removed.
+//
+// Parameters   :
+//              entry   -   A pointer to the cache entry (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int evict_cache_entry(CacheEntry *entry) {
+    CacheEntry *prev;
+    CacheEntry *curr;
+    int status;
+
+    if (!entry->dev)
+        // The entry was never used.
+        return 0;
+
+    if ((entry->flags & CACHE_DIRTY) && journal_active(entry->dev))
+        // Writing it would put half an operation in place.
+        return CACHE_FULL;
+    if (entry->flags & CACHE_JOURNALED) {
+        status = checkpoint_cache();
+        if (status)
+            return status;
+    }
+    if (entry->flags & CACHE_DIRTY) {
+        status = write_bbb(entry->dev, entry->block, 1, entry->data);
+        if (status)
+            return status;
+        write_backs++;
+    }
+
+    // Unlink the entry from its hash chain.
+    prev = 0;
+    curr = hash[CACHE_HASH(entry->block)];
+    while (curr && curr != entry) {
+        prev = curr;
+        curr = curr->hash_next;
+    }
+    if (curr) {
+        if (prev)
+            prev->hash_next = entry->hash_next;
+        else
+            hash[CACHE_HASH(entry->block)] = entry->hash_next;
+    }
+
+    entry->dev = 0;
+    entry->flags = 0;
+    entry->hash_next = 0;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// touch_cache_entry
+// -----------------
+//
+// General      :   The function marks an entry as the most recently used one.
+//
+// Parameters   :
+//              entry   -   A pointer to the cache entry (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void touch_cache_entry(CacheEntry *entry) {
+    if (entry == lru_head)
+        return;
+
+    // Unlink the entry from the LRU list.
+    entry->prev->next = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+
+    // Put it at the head of the list.
+    entry->prev = 0;
+    entry->next = lru_head;
+    lru_head->prev = entry;
+    lru_head = entry;
+}
@@ -54,6 +54,11 @@ void init_command_prompt(void) {
     add_command("read", &read_cmd);
     add_command("del", &delete_cmd);
     add_command("mkdir", &make_dir_cmd);
+    add_command("mv", &move_cmd);
+    add_command("clone", &clone_cmd);
+    add_command("defrag", &defrag_cmd);
+    add_command("sync", &sync_cmd);
+    add_command("cstat", &cache_stats_cmd);
 
     // Initiate the command-prompt.
     command_prompt();
@@ -295,6 +300,7 @@ void print_args_cmd(int argc, char **args, int call_type) {
 void free_text_cmd(int argc, char **args, int call_type) {
     int c;
     uint32_t n;
+    char mode;
     char *path;
     File *f;
     char *buff;
@@ -304,18 +310,32 @@ void free_text_cmd(int argc, char **args, int call_type) {
             puts("WRITE TEXT AND SAVE IT TO A FILE\n");
             return;
         case CALL_TYPE_DESC:
-            puts("[PATH]\n");
+            puts("[append | compress] [PATH]\n");
+            puts("\tappend\tADD THE TEXT TO THE END OF THE FILE\n");
+            puts("\tcompress\tKEEP THE TEXT OF A NEW FILE COMPRESSED\n");
             puts("\tPATH\tTHE PATH OF THE FILE TO SAVE THE TEXT TO\n");
             return;
     }
 
+    mode = 'w';
+    for (n = 0; n < argc; n++) {
+        if (!strcmp(*(args + n), "append"))
+            mode = 'a';
+        else if (!strcmp(*(args + n), "compress") && mode == 'w')
+            mode = 'z';
+    }
+
     path = 0;
+    f = 0;
     while (argc--) {
-        path = get_full_path(*args);
-        f = open(path, strlen(path), 'w');
-        free(path);
-        if (f)
-            break;
+        if (strcmp(*args, "append") && strcmp(*args, "compress")) {
+            path = get_full_path(*args);
+            f = open(path, strlen(path), mode);
+            free(path);
+            if (f)
+                break;
+        }
+        args++;
     }
 
     if (path && !f) {
@@ -348,7 +368,7 @@ void free_text_cmd(int argc, char **args, int call_type) {
     *(buff + n) = 0;
     if (f) {
         write_to_file(f, buff, n);
-        free((void *) f);
+        close(f);
     }
     pfree((void *) buff);
     putc('\n');
@@ -569,7 +589,7 @@ void read_cmd(int argc, char **args, int call_type) {
         }
     }
 
-    free((void *) f);
+    close(f);
     pfree((void *) buff);
     putc('\n');
 }
@@ -624,4 +644,132 @@ void make_dir_cmd(int argc, char **args, int call_type) {
         free(path);
         args++;
     }
-}
\ No newline at end of file
+}
+
+void sync_cmd(int argc, char **args, int call_type) {
+    switch (call_type) {
+        case CALL_TYPE_HELP:
+            puts("WRITE ALL CACHED CHANGES TO THE DEVICE\n");
+            return;
+        case CALL_TYPE_DESC:
+            putc('\n');
+            return;
+    }
+
+    if (sync_fs())
+        puts("Sync failed!\n");
+}
+
+void cache_stats_cmd(int argc, char **args, int call_type) {
+    switch (call_type) {
+        case CALL_TYPE_HELP:
+            puts("PRINT BLOCK CACHE AND DIRECTORY ENTRY CACHE STATISTICS\n");
+            return;
+        case CALL_TYPE_DESC:
+            putc('\n');
+            return;
+    }
+
+    print_cache_stats();
+    print_dcache_stats();
+}
+
+void move_cmd(int argc, char **args, int call_type) {
+    char *src;
+    char *dst;
+    char *name;
+    char *path;
+
+    switch (call_type) {
+        case CALL_TYPE_HELP:
+            puts("MOVE OR RENAME A FILE OR A DIRECTORY\n");
+            return;
+        case CALL_TYPE_DESC:
+            puts("SOURCE DESTINATION\n");
+            puts("\tSOURCE\t\tTHE PATH OF THE TARGET TO MOVE\n");
+            puts("\tDESTINATION\tTHE NEW PATH OF THE TARGET, OR A DIRECTORY TO MOVE IT INTO\n");
+            return;
+    }
+
+    if (argc < 2) {
+        puts("Not enough arguments!\n");
+        return;
+    }
+
+    src = get_full_path(*args);
+    dst = get_full_path(*(args + 1));
+    if (is_path(dst, strlen(dst), TYPE_DIR, 0)) {
+        // Move the target into the directory, under the same name.
+        name = src + strlen(src);
+        while (name > src && *(name - 1) != '/')
+            name--;
+        path = join_path(dst, name);
+        free(dst);
+        dst = path;
+    }
+    if (!is_path(src, strlen(src), TYPE_UNDEFINED, 0)) {
+        puts(*args);
+        puts(" not found!\n");
+    } else if (rename(src, strlen(src), dst, strlen(dst))) {
+        puts("Move failed!\n");
+    }
+    free(src);
+    free(dst);
+}
+
+void clone_cmd(int argc, char **args, int call_type) {
+    char *src;
+    char *dst;
+
+    switch (call_type) {
+        case CALL_TYPE_HELP:
+            puts("COPY A FILE WITHOUT COPYING ITS DATA\n");
+            return;
+        case CALL_TYPE_DESC:
+            puts("SOURCE DESTINATION\n");
+            puts("\tSOURCE\t\tTHE PATH OF THE FILE TO COPY\n");
+            puts("\tDESTINATION\tTHE PATH OF THE COPY\n");
+            return;
+    }
+
+    if (argc < 2) {
+        puts("Not enough arguments!\n");
+        return;
+    }
+
+    src = get_full_path(*args);
+    dst = get_full_path(*(args + 1));
+    if (!is_path(src, strlen(src), TYPE_FILE, 0)) {
+        puts(*args);
+        puts(" not found!\n");
+    } else if (clone(src, strlen(src), dst, strlen(dst))) {
+        puts("Clone failed!\n");
+    }
+    free(src);
+    free(dst);
+}
+
+void defrag_cmd(int argc, char **args, int call_type) {
+    char *path;
+    uint32_t *status;
+
+    switch (call_type) {
+        case CALL_TYPE_HELP:
+            puts("MOVE THE PARTS OF FILES TO CONSECUTIVE BLOCKS IN THE BACKGROUND\n");
+            return;
+        case CALL_TYPE_DESC:
+            puts("[PATH]\n");
+            puts("\tPATH\tTHE FILE OR DIRECTORY TO DEFRAGMENT (DEFAULT: WORKING DIRECTORY)\n");
+            return;
+    }
+
+    path = get_full_path(argc ? *args : working_dir);
+    if (new_thread("defrag", &status)) {
+        // Let the foreground threads run most of the time.
+        set_idle();
+        if (defrag(path, strlen(path)))
+            puts("Defrag failed!\n");
+        free(path);
+        dispose_thread();
+    }
+}
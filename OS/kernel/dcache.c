@@ -0,0 +1,355 @@
+// -----------------------------------------------------------------------------
+// Directory Entry Cache Module
+// ----------------------------
+//
+// General      :   The module remembers where the entries of recently resolved
+//                  names are, so resolving the same paths again does not scan
+//                  the directories.
+//
+// Input        :   None
+//
+// Process      :   Maps a directory and a name to the position of the entry of
+//                  the name, or records that the directory has no such name.
+//                  Replaces the entries in a round-robin order when full.
+//                  Every change is counted, so a lookup which scanned a
+//                  directory while it changed does not record a stale miss.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <dcache.h>
+
+
+static Dentry dentries[DCACHE_ENTRIES];
+static Dentry *hash[DCACHE_HASH_SIZE];
+static uint32_t next_victim;
+static uint32_t hits;
+static uint32_t misses;
+static uint32_t stamp;
+static RWLock dcache_lock;
+
+
+// -----------------------------------------------------------------------------
+// init_dcache
+// -----------
+//
+// General      :   The function initializes the directory entry cache.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void init_dcache(void) {
+    init_rwlock(&dcache_lock);
+    flush_dcache();
+    hits = 0;
+    misses = 0;
+}
+
+// -----------------------------------------------------------------------------
+// find_dentry
+// -----------
+//
+// General      :   The function finds the cached entry of a name in a
+//                  directory, and copies it, since the dentry may be replaced
+//                  by another thread once it is returned.
+//
+// Parameters   :
+//              dir_lba -   The LBA of the first part of the directory (In)
+//              name    -   The name, padded with 0's to DENTRY_NAME_LEN (In)
+//              found   -   A pointer to a dentry to copy the cached one to. A
+//                          dentry with the DENTRY_NEGATIVE flag means the
+//                          directory has no such name (Out)
+//
+// Return Value :   1 if the name is cached, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int find_dentry(uint32_t dir_lba, const char *name, Dentry *found) {
+    Dentry *dentry;
+
+    write_lock(&dcache_lock);
+    dentry = hash[dentry_hash(dir_lba, name)];
+    while (dentry) {
+        if (dentry->dir_lba == dir_lba && !memcmp(dentry->name, name, DENTRY_NAME_LEN)) {
+            hits++;
+            memcpy((void *) found, (void *) dentry, sizeof (Dentry));
+            write_unlock(&dcache_lock);
+            return 1;
+        }
+        dentry = dentry->hash_next;
+    }
+    misses++;
+    write_unlock(&dcache_lock);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// add_dentry
+// ----------
+//
+// General      :   The function caches the position of the entry of a name.
+//
+// Parameters   :
+//              dir_lba     -   The LBA of the first part of the directory (In)
+//              name        -   The name, padded with 0's to DENTRY_NAME_LEN
+//                              (In)
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The offset of the entry in the part (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void add_dentry(uint32_t dir_lba, const char *name, uint32_t base_lba, uint32_t offset) {
+    Dentry *dentry;
+
+    write_lock(&dcache_lock);
+    dentry = get_dentry(dir_lba, name);
+    dentry->base_lba = base_lba;
+    dentry->offset = offset;
+    dentry->flags = DENTRY_VALID;
+    stamp++;
+    write_unlock(&dcache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// add_negative_dentry
+// -------------------
+//
+// General      :   The function records that a directory has no such name,
+//                  unless the cache changed since the directory was scanned,
+//                  since the name may have been added meanwhile.
+//
+// Parameters   :
+//              dir_lba     -   The LBA of the first part of the directory (In)
+//              name        -   The name, padded with 0's to DENTRY_NAME_LEN
+//                              (In)
+//              scan_stamp  -   The stamp of the cache from before the scan
+//                              (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void add_negative_dentry(uint32_t dir_lba, const char *name, uint32_t scan_stamp) {
+    Dentry *dentry;
+
+    write_lock(&dcache_lock);
+    if (scan_stamp == stamp) {
+        dentry = get_dentry(dir_lba, name);
+        dentry->base_lba = 0;
+        dentry->offset = 0;
+        dentry->flags = DENTRY_VALID | DENTRY_NEGATIVE;
+    }
+    write_unlock(&dcache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// dcache_stamp
+// ------------
+//
+// General      :   The function returns the count of the changes to the cache,
+//                  which is taken before a directory is scanned.
+//
+// Parameters   :   None
+//
+// Return Value :   The stamp (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t dcache_stamp(void) {
+    return stamp;
+}
+
+// -----------------------------------------------------------------------------
+// drop_dentry_at
+// --------------
+//
+// General      :   The function removes the dentries which point to an entry,
+//                  after the entry is deleted.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The offset of the entry in the part (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void drop_dentry_at(uint32_t base_lba, uint32_t offset) {
+    uint32_t i;
+
+    write_lock(&dcache_lock);
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        if ((dentries[i].flags & DENTRY_VALID) && !(dentries[i].flags & DENTRY_NEGATIVE)
+                && dentries[i].base_lba == base_lba && dentries[i].offset == offset)
+            unlink_dentry(&dentries[i]);
+    }
+    stamp++;
+    write_unlock(&dcache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// flush_dcache
+// ------------
+//
+// General      :   The function removes all the dentries. It is used when
+//                  directories are deleted, since their blocks may be reused.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void flush_dcache(void) {
+    uint32_t i;
+
+    write_lock(&dcache_lock);
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        dentries[i].flags = 0;
+        dentries[i].hash_next = 0;
+    }
+    for (i = 0; i < DCACHE_HASH_SIZE; i++)
+        hash[i] = 0;
+    next_victim = 0;
+    stamp++;
+    write_unlock(&dcache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// print_dcache_stats
+// ------------------
+//
+// General      :   The function prints the statistics of the directory entry
+//                  cache.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void print_dcache_stats(void) {
+    char *buff;
+
+    buff = malloc(16);
+    puts("Dentry hits: ");
+    puts(uitoa(hits, buff, BASE10));
+    puts("\tDentry misses: ");
+    puts(uitoa(misses, buff, BASE10));
+    putc('\n');
+    free((void *) buff);
+}
+
+// -----------------------------------------------------------------------------
+// get_dentry
+// ----------
+//
+// General      :   The function returns the dentry of a name, taking the next
+//                  victim if the name is not cached yet.
+//
+// Parameters   :
+//              dir_lba -   The LBA of the first part of the directory (In)
+//              name    -   The name, padded with 0's to DENTRY_NAME_LEN (In)
+//
+// Return Value :   A pointer to the dentry
+//
+// -----------------------------------------------------------------------------
+
+Dentry *get_dentry(uint32_t dir_lba, const char *name) {
+    uint32_t i;
+    Dentry *dentry;
+
+    dentry = hash[dentry_hash(dir_lba, name)];
+    while (dentry) {
+        if (dentry->dir_lba == dir_lba && !memcmp(dentry->name, name, DENTRY_NAME_LEN))
+            return dentry;
+        dentry = dentry->hash_next;
+    }
+
+    // Prefer an unused dentry over the next victim.
+    dentry = &dentries[next_victim];
+    for (i = 0; i < DCACHE_ENTRIES; i++) {
+        if (!(dentries[i].flags & DENTRY_VALID)) {
+            dentry = &dentries[i];
+            break;
+        }
+    }
+    if (dentry == &dentries[next_victim])
+        next_victim = (next_victim + 1) % DCACHE_ENTRIES;
+    if (dentry->flags & DENTRY_VALID)
+        unlink_dentry(dentry);
+
+    dentry->dir_lba = dir_lba;
+    memcpy(dentry->name, (void *) name, DENTRY_NAME_LEN);
+    dentry->hash_next = hash[dentry_hash(dir_lba, name)];
+    hash[dentry_hash(dir_lba, name)] = dentry;
+    return dentry;
+}
+
+// -----------------------------------------------------------------------------
+// unlink_dentry
+// -------------
+//
+// General      :   The function removes a dentry from the cache.
+//
+// Parameters   :
+//              dentry  -   A pointer to the dentry (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void unlink_dentry(Dentry *dentry) {
+    Dentry *prev;
+    Dentry *curr;
+    uint32_t index;
+
+    index = dentry_hash(dentry->dir_lba, dentry->name);
+    prev = 0;
+    curr = hash[index];
+    while (curr && curr != dentry) {
+        prev = curr;
+        curr = curr->hash_next;
+    }
+    if (curr) {
+        if (prev)
+            prev->hash_next = dentry->hash_next;
+        else
+            hash[index] = dentry->hash_next;
+    }
+    dentry->flags = 0;
+    dentry->hash_next = 0;
+}
+
+// -----------------------------------------------------------------------------
+// dentry_hash
+// -----------
+//
+// General      :   The function computes the hash of a directory and a name.
+//
+// Parameters   :
+//              dir_lba -   The LBA of the first part of the directory (In)
+//              name    -   The name, padded with 0's to DENTRY_NAME_LEN (In)
+//
+// Return Value :   The index of the hash chain of the name
+//
+// -----------------------------------------------------------------------------
+
+uint32_t dentry_hash(uint32_t dir_lba, const char *name) {
+    uint32_t h;
+    uint32_t i;
+
+    h = dir_lba;
+    for (i = 0; i < DENTRY_NAME_LEN && name[i]; i++)
+        h = h * 31 + (uint8_t) name[i];
+    return h % DCACHE_HASH_SIZE;
+}
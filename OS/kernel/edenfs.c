@@ -10,6 +10,47 @@
 // Process      :   Initializes the interface and provides functions to manage
 //                  the file-system.
 //
+//                  Threads take the locks of the file-system in this order:
+//                  1. The gate. An operation enters it with begin_fs_op while
+//                     holding nothing, and may enter it again. begin_fs_op
+//                     waits only while the file-system is held, which happens
+//                     only once no operation is inside, so an operation never
+//                     waits for the gate. The defragmenter (hold_fs) and the
+//                     freeing of a directory with parts (begin_excl_fs_op)
+//                     hold the file-system and take the locks below it from
+//                     there. Reading and writing an open file does not enter
+//                     the gate.
+//                  2. The lock of an open file, held by its descriptor from
+//                     open to close. While a directory is locked, a file is
+//                     only tried; a thread waits for a file (wait_file) with
+//                     no lock and outside the gate, so the thread which has
+//                     the file open can always go on and close it.
+//                  3. rename_lock, for a move between directories.
+//                  4. The locks of directories. Two directories are locked
+//                     in the order of their LBAs (lock_dir_pair). A thread
+//                     pins at most two slots, so the table does not run out
+//                     while fewer than DIR_LOCKS / 2 threads lock directories.
+//                  5. The journal. journal_begin waits for a commit to end,
+//                     and sync_cache waits for the operations to end (it is
+//                     called with nothing below the gate held). A commit
+//                     itself takes only the lock of the block cache.
+//                  6. alloc_lock, which is taken inside journaled operations
+//                     (balloc_n, bfree, unshare_blocks) and never begins or
+//                     ends one.
+//                  7. The locks of the directory entry cache and of the block
+//                     cache, which wait for no other lock; a full block cache
+//                     only tries to hold the journal (journal_try_hold).
+//                  No lock is waited for while a later one is held, and the
+//                  holders of the gate and of the directories never wait for
+//                  an open file to be closed, so the locks can not wait for
+//                  each other in a cycle. The exclusive operations wait for
+//                  the operations inside the gate to end, and never for the
+//                  open files: a directory with an open file inside it is not
+//                  freed. This is why open can leave the gate, free the
+//                  directory in its way with create, and enter the gate again
+//                  to open the new file; if a directory is in the way again,
+//                  open fails instead of trying once more.
+//
 // Output       :   None
 //
 // -----------------------------------------------------------------------------
@@ -21,11 +62,30 @@
 
 
 static UHCIDevice *fs_dev;
+static uint8_t fs_version;
+static uint8_t addr_shift;
 static uint32_t block_count;
+static uint32_t cluster_blocks;
+static uint8_t cluster_shift;
+static uint32_t cluster_count;
 static uint8_t levels;
 static LevelNode *first_level;
 static uint32_t root_lba;
 static uint32_t first_bitmap_lba;
+static uint32_t leaf_base_lba;
+static uint32_t leaf_count;
+static uint32_t first_free_leaf;
+static uint16_t **leaf_free;
+static uint32_t open_count;
+static uint32_t fs_ops;
+static uint32_t fs_waiters;
+static uint32_t fs_generation;
+static uint32_t map_generation;
+static int fs_held;
+static LockSlot dir_locks[DIR_LOCKS];
+static LockSlot file_locks[FILE_LOCKS];
+static RWLock alloc_lock;
+static RWLock rename_lock;
 
 
 // -----------------------------------------------------------------------------
@@ -52,31 +112,80 @@ void init_fs(UHCIDevice *dev) {
 
     // Read the boot-sector.
     read_bbb(dev, 0, 1, bsect);
-    // Check whether the boot-sector contain the EdenFS signature.
-    if (!memcmp(bsect->sign, "EDENFS100", EDENFS_SIGN_LEN))
+    // Check whether the boot-sector contain an EdenFS signature, and which
+    // format revision it is.
+    if (!memcmp(bsect->sign, EDENFS_SIGN_V1, EDENFS_SIGN_LEN))
+        fs_version = FS_VERSION_CHAINS;
+    else if (!memcmp(bsect->sign, EDENFS_SIGN_V2, EDENFS_SIGN_LEN))
+        fs_version = FS_VERSION_EXTENTS;
+    else if (!memcmp(bsect->sign, EDENFS_SIGN_V3, EDENFS_SIGN_LEN))
+        fs_version = FS_VERSION_WIDE;
+    else {
+        free((void *) bsect);
+        return;
+    }
+    // The wide revision keeps only the flags below the LBA of an address,
+    // which leaves 28 bits for the LBA instead of 23.
+    addr_shift = fs_version == FS_VERSION_WIDE ? ADDR_SHIFT_WIDE : ADDR_SHIFT_NARROW;
+    // Bring the metadata up to date with the journal before reading it.
+    if (init_journal(dev, bsect->journal_lba, bsect->journal_blocks)) {
+        free((void *) bsect);
         return;
+    }
+    // Only the extents of cloned files share blocks.
+    if (fs_version >= FS_VERSION_EXTENTS)
+        init_refcount(dev, bsect->refcount_lba, bsect->refcount_blocks);
+    else
+        init_refcount(dev, 0, 0);
     fs_dev = dev;
     block_count = bsect->block_count;
+    // Blocks are allocated in clusters of a power of two blocks. Devices
+    // formatted without a cluster size have a cluster for every block.
+    cluster_shift = 0;
+    while ((1u << cluster_shift) < bsect->cluster_blocks
+            && (1u << cluster_shift) < CLUSTER_BLOCKS_MAX)
+        cluster_shift++;
+    if ((1u << cluster_shift) != bsect->cluster_blocks)
+        cluster_shift = 0;
+    cluster_blocks = 1 << cluster_shift;
+    cluster_count = block_count >> cluster_shift;
     levels = bsect->levels;
     first_bitmap_lba = bsect->first_bitmap;
     root_lba = bsect->first_sect;
 
     free((void *) bsect);
 
-    fs_dev->capacity = block_count * BLOCK_SIZE;
+    // The capacity in bytes does not fit devices of 4 GB and more.
+    if (block_count > 0xFFFFFFFF / BLOCK_SIZE)
+        fs_dev->capacity = 0xFFFFFFFF;
+    else
+        fs_dev->capacity = block_count * BLOCK_SIZE;
 
-    temp = block_count;
+    temp = cluster_count;
     level_node = 0;
-    // Calculate the memory space needed for every level of the bitmaps.
+    // Calculate the memory space needed for every level of the bitmaps, which
+    // have a bit for every cluster. The levels of the wide revision cover all
+    // the clusters, up to a single bitmap block at the top.
     for (i = 0; i < levels; i++) {
         temp_level_node = (LevelNode *) malloc(sizeof (LevelNode));
         temp_level_node->next = level_node;
         level_node = temp_level_node;
-        level_node->level_size = temp / BITMAP_SIZE;
+        if (fs_version == FS_VERSION_WIDE)
+            level_node->level_size = (temp + BITMAP_SIZE - 1) / BITMAP_SIZE;
+        else
+            level_node->level_size = temp / BITMAP_SIZE;
         temp = level_node->level_size;
     }
     first_level = level_node;
 
+    // The allocator and the moves between directories are locked as a whole.
+    init_rwlock(&alloc_lock);
+    init_rwlock(&rename_lock);
+    // Build the in-memory summary of the free blocks.
+    load_bitmap_summary();
+    // Forget the entries of any previous file-system.
+    init_dcache();
+
     working_dir = (char *) malloc(2);
     // Set working directory to root.
     *working_dir = '/';
@@ -86,43 +195,249 @@ void init_fs(UHCIDevice *dev) {
 // open
 // ----
 // 
-// General      :   The function opens a file for reading/writing.
+// General      :   The function opens a file for reading/writing. The file
+//                  is locked until it is closed, shared for reading and
+//                  exclusive for writing.
 //
 // Parameters   :
 //              path    -   The path to the file in the file-system (In)
 //              len     -   The length of the path string (In)
 //              mode    -   The opening mode ('w' for creating the file and
-//                          opening it, 'r' for opening an existing file) (In)
+//                          opening it, 'r' for opening an existing file, 'a'
+//                          for writing to the end of a file, which is created
+//                          if it does not exist, 'z' as 'w', but an empty file
+//                          keeps its data compressed) (In)
 //
 // Return Value :   A pointer to an opened file descriptor, or 0 if opening a
-//                  file that doesn't exist
+//                  file that doesn't exist, or appending to a file whose
+//                  chain of parts is broken
 //
 // -----------------------------------------------------------------------------
 
 File *open(char *path, uint32_t len, char mode) {
-    uint32_t base_lba;
-    uint32_t offset;
     int status;
+    LockSlot *slot;
     File *f;
 
-    if (mode == 'w')
-        // If the mode is 'w', create the file.
+    // Create the file descriptor.
+    f = (File *) malloc(sizeof (File));
+    f->mode = mode;
+    begin_fs_op();
+    if (mode != 'r')
+        mark_fs_changed();
+    // Find the entry of the wanted file, and lock it for the descriptor.
+    if (mode == 'r')
+        status = open_path(path, len, f);
+    else
+        // Create the file, or the missing file to append to.
+        status = create_path(path, len, TYPE_FILE, f);
+    if (status == FS_EXCLUSIVE) {
+        // A directory is in the way, which only create removes.
+        end_fs_op();
         create(path, len, TYPE_FILE);
-    // Find the entry of the wanted file.
-    status = find_path(path, len, TYPE_FILE, 0, &base_lba, &offset);
-    if (status)
+        begin_fs_op();
+        status = create_path(path, len, TYPE_FILE, f);
+    }
+    if (status) {
+        end_fs_op();
+        free((void *) f);
         return 0;
+    }
 
-    // Create the file descriptor.
-    f = (File *) malloc(sizeof (File));
-    f->base_lba = base_lba;
-    f->offset = offset;
     f->r_seek = 0;
     f->w_seek = 0;
+    f->r_lba = 0;
+    f->r_pos = 0;
+    f->w_lba = 0;
+    f->w_pos = 0;
+    f->m_block = 0;
+    f->m_lba = 0;
+    f->m_run = 0;
+    f->m_gen = map_generation;
+    f->ra_next = 0;
+    f->ra_window = 0;
+    f->ra_end = 0;
+    f->w_buff = 0;
+    f->wb_seek = 0;
+    f->wb_len = 0;
+    if (mode == 'a' && seek_to_end(f)) {
+        // Writes start at the end of the file, which could not be found.
+        unlock_file(f->lock, LOCK_WRITE);
+        end_fs_op();
+        free((void *) f);
+        return 0;
+    } else if (mode == 'z') {
+        // The entry of the file is changed in its directory part.
+        slot = lock_dir(f->dir_lba, LOCK_WRITE);
+        make_compressed(f);
+        unlock_dir(slot, LOCK_WRITE);
+    }
+    // The defragmenter does not move parts while files are open.
+    CLEAR_INTS();
+    open_count++;
+    SET_INTS();
+    end_fs_op();
 
     return f;
 }
 
+// -----------------------------------------------------------------------------
+// open_path
+// ---------
+// 
+// General      :   The function finds the entry of an existing file, and locks
+//                  the file for reading. The directory of the file is not held
+//                  while a writer of the file is waited for.
+//
+// Parameters   :
+//              path    -   The path to the file in the file-system (In)
+//              len     -   The length of the path string (In)
+//              f       -   A pointer to the file descriptor to fill with the
+//                          entry and the lock (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int open_path(char *path, uint32_t len, File *f) {
+    uint32_t dir_lba;
+    uint32_t base_lba;
+    uint32_t offset;
+    LockSlot *dir_slot;
+    LockSlot *slot;
+
+    while (1) {
+        if (lock_parent_dir(path, len, LOCK_READ, &dir_lba, &dir_slot))
+            return 1;
+        if (find_path(path, len, TYPE_FILE, 0, &base_lba, &offset)) {
+            unlock_dir(dir_slot, LOCK_READ);
+            return 1;
+        }
+        slot = try_lock_file(base_lba, offset, LOCK_READ);
+        unlock_dir(dir_slot, LOCK_READ);
+        if (slot)
+            break;
+        // The file is open for writing, look it up again once it is closed.
+        wait_file(base_lba, offset, LOCK_READ);
+    }
+
+    f->base_lba = base_lba;
+    f->offset = offset;
+    f->dir_lba = dir_lba;
+    f->lock = slot;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// seek_to_end
+// -----------
+// 
+// General      :   The function moves the write seek of an open file to its
+//                  end. The last part of a chained file is remembered, so the
+//                  writes that follow start from it.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   0 if successful, otherwise error specifier (a part of the
+//                  chain is out of the device)
+//
+// -----------------------------------------------------------------------------
+
+int seek_to_end(File *f) {
+    uint32_t lba;
+    uint32_t w_lba;
+    uint32_t w_pos;
+    uint32_t size;
+    DirPart *dir;
+
+    if (is_inline(f)) {
+        // The size of an inline file is kept in place of its address.
+        dir = (DirPart *) malloc(sizeof (DirPart));
+        read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+        f->w_seek = dir->entry[f->offset].addr >> addr_shift;
+        free((void *) dir);
+        return 0;
+    }
+    lba = get_file_lba(f);
+    if (!lba) {
+        f->w_seek = 0;
+        return 0;
+    }
+    if (fs_version >= FS_VERSION_EXTENTS) {
+        f->w_seek = get_file_size(lba);
+        return 0;
+    }
+    if (find_tail_part(lba, &w_lba, &w_pos, &size))
+        return 1;
+    f->w_seek = size;
+    f->w_lba = w_lba;
+    f->w_pos = w_pos;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// find_tail_part
+// --------------
+// 
+// General      :   The function finds the last part of a chain of parts. The
+//                  parts of a chain are usually allocated together, so a page
+//                  of blocks is read with every command.
+//
+// Parameters   :
+//              lba         -   The LBA of the first part (In)
+//              tail_lba    -   A pointer to an unsigned int, which will contain
+//                              the LBA of the last part (Out)
+//              tail_pos    -   A pointer to an unsigned int, which will contain
+//                              the position of the last part in the chain (Out)
+//              size        -   A pointer to an unsigned int, which will contain
+//                              the size of the chain in bytes (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier (a part of the
+//                  chain is out of the device)
+//
+// -----------------------------------------------------------------------------
+
+int find_tail_part(uint32_t lba, uint32_t *tail_lba, uint32_t *tail_pos, uint32_t *size) {
+    uint32_t pos;
+    uint32_t run;
+    uint32_t run_lba;
+    FilePart *part;
+    FilePart *parts;
+
+    parts = (FilePart *) palloc();
+    pos = 0;
+    run = 0;
+    run_lba = 0;
+    while (1) {
+        if (lba < run_lba || lba >= run_lba + run) {
+            if (lba >= block_count) {
+                // The chain is broken.
+                pfree((void *) parts);
+                return 1;
+            }
+            // Read the part together with the blocks after it.
+            run = FS_RUN_BLOCKS;
+            if (lba + run > block_count)
+                run = block_count - lba;
+            read_cache(fs_dev, lba, run, (void *) parts);
+            run_lba = lba;
+        }
+        part = &parts[lba - run_lba];
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        // Every part but the last one is full.
+        pos += FILE_DATA_PER_PART;
+        lba = part->next_part >> addr_shift;
+    }
+    *tail_lba = lba;
+    *tail_pos = pos;
+    *size = pos + part->part_size;
+    pfree((void *) parts);
+
+    return 0;
+}
+
 // -----------------------------------------------------------------------------
 // list
 // ----
@@ -142,116 +457,276 @@ File *open(char *path, uint32_t len, char mode) {
 // -----------------------------------------------------------------------------
 
 void list(char *path, uint32_t len, int tree, int size) {
+    uint32_t lba;
+    LockSlot *slot;
+    Dir *d;
+    DirItem *item;
+
+    begin_fs_op();
+    if (find_dir_lba(path, len, &lba)) {
+        end_fs_op();
+        puts("Path not found!\n");
+        return;
+    }
+    // Entries are not added or removed while the directory is listed.
+    slot = lba ? lock_dir(lba, LOCK_READ) : 0;
+    d = open_dir_at(lba, tree);
+    item = (DirItem *) malloc(sizeof (DirItem));
+    while (readdir(d, item))
+        print_dir_item(item, tree, size);
+    free((void *) item);
+    closedir(d);
+    if (slot)
+        unlock_dir(slot, LOCK_READ);
+    end_fs_op();
+}
+
+// -----------------------------------------------------------------------------
+// opendir
+// -------
+// 
+// General      :   The function opens a directory for iterating over its
+//                  entries.
+//
+// Parameters   :
+//              path    -   The path to the directory in the file-system (In)
+//              len     -   The length of the path string (In)
+//              tree    -   Whether to walk into the sub-directories too
+//                          (boolean) (In)
+//
+// Return Value :   A pointer to an opened directory descriptor, or 0 if the
+//                  directory doesn't exist
+//
+// -----------------------------------------------------------------------------
+
+Dir *opendir(char *path, uint32_t len, int tree) {
+    uint32_t lba;
+
+    if (find_dir_lba(path, len, &lba))
+        return 0;
+    return open_dir_at(lba, tree);
+}
+
+// -----------------------------------------------------------------------------
+// find_dir_lba
+// ------------
+// 
+// General      :   The function finds the first part of a directory.
+//
+// Parameters   :
+//              path    -   The path to the directory in the file-system (In)
+//              len     -   The length of the path string (In)
+//              lba     -   A pointer to an unsigned int, which will contain the
+//                          LBA of the first part of the directory, or 0 if the
+//                          directory is empty (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int find_dir_lba(char *path, uint32_t len, uint32_t *lba) {
     uint32_t base_lba;
     uint32_t offset;
-    uint32_t lba;
     int status;
     DirPart *dir;
 
-    if ((len == 1 && path[0] == '/') || len == 0)
-        lba = root_lba;
-    else {
-        status = find_path(path, len, TYPE_DIR, 0, &base_lba, &offset);
-        if (status) {
-            puts("Path not found!\n");
-            return;
+    if ((len == 1 && path[0] == '/') || len == 0) {
+        *lba = root_lba;
+        return 0;
+    }
+    status = find_path(path, len, TYPE_DIR, 0, &base_lba, &offset);
+    if (status)
+        return status;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    // Read the part of the directory that contains the wanted directory.
+    read_cache(fs_dev, base_lba, 1, dir);
+    // An empty directory has no parts.
+    *lba = dir->entry[offset].addr & NOT_EMPTY ? dir->entry[offset].addr >> addr_shift : 0;
+    free((void *) dir);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// open_dir_at
+// -----------
+// 
+// General      :   The function opens a directory by the LBA of its first part
+//                  for iterating over its entries.
+//
+// Parameters   :
+//              lba     -   The LBA of the first part of the directory, or 0 if
+//                          the directory is empty (In)
+//              tree    -   Whether to walk into the sub-directories too
+//                          (boolean) (In)
+//
+// Return Value :   A pointer to an opened directory descriptor
+//
+// -----------------------------------------------------------------------------
+
+Dir *open_dir_at(uint32_t lba, int tree) {
+    Dir *d;
+
+    d = (Dir *) malloc(sizeof (Dir));
+    d->tree = tree;
+    d->depth = 0;
+    d->descend = 0;
+    d->part_lba = lba;
+    d->index = 0;
+    if (lba)
+        read_cache(fs_dev, lba, 1, (void *) &d->part);
+
+    return d;
+}
+
+// -----------------------------------------------------------------------------
+// readdir
+// -------
+// 
+// General      :   The function returns the next entry of an open directory.
+//                  The entries are taken from a copy of the current part, so
+//                  the device is read once per part. When walking a tree, a
+//                  non-empty sub-directory is walked right after its entry is
+//                  returned, as long as the walk is less than DIR_WALK_DEPTH
+//                  levels deep; deeper directories are returned but not
+//                  walked.
+//
+// Parameters   :
+//              d       -   A pointer to an open directory descriptor (In)
+//              item    -   A pointer to the item to fill with the entry (Out)
+//
+// Return Value :   1 if an entry was returned, 0 if there are no more entries
+//
+// -----------------------------------------------------------------------------
+
+int readdir(Dir *d, DirItem *item) {
+    uint32_t i;
+
+    if (d->descend) {
+        if (d->depth < DIR_WALK_DEPTH) {
+            // Remember where to continue once the sub-directory is done.
+            d->stack[d->depth].part_lba = d->part_lba;
+            d->stack[d->depth].index = d->index;
+            d->depth++;
+            d->part_lba = d->descend;
+            d->index = 0;
+            read_cache(fs_dev, d->part_lba, 1, (void *) &d->part);
         }
-        dir = (DirPart *) malloc(sizeof (DirPart));
-        // Read the part of the directory that contains the wanted directory.
-        read_bbb(fs_dev, base_lba, 1, dir);
-        if (!(dir->entry[offset].addr & NOT_EMPTY))
-            // If the directory to be listed is empty, return.
-            return;
-        lba = dir->entry[offset].addr >> 9;
+        d->descend = 0;
+    }
+
+    while (d->part_lba) {
+        while (d->index < DIR_ENTRIES_PER_PART) {
+            i = d->index++;
+            if (!(d->part.entry[i].addr & PRESENT))
+                continue;
+            memcpy(item->name, d->part.entry[i].name, NAME_LEN + 1);
+            item->addr = d->part.entry[i].addr;
+            item->level = d->depth;
+            item->part_lba = d->part_lba;
+            item->offset = i;
+            if (d->tree && (item->addr & IS_DIR) && (item->addr & NOT_EMPTY))
+                d->descend = item->addr >> addr_shift;
+            return 1;
+        }
+
+        // Move to the next part of the directory, or back to the parent.
+        if ((d->part.next_part & PRESENT) && (d->part.next_part & NOT_EMPTY)) {
+            d->part_lba = d->part.next_part >> addr_shift;
+            d->index = 0;
+        } else if (d->depth) {
+            d->depth--;
+            d->part_lba = d->stack[d->depth].part_lba;
+            d->index = d->stack[d->depth].index;
+        } else {
+            d->part_lba = 0;
+            break;
+        }
+        read_cache(fs_dev, d->part_lba, 1, (void *) &d->part);
     }
-    // List the directory contents.
-    _list(lba, tree, size, 0);
+
+    return 0;
 }
 
 // -----------------------------------------------------------------------------
-// _list
-// -----
+// closedir
+// --------
 // 
-// General      :   The function lists directory contents.
+// General      :   The function closes an open directory.
 //
 // Parameters   :
-//              lba     -   The LBA of the first directory-part (In)
-//              tree    -   Whether to list directory structure as tree
+//              d   -   A pointer to an open directory descriptor (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void closedir(Dir *d) {
+    free((void *) d);
+}
+
+// -----------------------------------------------------------------------------
+// print_dir_item
+// --------------
+// 
+// General      :   The function prints a directory entry as a line of a
+//                  listing.
+//
+// Parameters   :
+//              item    -   A pointer to the entry (In)
+//              tree    -   Whether the directory structure is listed as tree
 //                          (boolean) (In)
-//              size    -   Whether to print the size of each element (boolean)
+//              size    -   Whether to print the size of the element (boolean)
 //                          (In)
-//              level   -   The level of the directory in the directory tree
-//                          (used for recursion) (In)
 //
 // Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-void _list(uint32_t lba, int tree, int size, uint32_t level) {
-    uint32_t i, c, j;
-    DirPart *dir;
+void print_dir_item(DirItem *item, int tree, int size) {
+    uint32_t j;
     char *buff;
 
-    dir = (DirPart *) malloc(sizeof (DirPart));
-    while (1) {
-        // Read the directory-part.
-        read_bbb(fs_dev, lba, 1, (void *) dir);
-        // Set the entry-count to 0.
-        c = 0;
-        // For every entry in the directory-part:
-        for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
-            if (c >= dir->part_size)
-                // If the entry-count reaches or exceeds the size of the
-                // directory, quit searching for files to list.
-                break;
-            // If the entry contains a present entry:
-            if (dir->entry[i].addr & PRESENT) {
-                // Increment the entry-count.
-                c++;
-                /* The following code handles the graphic part of the listing.
-                 */
-                if (level) {
-                    for (j = 0; j < level - 1; j++)
-                        puts("    |");
-                    puts("    +--- ");
-                }
-                puts(dir->entry[i].name);
-                if (dir->entry[i].addr & IS_DIR)
-                    puts(" (DIR)");
-                else
-                    puts(" (FILE)");
-                if (size) {
-                    if (dir->entry[i].addr & NOT_EMPTY) {
-                        buff = (char *) malloc(100);
-                        puts(" (");
-                        puts(uitoa(get_size(dir->entry[i].addr >> 9), buff, BASE10));
-                        free((void *) buff);
-                    } else
-                        puts(" (0");
-                    if (dir->entry[i].addr & IS_DIR)
-                        puts(" entries)");
-                    else
-                        puts(" bytes)");
-                }
-                putc('\n');
-                if (tree && (dir->entry[i].addr & NOT_EMPTY) && (dir->entry[i].addr & IS_DIR)) {
-                    for (j = 0; j < level + 1; j++)
-                        puts("    |");
-                    putc('\n');
-                    // If the entry is of a directory which is not empty, and
-                    // the listing is recursive (tree), list the entry's
-                    // directory at the next level of the tree.
-                    _list(dir->entry[i].addr >> 9, tree, size, level + 1);
-                }
-            }
-        }
-        if (!(dir->next_part & PRESENT) || !(dir->next_part & NOT_EMPTY)) {
-            free((void *) dir);
-            // If there is not next part, stop listing.
-            return;
-        }
-        // Get the LBA of the next part of the directory.
-        lba = dir->next_part >> 9;
+    /* The following code handles the graphic part of the listing.
+     */
+    if (item->level) {
+        for (j = 0; j < item->level - 1; j++)
+            puts("    |");
+        puts("    +--- ");
+    }
+    puts(item->name);
+    if (item->addr & IS_DIR)
+        puts(" (DIR)");
+    else
+        puts(" (FILE)");
+    if (size) {
+        if (item->addr & NOT_EMPTY) {
+            buff = (char *) malloc(100);
+            puts(" (");
+            if (item->addr & IS_DIR)
+                puts(uitoa(get_dir_size(item->addr >> addr_shift), buff, BASE10));
+            else
+                puts(uitoa(get_file_size(item->addr >> addr_shift), buff, BASE10));
+            free((void *) buff);
+        } else if (item->addr & INLINE) {
+            // The size of an inline file is kept in place of its address.
+            buff = (char *) malloc(100);
+            puts(" (");
+            puts(uitoa(item->addr >> addr_shift, buff, BASE10));
+            free((void *) buff);
+        } else
+            puts(" (0");
+        if (item->addr & IS_DIR)
+            puts(" entries)");
+        else
+            puts(" bytes)");
+    }
+    putc('\n');
+    if (tree && (item->addr & NOT_EMPTY) && (item->addr & IS_DIR)) {
+        // The sub-directory is listed next, one level deeper.
+        for (j = 0; j < item->level + 1; j++)
+            puts("    |");
+        putc('\n');
     }
 }
 
@@ -276,7 +751,7 @@ uint32_t get_size(uint32_t part_lba) {
     part = (FilePart *) malloc(sizeof (FilePart));
     while (1) {
         // Read the part.
-        read_bbb(fs_dev, part_lba, 1, (void *) part);
+        read_cache(fs_dev, part_lba, 1, (void *) part);
         // Add its size to the total.
         size += part->part_size;
         if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
@@ -285,52 +760,295 @@ uint32_t get_size(uint32_t part_lba) {
             return size;
         }
         // Get the next part.
-        part_lba = part->next_part >> 9;
+        part_lba = part->next_part >> addr_shift;
     }
 }
 
 // -----------------------------------------------------------------------------
-// create
-// ------
+// get_file_size
+// -------------
 // 
-// General      :   The function create a file or a directory.
+// General      :   The function returns the size of a file in bytes.
 //
 // Parameters   :
-//              path        -   The path to the target in the file-system (In)
-//              len         -   The length of the path string (In)
-//              target_type -   The type of the target as int (see the DEFINEs
-//                              for values) (In)
+//              lba -   The LBA of the first part of the file (In)
 //
-// Return Value :   0 if successful, otherwise error specifier
+// Return Value :   The size of the file
 //
 // -----------------------------------------------------------------------------
 
-int create(char *path, uint32_t len, int target_type) {
-    char *dir_path;
-    char *target_name;
-    uint32_t dir_path_len;
-    uint32_t target_name_len;
-    uint32_t i;
-    uint32_t last;
-    uint32_t base_lba;
-    uint32_t offset;
-    int cut_found;
-    int status;
+uint32_t get_file_size(uint32_t lba) {
+    uint32_t size;
+    ExtentPart *header;
+
+    if (fs_version < FS_VERSION_EXTENTS)
+        return get_size(lba);
+
+    // The size of an extent-based file is kept in its header.
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, lba, 1, (void *) header);
+    size = header->size;
+    free((void *) header);
+    return size;
+}
+
+// -----------------------------------------------------------------------------
+// get_dir_size
+// ------------
+// 
+// General      :   The function returns the amount of entries in a directory.
+//                  The count is kept in the first part of the directory; a
+//                  directory written by an older kernel is counted once, and
+//                  the count is stored.
+//
+// Parameters   :
+//              lba -   The LBA of the first part of the directory (In)
+//
+// Return Value :   The amount of entries
+//
+// -----------------------------------------------------------------------------
+
+uint32_t get_dir_size(uint32_t lba) {
+    uint32_t size;
     DirPart *dir;
 
     dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, lba, 1, (void *) dir);
+    if (dir->entry_count & DIR_COUNT_VALID) {
+        size = dir->entry_count & DIR_COUNT_MASK;
+        free((void *) dir);
+        return size;
+    }
 
-    status = find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset);
-    if (!status) {
-        /* If the object already exist, overwrite it.
-         */
-        read_bbb(fs_dev, base_lba, 1, (void *) dir);
-        if (dir->entry[offset].addr & NOT_EMPTY)
-            delete_chain_parts(dir->entry[offset].addr >> 9);
+    // Count the entries of every part, and keep the count.
+    size = get_size(lba);
+    dir->entry_count = size | DIR_COUNT_VALID;
+    write_cache(fs_dev, lba, 1, (void *) dir);
+    free((void *) dir);
+    return size;
+}
+
+// -----------------------------------------------------------------------------
+// update_dir_size
+// ---------------
+// 
+// General      :   The function updates the amount of entries of a directory,
+//                  if the directory keeps it.
+//
+// Parameters   :
+//              lba     -   The LBA of the first part of the directory (In)
+//              delta   -   The change in the amount of entries (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void update_dir_size(uint32_t lba, int delta) {
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, lba, 1, (void *) dir);
+    if (dir->entry_count & DIR_COUNT_VALID) {
+        dir->entry_count = ((dir->entry_count + delta) & DIR_COUNT_MASK) | DIR_COUNT_VALID;
+        write_cache(fs_dev, lba, 1, (void *) dir);
+    }
+    free((void *) dir);
+}
+
+// -----------------------------------------------------------------------------
+// create
+// ------
+// 
+// General      :   The function create a file or a directory, as a single
+//                  journaled operation.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int create(char *path, uint32_t len, int target_type) {
+    uint32_t dir_lba;
+    int status;
+    LockSlot *slot;
+
+    begin_fs_op();
+    mark_fs_changed();
+    status = create_path(path, len, target_type, 0);
+    end_fs_op();
+    if (status == FS_EXCLUSIVE) {
+        // The directory in the way is freed with everything inside it, so no
+        // other operation may walk through it, and no file in it may be open.
+        begin_excl_fs_op();
+        status = 1;
+        // Open files are still written, and their entries may share the
+        // directory which contains the target.
+        if (!is_path_open(path, len) && !lock_parent_dir(path, len, LOCK_WRITE, &dir_lba, &slot)) {
+            journal_begin();
+            status = _create(path, len, target_type);
+            journal_end();
+            unlock_dir(slot, LOCK_WRITE);
+        }
+        release_fs();
+    }
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// create_path
+// -----------
+// 
+// General      :   The function creates a file or a directory while the
+//                  directory which contains it is locked. An existing file is
+//                  locked before it is overwritten, and the directory is not
+//                  held while the file is waited for.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//              f           -   A pointer to a file descriptor to fill with the
+//                              entry and keep it locked for, or 0. An existing
+//                              file is kept as is when the mode of the
+//                              descriptor is 'a' (In/Out)
+//
+// Return Value :   0 if successful, FS_EXCLUSIVE if a directory with parts is
+//                  in the way, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int create_path(char *path, uint32_t len, int target_type, File *f) {
+    uint32_t dir_lba;
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t addr;
+    int status;
+    LockSlot *dir_slot;
+    LockSlot *slot;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    while (1) {
+        if (lock_parent_dir(path, len, LOCK_WRITE, &dir_lba, &dir_slot)) {
+            // The directory has no part to be locked by yet.
+            status = fill_parent_dir(path, len);
+            if (status)
+                break;
+            continue;
+        }
+
+        addr = 0;
+        slot = 0;
+        status = 0;
+        if (!find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset)) {
+            read_cache(fs_dev, base_lba, 1, (void *) dir);
+            addr = dir->entry[offset].addr;
+            if (f && f->mode == 'a' && (addr & IS_DIR))
+                // Only a file is appended to.
+                status = 1;
+            else if ((addr & IS_DIR) && (addr & NOT_EMPTY))
+                status = FS_EXCLUSIVE;
+            else if (!(addr & IS_DIR)) {
+                // The file must not be open while it is overwritten.
+                slot = try_lock_file(base_lba, offset, LOCK_WRITE);
+                if (!slot) {
+                    unlock_dir(dir_slot, LOCK_WRITE);
+                    wait_file(base_lba, offset, LOCK_WRITE);
+                    continue;
+                }
+            }
+        }
+        if (status) {
+            unlock_dir(dir_slot, LOCK_WRITE);
+            break;
+        }
+
+        if (!slot || !f || f->mode != 'a') {
+            journal_begin();
+            status = _create(path, len, target_type);
+            journal_end();
+        }
+        if (!status && f && !slot) {
+            // Nobody has the new file open yet.
+            find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+            slot = try_lock_file(base_lba, offset, LOCK_WRITE);
+            if (!slot) {
+                unlock_dir(dir_slot, LOCK_WRITE);
+                wait_file(base_lba, offset, LOCK_WRITE);
+                continue;
+            }
+        }
+        unlock_dir(dir_slot, LOCK_WRITE);
+
+        if (f && !status) {
+            f->base_lba = base_lba;
+            f->offset = offset;
+            f->dir_lba = dir_lba;
+            f->lock = slot;
+        } else if (slot)
+            unlock_file(slot, LOCK_WRITE);
+        break;
+    }
+    free((void *) dir);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// _create
+// -------
+// 
+// General      :   The function create a file or a directory.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int _create(char *path, uint32_t len, int target_type) {
+    char *dir_path;
+    char *target_name;
+    uint32_t dir_path_len;
+    uint32_t target_name_len;
+    uint32_t i;
+    uint32_t last;
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t dir_lba;
+    int cut_found;
+    int status;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+
+    status = find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+    if (!status) {
+        /* If the object already exist, overwrite it.
+         */
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        if (dir->entry[offset].addr & NOT_EMPTY)
+            free_entry_parts(dir->entry[offset].addr);
+        else if (dir->entry[offset].addr & INLINE)
+            clear_inline(dir, offset);
+        if (dir->entry[offset].addr & IS_DIR)
+            // The blocks of the directory may be reused by other directories.
+            flush_dcache();
         dir->entry[offset].addr = PRESENT;
         if (target_type == TYPE_DIR)
             dir->entry[offset].addr |= IS_DIR;
-        write_bbb(fs_dev, base_lba, 1, (void *) dir);
+        write_cache(fs_dev, base_lba, 1, (void *) dir);
         free((void *) dir);
         return 0;
     }
@@ -369,6 +1087,7 @@ int create(char *path, uint32_t len, int target_type) {
     if (!dir_path_len) {
         // If the path of the directory that contains the target is empty, it is
         // the root directory. Find an empty entry for the target.
+        dir_lba = root_lba;
         find_empty_entry(root_lba, &base_lba, &offset);
     } else {
         /* Find an empty entry for the target in the directory specified in the
@@ -381,17 +1100,17 @@ int create(char *path, uint32_t len, int target_type) {
             // invalid.
             return 1;
         }
-        read_bbb(fs_dev, base_lba, 1, (void *) dir);
-        if (!(dir->entry[offset].addr | NOT_EMPTY)) {
-            dir->entry[offset].addr = (balloc() << 9) | PRESENT | IS_DIR | NOT_EMPTY;
-            write_bbb(fs_dev, base_lba, 1, (void *) dir);
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        if (!(dir->entry[offset].addr & NOT_EMPTY)) {
+            dir->entry[offset].addr = (balloc(base_lba) << addr_shift) | PRESENT | IS_DIR | NOT_EMPTY;
+            write_cache(fs_dev, base_lba, 1, (void *) dir);
         }
-        base_lba = dir->entry[offset].addr >> 9;
-        find_empty_entry(base_lba, &base_lba, &offset);
+        dir_lba = dir->entry[offset].addr >> addr_shift;
+        find_empty_entry(dir_lba, &base_lba, &offset);
     }
 
     // Read the directory-part that will contain the target entry.
-    read_bbb(fs_dev, base_lba, 1, (void *) dir);
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
     
     // The name length must not exceed the limit.
     if (target_name_len > NAME_LEN)
@@ -403,700 +1122,5461 @@ int create(char *path, uint32_t len, int target_type) {
     if (target_type == TYPE_DIR)
         // If the target is a directory, set the IS_DIR flag.
         dir->entry[offset].addr |= IS_DIR;
+    update_name_filter(dir);
 
     // Write the modified directory-part.
-    write_bbb(fs_dev, base_lba, 1, (void *) dir);
+    write_cache(fs_dev, base_lba, 1, (void *) dir);
+    // The name is no longer missing from the directory.
+    add_dentry(dir_lba, dir->entry[offset].name, base_lba, offset);
     free((void *) dir);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
-// delete
-// ------
+// fill_parent_dir
+// ---------------
 // 
-// General      :   The function deletes a file or a directory.
+// General      :   The function gives the directory which is to contain a path
+//                  its first part, if it is empty, so the directory has a
+//                  part to be locked by. The entry of the directory is changed
+//                  while the directory which contains it is locked.
 //
 // Parameters   :
-//              path        -   The path to the target in the file-system (In)
-//              len         -   The length of the path string (In)
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
 //
-// Return Value :   None
+// Return Value :   0 if successful, otherwise error specifier (the directory
+//                  does not exist)
 //
 // -----------------------------------------------------------------------------
 
-void delete(char *path, uint32_t len) {
+int fill_parent_dir(char *path, uint32_t len) {
+    uint32_t parent_len;
+    uint32_t dir_lba;
     uint32_t base_lba;
     uint32_t offset;
+    uint32_t lba;
     int status;
+    LockSlot *slot;
     DirPart *dir;
 
-    dir = (DirPart *) malloc(sizeof (DirPart));
+    parent_len = get_parent_len(path, len);
+    if (!parent_len)
+        // The root directory always has parts.
+        return 1;
+    if (lock_parent_dir(path, parent_len, LOCK_WRITE, &dir_lba, &slot))
+        return 1;
 
-    status = find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+    status = find_path(path, parent_len, TYPE_DIR, 0, &base_lba, &offset);
     if (!status) {
-        read_bbb(fs_dev, base_lba, 1, (void *) dir);
-        if (dir->entry[offset].addr & NOT_EMPTY)
-            // If the target is not empty, erase all of its parts.
-            delete_chain_parts(dir->entry[offset].addr >> 9);
-        // Zero all of the entry.
-        memset((void *) &dir->entry[offset], 0, sizeof (DirEntry));
-        // decrement the size of the directory.
-        dir->part_size--;
-        // Write the changes to the device.
-        write_bbb(fs_dev, base_lba, 1, (void *) dir);
+        dir = (DirPart *) malloc(sizeof (DirPart));
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        if (!(dir->entry[offset].addr & NOT_EMPTY)) {
+            journal_begin();
+            lba = balloc(base_lba);
+            if (lba) {
+                dir->entry[offset].addr = (lba << addr_shift) | PRESENT | IS_DIR | NOT_EMPTY;
+                write_cache(fs_dev, base_lba, 1, (void *) dir);
+            } else
+                status = 1;
+            journal_end();
+        }
         free((void *) dir);
     }
+    unlock_dir(slot, LOCK_WRITE);
+
+    return status;
 }
 
 // -----------------------------------------------------------------------------
-// read_from_file
-// --------------
+// delete
+// ------
 // 
-// General      :   The function reads data from an open file.
+// General      :   The function deletes a file or a directory.
 //
 // Parameters   :
-//              f       -   A pointer to an open file descriptor (In)
-//              count   -   The amount of bytes to read (In)
-//              data    -   A pointer of the buffer to write the data to (Out)
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
 //
-// Return Value :   The actual amount of bytes read
+// Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-uint32_t read_from_file(File *f, uint32_t count, char *data) {
-    uint32_t total;
-    uint32_t lba;
-    uint32_t seek;
-    uint32_t max;
-    DirPart *dir;
-    FilePart *part;
+void delete(char *path, uint32_t len) {
+    uint32_t dir_lba;
+    int status;
+    LockSlot *slot;
 
-    dir = (DirPart *) malloc(sizeof (DirPart));
-    read_bbb(fs_dev, f->base_lba, 1, (void *) dir);
-    if (!(dir->entry[f->offset].addr & PRESENT) || !(dir->entry[f->offset].addr & NOT_EMPTY)) {
-        free((void *) dir);
-        // If the file is empty or does not exist, return 0 (no bytes read).
-        return 0;
+    begin_fs_op();
+    mark_fs_changed();
+    status = delete_path(path, len);
+    end_fs_op();
+    if (status == FS_EXCLUSIVE) {
+        // The directory is freed with everything inside it, so no other
+        // operation may walk through it, and no file in it may be open.
+        begin_excl_fs_op();
+        // Open files are still written, and their entries may share the
+        // directory which contains the target.
+        if (!is_path_open(path, len) && !lock_parent_dir(path, len, LOCK_WRITE, &dir_lba, &slot)) {
+            journal_begin();
+            _delete(path, len);
+            journal_end();
+            unlock_dir(slot, LOCK_WRITE);
+        }
+        release_fs();
     }
-    // Get the LBA of the first part.
-    lba = dir->entry[f->offset].addr >> 9;
-    free((void *) dir);
-    part = (FilePart *) malloc(sizeof (FilePart));
-
-    // Set the total amount of byte read to 0.
-    total = 0;
-    
-    // Get the read seek.
-    seek = f->r_seek;
-    while (seek) {
-        read_bbb(fs_dev, lba, 1, part);
+}
 
-        if (part->part_size < FILE_DATA_PER_PART) {
-            if (seek >= part->part_size) {
-                free((void *) part);
-                // If this is the last part of the file and the seek is greater
-                // than the remaining size, return 0 (no bytes read)
-                return 0;
-            }
-            max = part->part_size - seek;
-            if (count > max) {
-                count = max;
-            }
-            total += count;
-            memcpy(data, (char *) part->data + seek, count);
+// -----------------------------------------------------------------------------
+// delete_path
+// -----------
+// 
+// General      :   The function deletes a file or an empty directory while the
+//                  directory which contains it is locked. A file is locked
+//                  before it is deleted, and the directory is not held while
+//                  the file is waited for.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//
+// Return Value :   0 if successful, FS_EXCLUSIVE if the target is a directory
+//                  with parts, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
 
-            free((void *) part);
-            return total;
-        }
-        if (seek < FILE_DATA_PER_PART) {
-            max = FILE_DATA_PER_PART - seek;
-            if (count <= max) {
-                total += count;
-                memcpy(data, (char *) part->data + seek, count);
-                free((void *) part);
-                return total;
-            }
-            total += max;
-            memcpy(data, (char *) part->data + seek, max);
-            data += max;
-            count -= max;
-            seek = 0;
-        } else
-            seek -= FILE_DATA_PER_PART;
-        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
-            free((void *) part);
-            return total;
-        }
-        lba = part->next_part >> 9;
-    }
+int delete_path(char *path, uint32_t len) {
+    uint32_t dir_lba;
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t addr;
+    LockSlot *dir_slot;
+    LockSlot *slot;
+    DirPart *dir;
 
-    while (count) {
-        read_bbb(fs_dev, lba, 1, part);
-        if (part->part_size < FILE_DATA_PER_PART) {
-            if (count > part->part_size)
-                count = part->part_size;
-            memcpy(data, (char *) part->data, count);
-            total += count;
-            free((void *) part);
-            return total;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    while (1) {
+        if (lock_parent_dir(path, len, LOCK_WRITE, &dir_lba, &dir_slot)) {
+            free((void *) dir);
+            return 1;
         }
-        if (count <= FILE_DATA_PER_PART) {
-            memcpy(data, (char *) part->data, count);
-            total += count;
-            free((void *) part);
-            return total;
+        if (find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset)) {
+            unlock_dir(dir_slot, LOCK_WRITE);
+            free((void *) dir);
+            return 1;
         }
-        memcpy(data, (char *) part->data, FILE_DATA_PER_PART);
-        count -= FILE_DATA_PER_PART;
-        data += FILE_DATA_PER_PART;
-        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
-            free((void *) part);
-            return total;
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        addr = dir->entry[offset].addr;
+        slot = 0;
+        if ((addr & IS_DIR) && !(addr & NOT_EMPTY))
+            // An empty directory has nothing to free.
+            break;
+        if (addr & IS_DIR) {
+            unlock_dir(dir_slot, LOCK_WRITE);
+            free((void *) dir);
+            return FS_EXCLUSIVE;
         }
-        lba = part->next_part >> 9;
+        // The file must not be open while it is deleted.
+        slot = try_lock_file(base_lba, offset, LOCK_WRITE);
+        if (slot)
+            break;
+        unlock_dir(dir_slot, LOCK_WRITE);
+        wait_file(base_lba, offset, LOCK_WRITE);
     }
-    free((void *) part);
-    return total;
+    free((void *) dir);
+
+    journal_begin();
+    _delete(path, len);
+    journal_end();
+    if (slot)
+        unlock_file(slot, LOCK_WRITE);
+    unlock_dir(dir_slot, LOCK_WRITE);
+
+    return 0;
 }
 
 // -----------------------------------------------------------------------------
-// write_to_file
-// -------------
+// _delete
+// -------
 // 
-// General      :   The function writes data to an open file.
+// General      :   The function deletes a file or a directory.
 //
 // Parameters   :
-//              f       -   A pointer to an open file descriptor (In)
-//              count   -   The amount of bytes to write (In)
-//              data    -   A pointer of the buffer to read the data from (In)
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
 //
 // Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-void write_to_file(File *f, char *data, uint32_t count) {
-    uint32_t lba;
-    uint32_t seek;
-    uint32_t new_size;
-    uint32_t max;
+void _delete(char *path, uint32_t len) {
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t dir_lba;
+    int status;
     DirPart *dir;
-    FilePart *part;
 
     dir = (DirPart *) malloc(sizeof (DirPart));
-    read_bbb(fs_dev, f->base_lba, 1, (void *) dir);
-    if (!(dir->entry[f->offset].addr & PRESENT) || !(dir->entry[f->offset].addr & NOT_EMPTY)) {
-        dir->entry[f->offset].addr = (balloc() << 9) | PRESENT | NOT_EMPTY;
-        write_bbb(fs_dev, f->base_lba, 1, (void *) dir);
-    }
-    lba = dir->entry[f->offset].addr >> 9;
-    free((void *) dir);
-    part = (FilePart *) malloc(sizeof (FilePart));
-
-    seek = f->w_seek;
-    while (seek) {
-        read_bbb(fs_dev, lba, 1, part);
-
-        if (seek < FILE_DATA_PER_PART) {
-            max = FILE_DATA_PER_PART - seek;
-            if (count <= max) {
-                memcpy((char *) part->data + seek, data, count);
-                new_size = seek + count;
-                if (new_size > part->part_size)
-                    part->part_size = new_size;
-                write_bbb(fs_dev, lba, 1, part);
+    status = find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+    if (!status && !find_parent_dir(path, len, &dir_lba)) {
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        if (dir->entry[offset].addr & NOT_EMPTY)
+            // If the target is not empty, erase all of its parts.
+            free_entry_parts(dir->entry[offset].addr);
+        else if (dir->entry[offset].addr & INLINE)
+            // The data of an inline file takes entries of the same part.
+            clear_inline(dir, offset);
+        if (dir->entry[offset].addr & IS_DIR)
+            // The blocks of the directory may be reused by other directories.
+            flush_dcache();
+        else
+            drop_dentry_at(base_lba, offset);
+        // Zero all of the entry.
+        memset((void *) &dir->entry[offset], 0, sizeof (DirEntry));
+        // decrement the size of the directory.
+        dir->part_size--;
+        update_name_filter(dir);
+        // Write the changes to the device.
+        write_cache(fs_dev, base_lba, 1, (void *) dir);
+        // The directory has one less entry.
+        update_dir_size(dir_lba, -1);
+    }
+    free((void *) dir);
+}
+
+// -----------------------------------------------------------------------------
+// rename
+// ------
+// 
+// General      :   The function moves a file or a directory to another path,
+//                  while both directories are locked. An open file is waited
+//                  for without holding the directories.
+//
+// Parameters   :
+//              src     -   The path to the target in the file-system (In)
+//              src_len -   The length of the target path string (In)
+//              dst     -   The new path of the target (In)
+//              dst_len -   The length of the new path string (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int rename(char *src, uint32_t src_len, char *dst, uint32_t dst_len) {
+    uint32_t src_lba;
+    uint32_t dst_lba;
+    uint32_t lba;
+    uint32_t base_lba;
+    uint32_t offset;
+    int status;
+    int cross;
+    int again;
+    int busy;
+    LockSlot *src_slot;
+    LockSlot *dst_slot;
+    LockSlot *slot;
+
+    // Ignore separators at the end of the paths.
+    while (src_len && *(src + src_len - 1) == '/')
+        src_len--;
+    while (dst_len && *(dst + dst_len - 1) == '/')
+        dst_len--;
+
+    begin_fs_op();
+    mark_fs_changed();
+    while (1) {
+        status = 1;
+        if (find_parent_dir(src, src_len, &src_lba))
+            break;
+        if (find_parent_dir(dst, dst_len, &dst_lba)) {
+            // The new directory has no part to be locked by yet.
+            if (fill_parent_dir(dst, dst_len))
+                break;
+            continue;
+        }
+
+        // Moves between directories are made one at a time, so two of them
+        // can not move directories into each other.
+        cross = src_lba != dst_lba;
+        if (cross)
+            write_lock(&rename_lock);
+        lock_dir_pair(src_lba, LOCK_WRITE, dst_lba, LOCK_WRITE, &src_slot, &dst_slot);
+        // The directories may have been moved before they were locked.
+        again = find_parent_dir(src, src_len, &lba) || lba != src_lba
+            || find_parent_dir(dst, dst_len, &lba) || lba != dst_lba;
+        slot = 0;
+        busy = 0;
+        if (!again && !find_path(src, src_len, TYPE_FILE, 0, &base_lba, &offset)) {
+            // The file must not be open while its entry moves.
+            slot = try_lock_file(base_lba, offset, LOCK_WRITE);
+            busy = !slot;
+        }
+        if (!again && !busy)
+            status = _rename(src, src_len, dst, dst_len);
+        if (slot)
+            unlock_file(slot, LOCK_WRITE);
+        unlock_dir_pair(src_slot, LOCK_WRITE, dst_slot, LOCK_WRITE);
+        if (cross)
+            write_unlock(&rename_lock);
+        if (busy)
+            // Wait for the file without holding the directories.
+            wait_file(base_lba, offset, LOCK_WRITE);
+        else if (!again)
+            break;
+    }
+    end_fs_op();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// _rename
+// -------
+// 
+// General      :   The function moves a file or a directory to another path,
+//                  as a single journaled operation. Only the directory entry
+//                  is moved, the parts of the target stay where they are.
+//
+// Parameters   :
+//              src     -   The path to the target in the file-system (In)
+//              src_len -   The length of the target path string (In)
+//              dst     -   The new path of the target (In)
+//              dst_len -   The length of the new path string (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int _rename(char *src, uint32_t src_len, char *dst, uint32_t dst_len) {
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t dir_lba;
+    uint32_t addr;
+    uint32_t size;
+    int status;
+    char *buff;
+    DirPart *dir;
+
+    if (find_path(src, src_len, TYPE_UNDEFINED, 0, &base_lba, &offset) ||
+            find_parent_dir(src, src_len, &dir_lba))
+        // The target must exist.
+        return 1;
+    if (!find_path(dst, dst_len, TYPE_UNDEFINED, 0, &base_lba, &offset))
+        // The target may not overwrite another file or directory.
+        return 1;
+    if (dst_len > src_len && !memcmp(src, dst, src_len) && *(dst + src_len) == '/')
+        // A directory can not be moved into itself.
+        return 1;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    journal_begin();
+
+    // Create an empty entry in the new path.
+    status = _create(dst, dst_len, TYPE_FILE);
+    if (!status) {
+        // Take the address of the target from its old entry, and clear it.
+        find_path(src, src_len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        addr = dir->entry[offset].addr;
+        if (addr & INLINE) {
+            // The data of an inline file stays in the old directory part, so
+            // it is moved with the entry.
+            buff = (char *) malloc(INLINE_MAX);
+            memset((void *) buff, 0, INLINE_MAX);
+            size = load_inline(dir, offset, buff);
+            clear_inline(dir, offset);
+        }
+        drop_dentry_at(base_lba, offset);
+        memset((void *) &dir->entry[offset], 0, sizeof (DirEntry));
+        dir->part_size--;
+        update_name_filter(dir);
+        write_cache(fs_dev, base_lba, 1, (void *) dir);
+        // The old directory has one less entry.
+        update_dir_size(dir_lba, -1);
+
+        // Link the parts of the target to the new entry.
+        find_path(dst, dst_len, TYPE_UNDEFINED, 0, &base_lba, &offset);
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        dir->entry[offset].addr = addr & INLINE ? PRESENT : addr;
+        write_cache(fs_dev, base_lba, 1, (void *) dir);
+        if (addr & INLINE) {
+            copy_inline(base_lba, offset, buff, size);
+            free((void *) buff);
+        }
+    }
+
+    journal_end();
+    free((void *) dir);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// clone
+// -----
+// 
+// General      :   The function creates a copy of a file, while the directory
+//                  of the copy is locked and the file is locked for reading.
+//                  A file which is open for writing is waited for without
+//                  holding the directories.
+//
+// Parameters   :
+//              src     -   The path to the file in the file-system (In)
+//              src_len -   The length of the file path string (In)
+//              dst     -   The path of the copy (In)
+//              dst_len -   The length of the copy path string (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int clone(char *src, uint32_t src_len, char *dst, uint32_t dst_len) {
+    uint32_t src_lba;
+    uint32_t dst_lba;
+    uint32_t lba;
+    uint32_t base_lba;
+    uint32_t offset;
+    int status;
+    int again;
+    int busy;
+    LockSlot *src_slot;
+    LockSlot *dst_slot;
+    LockSlot *slot;
+
+    begin_fs_op();
+    mark_fs_changed();
+    while (1) {
+        status = 1;
+        if (find_parent_dir(src, src_len, &src_lba))
+            break;
+        if (find_parent_dir(dst, dst_len, &dst_lba)) {
+            // The directory of the copy has no part to be locked by yet.
+            if (fill_parent_dir(dst, dst_len))
+                break;
+            continue;
+        }
+
+        lock_dir_pair(src_lba, LOCK_READ, dst_lba, LOCK_WRITE, &src_slot, &dst_slot);
+        // The directories may have been moved before they were locked.
+        again = find_parent_dir(src, src_len, &lba) || lba != src_lba
+            || find_parent_dir(dst, dst_len, &lba) || lba != dst_lba;
+        slot = 0;
+        busy = 0;
+        if (!again && !find_path(src, src_len, TYPE_FILE, 0, &base_lba, &offset)) {
+            // The data of the file must not change while it is shared.
+            slot = try_lock_file(base_lba, offset, LOCK_READ);
+            busy = !slot;
+        }
+        if (!again && !busy)
+            status = _clone(src, src_len, dst, dst_len);
+        if (slot)
+            unlock_file(slot, LOCK_READ);
+        unlock_dir_pair(src_slot, LOCK_READ, dst_slot, LOCK_WRITE);
+        if (busy)
+            // Wait for the file without holding the directories.
+            wait_file(base_lba, offset, LOCK_READ);
+        else if (!again)
+            break;
+    }
+    end_fs_op();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// _clone
+// ------
+// 
+// General      :   The function creates a copy of a file which shares the data
+//                  blocks of the file, as a single journaled operation. Only
+//                  the header of the file is copied; a shared block is copied
+//                  when either file writes to it. An inline file has no blocks,
+//                  so its data is copied; inline files exist only on
+//                  file-systems with extents.
+//
+// Parameters   :
+//              src     -   The path to the file in the file-system (In)
+//              src_len -   The length of the file path string (In)
+//              dst     -   The path of the copy (In)
+//              dst_len -   The length of the copy path string (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int _clone(char *src, uint32_t src_len, char *dst, uint32_t dst_len) {
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t addr;
+    uint32_t header_lba;
+    uint32_t size;
+    int status;
+    char *buff;
+    DirPart *dir;
+
+    if (find_path(src, src_len, TYPE_FILE, 0, &base_lba, &offset))
+        return 1;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    addr = dir->entry[offset].addr;
+    if (!(addr & INLINE) && (fs_version < FS_VERSION_EXTENTS || !refcount_active())) {
+        free((void *) dir);
+        // Only the extents of a file can be shared.
+        return 1;
+    }
+    if (!find_path(dst, dst_len, TYPE_UNDEFINED, 0, &base_lba, &offset)) {
+        free((void *) dir);
+        // The copy may not overwrite another file or directory.
+        return 1;
+    }
+
+    journal_begin();
+
+    status = _create(dst, dst_len, TYPE_FILE);
+    if (!status) {
+        find_path(src, src_len, TYPE_FILE, 0, &base_lba, &offset);
+        read_cache(fs_dev, base_lba, 1, (void *) dir);
+        addr = dir->entry[offset].addr;
+        if (addr & INLINE) {
+            // An inline file has no blocks to share, its data is copied.
+            buff = (char *) malloc(INLINE_MAX);
+            memset((void *) buff, 0, INLINE_MAX);
+            size = load_inline(dir, offset, buff);
+            find_path(dst, dst_len, TYPE_FILE, 0, &base_lba, &offset);
+            copy_inline(base_lba, offset, buff, size);
+            free((void *) buff);
+        } else if (addr & NOT_EMPTY) {
+            // No other file may change the owners of the blocks meanwhile.
+            write_lock(&alloc_lock);
+            status = share_extents(addr >> addr_shift, &header_lba);
+            write_unlock(&alloc_lock);
+            if (status) {
+                // Take the empty copy back; the directories are locked
+                // already, and this operation is the one that created it.
+                _delete(dst, dst_len);
+            } else {
+                // Link the copy of the header to the new entry.
+                find_path(dst, dst_len, TYPE_FILE, 0, &base_lba, &offset);
+                read_cache(fs_dev, base_lba, 1, (void *) dir);
+                dir->entry[offset].addr = (header_lba << addr_shift) | PRESENT | NOT_EMPTY;
+                write_cache(fs_dev, base_lba, 1, (void *) dir);
+            }
+        }
+    }
+
+    journal_end();
+    free((void *) dir);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// share_extents
+// -------------
+// 
+// General      :   The function copies the header of an extent-based file, and
+//                  adds an owner to every data block it maps. Both headers are
+//                  marked as shared. The frame index of a compressed file is
+//                  copied, since the files change their frames separately.
+//
+// Parameters   :
+//              lba         -   The LBA of the header of the file (In)
+//              copy_lba    -   A pointer to an unsigned int, which will contain
+//                              the LBA of the copy of the header (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int share_extents(uint32_t lba, uint32_t *copy_lba) {
+    uint32_t i;
+    uint32_t part_lba;
+    uint32_t next_lba;
+    uint32_t new_lba;
+    uint32_t prev_lba;
+    uint32_t index;
+    ExtentPart *part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+
+    // Check that every block can get another owner before changing anything.
+    part_lba = lba;
+    while (1) {
+        read_cache(fs_dev, part_lba, 1, (void *) part);
+        for (i = 0; i < part->part_size; i++) {
+            if (refcount_full(part->extent[i].start, part->extent[i].length)) {
                 free((void *) part);
-                return;
+                return 1;
             }
-            memcpy((char *) part->data + seek, data, max);
-            write_bbb(fs_dev, lba, 1, part);
-            data += max;
-            count -= max;
-            seek = 0;
+        }
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        part_lba = part->next_part >> addr_shift;
+    }
+
+    *copy_lba = 0;
+    prev_lba = 0;
+    index = 0;
+    part_lba = lba;
+    while (1) {
+        read_cache(fs_dev, part_lba, 1, (void *) part);
+        if (part_lba == lba) {
+            if (!(part->flags & EXTENT_SHARED)) {
+                // Writes to the file must check for shared blocks from now on.
+                part->flags |= EXTENT_SHARED;
+                write_cache(fs_dev, part_lba, 1, (void *) part);
+            }
+            // Every copy has a frame index of its own, which is copied last.
+            index = part->frame_index;
+            part->frame_index = 0;
+        }
+        new_lba = prev_lba ? balloc_after(prev_lba) : balloc(lba);
+        if (!new_lba) {
+            free((void *) part);
+            if (*copy_lba)
+                // Release the blocks the parts copied so far have shared.
+                free_entry_parts((*copy_lba << addr_shift) | PRESENT | NOT_EMPTY);
+            return 1;
+        }
+        for (i = 0; i < part->part_size; i++)
+            add_refcount(part->extent[i].start, part->extent[i].length, 1);
+
+        // Write the copy of the part as the end of the copied header.
+        next_lba = part->next_part;
+        part->next_part = 0;
+        write_cache(fs_dev, new_lba, 1, (void *) part);
+        if (prev_lba) {
+            read_cache(fs_dev, prev_lba, 1, (void *) part);
+            part->next_part = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+            write_cache(fs_dev, prev_lba, 1, (void *) part);
         } else
-            seek -= FILE_DATA_PER_PART;
+            *copy_lba = new_lba;
+        prev_lba = new_lba;
 
-        part->part_size = FILE_DATA_PER_PART;
-        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
-            part->next_part = (balloc() << 9) | PRESENT | NOT_EMPTY;
-            write_bbb(fs_dev, lba, 1, part);
+        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY))
+            break;
+        part_lba = next_lba >> addr_shift;
+    }
+
+    if ((index & PRESENT) && (index & NOT_EMPTY)) {
+        new_lba = copy_frame_index(index >> addr_shift, *copy_lba);
+        if (!new_lba) {
+            free((void *) part);
+            free_entry_parts((*copy_lba << addr_shift) | PRESENT | NOT_EMPTY);
+            return 1;
         }
-        lba = part->next_part >> 9;
+        read_cache(fs_dev, *copy_lba, 1, (void *) part);
+        part->frame_index = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+        write_cache(fs_dev, *copy_lba, 1, (void *) part);
+    }
+    free((void *) part);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// find_parent_dir
+// ---------------
+// 
+// General      :   The function finds the first part of the directory which
+//                  contains a file or a directory.
+//
+// Parameters   :
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
+//              dir_lba -   A pointer to an unsigned int, which will contain the
+//                          LBA of the first part of the directory (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int find_parent_dir(char *path, uint32_t len, uint32_t *dir_lba) {
+    uint32_t base_lba;
+    uint32_t offset;
+    DirPart *dir;
+
+    len = get_parent_len(path, len);
+    if (!len) {
+        *dir_lba = root_lba;
+        return 0;
     }
+    if (find_path(path, len, TYPE_DIR, 1, &base_lba, &offset))
+        return 1;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    *dir_lba = dir->entry[offset].addr >> addr_shift;
+    free((void *) dir);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// get_parent_len
+// --------------
+// 
+// General      :   The function finds the path of the directory which contains
+//                  a file or a directory.
+//
+// Parameters   :
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
+//
+// Return Value :   The length of the path of the directory, which is 0 for the
+//                  root directory
+//
+// -----------------------------------------------------------------------------
+
+uint32_t get_parent_len(char *path, uint32_t len) {
+    // Ignore separators at the end of the path.
+    while (len && *(path + len - 1) == '/')
+        len--;
+    // The parent is the path until the last separator.
+    while (len && *(path + len - 1) != '/')
+        len--;
+    while (len && *(path + len - 1) == '/')
+        len--;
+
+    return len;
+}
+
+// -----------------------------------------------------------------------------
+// read_from_file
+// --------------
+// 
+// General      :   The function reads data from an open file, and reads ahead
+//                  when the file is read sequentially.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to read (In)
+//              data    -   A pointer of the buffer to write the data to (Out)
+//
+// Return Value :   The actual amount of bytes read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t read_from_file(File *f, uint32_t count, char *data) {
+    uint32_t total;
+
+    // The data written through the descriptor may still be buffered.
+    flush(f);
+    check_cursors(f);
+    if (is_inline(f))
+        // The data is in the directory part, there is nothing to read ahead.
+        return read_inline(f, count, data);
+    if (fs_version >= FS_VERSION_EXTENTS)
+        total = read_from_extents(f, count, data);
+    else
+        total = read_from_parts(f, count, data);
+    read_ahead(f, count, total);
+
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// read_from_parts
+// ---------------
+// 
+// General      :   The function reads data from an open file of the chained
+//                  parts format.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to read (In)
+//              data    -   A pointer of the buffer to write the data to (Out)
+//
+// Return Value :   The actual amount of bytes read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t read_from_parts(File *f, uint32_t count, char *data) {
+    uint32_t total;
+    uint32_t lba;
+    uint32_t pos;
+    uint32_t seek;
+    uint32_t max;
+    uint32_t run;
+    uint32_t run_lba;
+    DirPart *dir;
+    FilePart *part;
+    FilePart *parts;
+
+    if (f->r_lba && f->r_seek >= f->r_pos) {
+        // Resume from the part that was touched last, instead of walking the
+        // chain from its beginning.
+        lba = f->r_lba;
+        pos = f->r_pos;
+    } else {
+        dir = (DirPart *) malloc(sizeof (DirPart));
+        read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+        if (!(dir->entry[f->offset].addr & PRESENT) || !(dir->entry[f->offset].addr & NOT_EMPTY)) {
+            free((void *) dir);
+            // If the file is empty or does not exist, return 0 (no bytes read).
+            return 0;
+        }
+        // Get the LBA of the first part.
+        lba = dir->entry[f->offset].addr >> addr_shift;
+        pos = 0;
+        free((void *) dir);
+    }
+    parts = (FilePart *) palloc();
+    run = 0;
+    run_lba = 0;
+
+    // Set the total amount of byte read to 0.
+    total = 0;
+
+    // Get the read seek, relative to the current part.
+    seek = f->r_seek - pos;
+    while (count) {
+        if (lba < run_lba || lba - run_lba >= run) {
+            if (lba >= block_count)
+                // The chain is broken, the read ends at it.
+                break;
+            // Read the parts that the rest of the read needs with a single
+            // command, assuming they are consecutive; only the parts which
+            // turn out to be linked consecutively are used.
+            run = (seek + count + FILE_DATA_PER_PART - 1) / FILE_DATA_PER_PART;
+            if (run > FS_RUN_BLOCKS)
+                run = FS_RUN_BLOCKS;
+            if (run > block_count - lba)
+                run = block_count - lba;
+            run_lba = lba;
+            read_cache(fs_dev, run_lba, run, (void *) parts);
+        }
+        part = &parts[lba - run_lba];
+        // Remember the position of the part for the next operation.
+        f->r_lba = lba;
+        f->r_pos = pos;
+
+        if (seek < part->part_size) {
+            // Copy the data of the part from the seek onwards.
+            max = part->part_size - seek;
+            if (count < max)
+                max = count;
+            memcpy(data, (char *) part->data + seek, max);
+            total += max;
+            data += max;
+            count -= max;
+            seek = 0;
+        } else
+            seek -= part->part_size;
+
+        if (part->part_size < FILE_DATA_PER_PART || !count)
+            // If this is the last part of the file, or all of the data was
+            // read, stop reading.
+            break;
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        lba = part->next_part >> addr_shift;
+        pos += FILE_DATA_PER_PART;
+    }
+    pfree((void *) parts);
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// read_ahead
+// ----------
+// 
+// General      :   The function reads the blocks which follow a sequential
+//                  read into the cache, before the reader asks for them. The
+//                  window grows while the stream continues, and a new window
+//                  is read once the reader has used half of the previous one.
+//                  The chained format is read ahead from the part the links
+//                  lead to, and only as far as its parts are linked
+//                  consecutively; compressed files read ahead the blocks of
+//                  whole frames.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes the reader asked for (In)
+//              total   -   The amount of bytes which were read (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void read_ahead(File *f, uint32_t count, uint32_t total) {
+    uint32_t unit;
+    uint32_t last;
+    uint32_t start;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t blocks;
+    uint32_t header_lba;
+    uint32_t i;
+    int compressed;
+    FilePart *part;
+
+    if (f->r_seek != f->ra_next || total < count) {
+        // The read is not part of a stream, or the stream reached the end of
+        // the file.
+        f->ra_next = f->r_seek + total;
+        f->ra_window = 0;
+        f->ra_end = 0;
+        return;
+    }
+    f->ra_next = f->r_seek + total;
+    if (!f->ra_window)
+        f->ra_window = READ_AHEAD_MIN;
+    else if (f->ra_window < READ_AHEAD_MAX)
+        f->ra_window *= 2;
+
+    // Find the last block, part or frame read, and the first one not read
+    // ahead. The window of a compressed file counts frames.
+    header_lba = fs_version >= FS_VERSION_EXTENTS ? get_file_lba(f) : 0;
+    compressed = header_lba && is_compressed(header_lba);
+    if (compressed)
+        unit = FRAME_SIZE;
+    else
+        unit = fs_version >= FS_VERSION_EXTENTS ? BLOCK_SIZE : FILE_DATA_PER_PART;
+    last = (f->ra_next - 1) / unit;
+    if (f->ra_end > last + f->ra_window / 2)
+        return;
+    start = f->ra_end > last ? f->ra_end : last + 1;
+    count = last + 1 + f->ra_window - start;
+
+    if (compressed) {
+        blocks = (get_file_size(header_lba) + FRAME_SIZE - 1) / FRAME_SIZE;
+        if (start >= blocks)
+            count = 0;
+        else if (count > blocks - start)
+            count = blocks - start;
+        start = prefetch_frames(f, header_lba, start, count);
+    } else if (fs_version >= FS_VERSION_EXTENTS) {
+        blocks = (get_file_size(header_lba) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (start >= blocks)
+            count = 0;
+        else if (count > blocks - start)
+            count = blocks - start;
+        while (count) {
+            lba = map_file_block(f, header_lba, start, &run);
+            if (!lba)
+                break;
+            if (run > count)
+                run = count;
+            prefetch_cache(fs_dev, lba, run);
+            start += run;
+            count -= run;
+        }
+    } else {
+        // Follow the links from the last part read to the first part not read
+        // ahead; the parts between them were read ahead already.
+        part = (FilePart *) malloc(sizeof (FilePart));
+        lba = f->r_lba;
+        for (i = f->r_pos / FILE_DATA_PER_PART; lba && i < start; i++) {
+            read_cache(fs_dev, lba, 1, (void *) part);
+            lba = 0;
+            if ((part->next_part & PRESENT) && (part->next_part & NOT_EMPTY)
+                    && (part->next_part >> addr_shift) < block_count)
+                lba = part->next_part >> addr_shift;
+        }
+        if (lba) {
+            if (count > block_count - lba)
+                count = block_count - lba;
+            // The window is read with a single command, but only the parts
+            // which are linked consecutively count as read ahead, so the next
+            // window starts from the link of the last one.
+            prefetch_cache(fs_dev, lba, count);
+            for (run = 1; run < count; run++) {
+                read_cache(fs_dev, lba + run - 1, 1, (void *) part);
+                if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)
+                        || (part->next_part >> addr_shift) != lba + run)
+                    break;
+            }
+            start += run;
+        }
+        free((void *) part);
+    }
+    f->ra_end = start;
+}
+
+// -----------------------------------------------------------------------------
+// write_to_file
+// -------------
+// 
+// General      :   The function writes data to an open file. Small writes are
+//                  gathered in the buffer of the file descriptor, and reach
+//                  the file-system, blocks allocated, only when the buffer is
+//                  flushed. Every write of a file opened for appending
+//                  continues the previous one.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to write (In)
+//              data    -   A pointer of the buffer to read the data from (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_to_file(File *f, char *data, uint32_t count) {
+    if (!count)
+        return;
+    if (f->wb_len && (f->w_seek < f->wb_seek || f->w_seek > f->wb_seek + f->wb_len ||
+            f->w_seek + count > f->wb_seek + PAGE_SIZE))
+        // The write does not continue the buffered data.
+        flush(f);
+
+    if (!f->wb_len && count >= PAGE_SIZE) {
+        // There is nothing to gather in a write this large.
+        write_through(f, data, count);
+    } else {
+        if (!f->wb_len) {
+            if (!f->w_buff)
+                f->w_buff = (char *) palloc();
+            f->wb_seek = f->w_seek;
+        }
+        memcpy(f->w_buff + (f->w_seek - f->wb_seek), data, count);
+        if (f->w_seek + count > f->wb_seek + f->wb_len)
+            f->wb_len = f->w_seek + count - f->wb_seek;
+    }
+
+    if (f->mode == 'a')
+        // The next write of an appending file continues this one.
+        f->w_seek += count;
+}
+
+// -----------------------------------------------------------------------------
+// write_through
+// -------------
+// 
+// General      :   The function writes data to an open file without buffering
+//                  it, as a single journaled operation. The directory of the
+//                  file is locked while the write may change its directory
+//                  part.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to write (In)
+//              data    -   A pointer of the buffer to read the data from (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_through(File *f, char *data, uint32_t count) {
+    LockSlot *slot;
+
+    slot = 0;
+    if (!get_file_lba(f))
+        // The data goes to the directory part, or the first part of the file
+        // is linked to it.
+        slot = lock_dir(f->dir_lba, LOCK_WRITE);
+    check_cursors(f);
+    mark_fs_changed();
+    journal_begin();
+    if (write_inline(f, data, count)) {
+        // The data does not fit in the directory part, move it to parts of
+        // its own first.
+        spill_inline(f);
+        if (fs_version >= FS_VERSION_EXTENTS)
+            write_to_extents(f, data, count);
+        else
+            write_to_parts(f, data, count);
+    }
+    journal_end();
+    if (slot)
+        unlock_dir(slot, LOCK_WRITE);
+}
+
+// -----------------------------------------------------------------------------
+// flush
+// -----
+// 
+// General      :   The function writes the buffered data of an open file to
+//                  the file-system.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void flush(File *f) {
+    uint32_t seek;
+
+    if (!f->wb_len)
+        return;
+
+    // The buffered data is written at the seek it was written to.
+    seek = f->w_seek;
+    f->w_seek = f->wb_seek;
+    write_through(f, f->w_buff, f->wb_len);
+    f->w_seek = seek;
+    f->wb_len = 0;
+}
+
+// -----------------------------------------------------------------------------
+// close
+// -----
+// 
+// General      :   The function flushes an open file, unlocks it and frees its
+//                  descriptor.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void close(File *f) {
+    flush(f);
+    unlock_file(f->lock, f->mode == 'r' ? LOCK_READ : LOCK_WRITE);
+    if (f->w_buff)
+        pfree((void *) f->w_buff);
+    free((void *) f);
+    CLEAR_INTS();
+    open_count--;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// is_inline
+// ---------
+// 
+// General      :   The function checks whether the data of an open file is
+//                  kept in its directory part.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   1 if the file is inline, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int is_inline(File *f) {
+    uint32_t addr;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    addr = dir->entry[f->offset].addr;
+    free((void *) dir);
+    return (addr & INLINE) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// read_inline
+// -----------
+// 
+// General      :   The function reads data from an open inline file. The data
+//                  is in the directory part of the entry, so no other block is
+//                  read.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to read (In)
+//              data    -   A pointer of the buffer to write the data to (Out)
+//
+// Return Value :   The actual amount of bytes read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t read_inline(File *f, uint32_t count, char *data) {
+    uint32_t size;
+    char *buff;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    buff = (char *) malloc(INLINE_MAX);
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    size = load_inline(dir, f->offset, buff);
+    free((void *) dir);
+
+    if (f->r_seek >= size)
+        count = 0;
+    else if (count > size - f->r_seek)
+        count = size - f->r_seek;
+    memcpy(data, buff + f->r_seek, count);
+    free((void *) buff);
+
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// write_inline
+// ------------
+// 
+// General      :   The function writes data to an open file whose data fits in
+//                  the free entries of its directory part, without allocating
+//                  any block. Only file-systems with extents keep inline files,
+//                  since older kernels mount EDENFS100 and would take the
+//                  entries of the data for free ones.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              data    -   A pointer of the buffer to read the data from (In)
+//              count   -   The amount of bytes to write (In)
+//
+// Return Value :   0 if the data was written inline, otherwise 1 (nothing is
+//                  written)
+//
+// -----------------------------------------------------------------------------
+
+int write_inline(File *f, char *data, uint32_t count) {
+    uint32_t addr;
+    uint32_t size;
+    int status;
+    char *buff;
+    DirPart *dir;
+
+    if (fs_version < FS_VERSION_EXTENTS)
+        return 1;
+    if (f->w_seek > INLINE_MAX || count > INLINE_MAX - f->w_seek)
+        return 1;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    addr = dir->entry[f->offset].addr;
+    if (addr & NOT_EMPTY) {
+        // The file already has parts.
+        free((void *) dir);
+        return 1;
+    }
+
+    buff = (char *) malloc(INLINE_MAX);
+    memset((void *) buff, 0, INLINE_MAX);
+    size = addr & INLINE ? load_inline(dir, f->offset, buff) : 0;
+    memcpy(buff + f->w_seek, data, count);
+    if (f->w_seek + count > size)
+        size = f->w_seek + count;
+    status = store_inline(dir, f->offset, buff, size);
+    if (!status)
+        write_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    free((void *) buff);
+    free((void *) dir);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// spill_inline
+// ------------
+// 
+// General      :   The function moves the data of an inline file, which
+//                  outgrew its directory part, to parts of its own.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void spill_inline(File *f) {
+    uint32_t size;
+    uint32_t seek;
+    char *buff;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    if (!(dir->entry[f->offset].addr & INLINE)) {
+        free((void *) dir);
+        return;
+    }
+
+    buff = (char *) malloc(INLINE_MAX);
+    size = load_inline(dir, f->offset, buff);
+    clear_inline(dir, f->offset);
+    dir->entry[f->offset].addr = PRESENT;
+    write_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    free((void *) dir);
+
+    // Write the data at the start of the now empty file.
+    seek = f->w_seek;
+    f->w_seek = 0;
+    f->w_lba = 0;
+    f->m_run = 0;
+    if (fs_version >= FS_VERSION_EXTENTS)
+        write_to_extents(f, buff, size);
+    else
+        write_to_parts(f, buff, size);
+    f->w_seek = seek;
+    free((void *) buff);
+}
+
+// -----------------------------------------------------------------------------
+// load_inline
+// -----------
+// 
+// General      :   The function gathers the data of an inline file from the
+//                  entries of its directory part.
+//
+// Parameters   :
+//              dir     -   A pointer to the directory part (In)
+//              offset  -   The offset of the entry of the file (In)
+//              buff    -   A pointer to a buffer of INLINE_MAX bytes, which
+//                          will contain the data (Out)
+//
+// Return Value :   The size of the file
+//
+// -----------------------------------------------------------------------------
+
+uint32_t load_inline(DirPart *dir, uint32_t offset, char *buff) {
+    uint32_t i;
+    uint32_t addr;
+
+    for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
+        addr = dir->entry[i].addr;
+        if (!(addr & PRESENT) && (addr & INLINE) && INLINE_OWNER(addr) == offset
+                && (addr >> INLINE_INDEX_SHIFT) < INLINE_SLOTS)
+            memcpy(buff + (addr >> INLINE_INDEX_SHIFT) * INLINE_CHUNK, dir->entry[i].name,
+                INLINE_CHUNK);
+    }
+    return dir->entry[offset].addr >> addr_shift;
+}
+
+// -----------------------------------------------------------------------------
+// store_inline
+// ------------
+// 
+// General      :   The function keeps the data of a file in the free entries
+//                  of its directory part. Every entry holds a chunk of the
+//                  data in place of a name, and the offset of the entry of the
+//                  file and the index of the chunk in place of an address.
+//
+// Parameters   :
+//              dir     -   A pointer to the directory part (In/Out)
+//              offset  -   The offset of the entry of the file (In)
+//              buff    -   A pointer to the data, padded with 0's to whole
+//                          chunks (In)
+//              size    -   The size of the data (In)
+//
+// Return Value :   0 if successful, otherwise 1 if the part has not enough
+//                  free entries (nothing is changed)
+//
+// -----------------------------------------------------------------------------
+
+int store_inline(DirPart *dir, uint32_t offset, char *buff, uint32_t size) {
+    uint32_t i;
+    uint32_t need;
+    uint32_t have;
+    uint32_t addr;
+
+    // Count the entries the data may take: the ones it takes already, and
+    // the free ones.
+    need = (size + INLINE_CHUNK - 1) / INLINE_CHUNK;
+    have = 0;
+    for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
+        addr = dir->entry[i].addr;
+        if (i != offset && (!(addr & (PRESENT | INLINE))
+                || (!(addr & PRESENT) && INLINE_OWNER(addr) == offset)))
+            have++;
+    }
+    if (have < need)
+        return 1;
+
+    clear_inline(dir, offset);
+    have = 0;
+    for (i = 0; i < DIR_ENTRIES_PER_PART && have < need; i++) {
+        if (i == offset || (dir->entry[i].addr & (PRESENT | INLINE)))
+            continue;
+        memcpy(dir->entry[i].name, buff + have * INLINE_CHUNK, INLINE_CHUNK);
+        dir->entry[i].addr = (have << INLINE_INDEX_SHIFT) | (offset << INLINE_OWNER_SHIFT) | INLINE;
+        have++;
+    }
+    dir->entry[offset].addr = (size << addr_shift) | PRESENT | INLINE;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// clear_inline
+// ------------
+// 
+// General      :   The function frees the entries which hold the data of an
+//                  inline file.
+//
+// Parameters   :
+//              dir     -   A pointer to the directory part (In/Out)
+//              offset  -   The offset of the entry of the file (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void clear_inline(DirPart *dir, uint32_t offset) {
+    uint32_t i;
+    uint32_t addr;
+
+    for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
+        addr = dir->entry[i].addr;
+        if (!(addr & PRESENT) && (addr & INLINE) && INLINE_OWNER(addr) == offset)
+            memset((void *) &dir->entry[i], 0, sizeof (DirEntry));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// copy_inline
+// -----------
+// 
+// General      :   The function gives an empty file the data of an inline file.
+//                  The data is kept inline if it fits in the free entries of
+//                  the directory part of the file, otherwise it is written to
+//                  parts of its own.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the file (In)
+//              offset      -   The offset of the entry of the file (In)
+//              buff        -   A pointer to the data, padded with 0's to whole
+//                              chunks (In)
+//              size        -   The size of the data (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void copy_inline(uint32_t base_lba, uint32_t offset, char *buff, uint32_t size) {
+    int status;
+    DirPart *dir;
+    File *f;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    status = store_inline(dir, offset, buff, size);
+    if (!status)
+        write_cache(fs_dev, base_lba, 1, (void *) dir);
+    free((void *) dir);
+    if (!status)
+        return;
+
+    // The part is full; the file is written like any other, through a
+    // descriptor of its own which is never opened.
+    f = (File *) malloc(sizeof (File));
+    memset((void *) f, 0, sizeof (File));
+    f->base_lba = base_lba;
+    f->offset = offset;
+    f->mode = 'w';
+    if (fs_version >= FS_VERSION_EXTENTS)
+        write_to_extents(f, buff, size);
+    else
+        write_to_parts(f, buff, size);
+    free((void *) f);
+}
+
+// -----------------------------------------------------------------------------
+// write_to_parts
+// --------------
+// 
+// General      :   The function writes data to an open file of the chained
+//                  parts format. A long write may be committed in steps, each
+//                  of which leaves a whole chain.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to write (In)
+//              data    -   A pointer of the buffer to read the data from (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_to_parts(File *f, char *data, uint32_t count) {
+    uint32_t lba;
+    uint32_t pos;
+    uint32_t seek;
+    uint32_t max;
+    uint32_t run;
+    uint32_t run_lba;
+    uint32_t res_lba;
+    uint32_t reserved;
+    int changed;
+    int fresh;
+    DirPart *dir;
+    FilePart *part;
+    FilePart *parts;
+
+    reserved = 0;
+    res_lba = 0;
+    fresh = 0;
+
+    if (f->w_lba && f->w_seek >= f->w_pos) {
+        // Resume from the part that was touched last, instead of walking the
+        // chain from its beginning.
+        lba = f->w_lba;
+        pos = f->w_pos;
+    } else {
+        dir = (DirPart *) malloc(sizeof (DirPart));
+        read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+        if (!(dir->entry[f->offset].addr & PRESENT) || !(dir->entry[f->offset].addr & NOT_EMPTY)) {
+            // Reserve all the parts of the new file at once.
+            res_lba = balloc_n((f->w_seek + count) / FILE_DATA_PER_PART + 1, f->base_lba, &reserved);
+            if (!reserved) {
+                free((void *) dir);
+                return;
+            }
+            dir->entry[f->offset].addr = (res_lba << addr_shift) | PRESENT | NOT_EMPTY;
+            write_cache(fs_dev, f->base_lba, 1, (void *) dir);
+            res_lba++;
+            reserved--;
+            fresh = 1;
+        }
+        lba = dir->entry[f->offset].addr >> addr_shift;
+        pos = 0;
+        free((void *) dir);
+    }
+    parts = (FilePart *) palloc();
+    run = 0;
+    run_lba = 0;
+
+    // Get the write seek, relative to the current part.
+    seek = f->w_seek - pos;
+    while (1) {
+        if (run && (lba != run_lba + run || run == FS_RUN_BLOCKS)) {
+            // The part does not continue the run of modified parts, write the
+            // run with a single command.
+            write_cache(fs_dev, run_lba, run, (void *) parts);
+            run = 0;
+            if (!fresh && !reserved) {
+                // The parts written so far are linked to written parts, and
+                // no block is allocated for later; let them be committed.
+                journal_end();
+                journal_begin();
+            }
+        }
+        part = &parts[run];
+        if (fresh)
+            // A new part is not read, its contents are not used.
+            memset((void *) part, 0, sizeof (FilePart));
+        else
+            read_cache(fs_dev, lba, 1, (void *) part);
+        fresh = 0;
+        // Remember the position of the part for the next operation.
+        f->w_lba = lba;
+        f->w_pos = pos;
+        changed = 0;
+
+        if (seek < FILE_DATA_PER_PART) {
+            // Copy the data to the part from the seek onwards.
+            max = FILE_DATA_PER_PART - seek;
+            if (count < max)
+                max = count;
+            memcpy((char *) part->data + seek, data, max);
+            if (seek + max > part->part_size)
+                part->part_size = seek + max;
+            data += max;
+            count -= max;
+            seek = 0;
+            changed = 1;
+        } else
+            seek -= FILE_DATA_PER_PART;
+
+        if ((count || seek) && (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))) {
+            if (!reserved && ((lba + 1) & (cluster_blocks - 1))) {
+                // The rest of the cluster of the last part belongs to the file.
+                res_lba = lba + 1;
+                reserved = cluster_blocks - (res_lba & (cluster_blocks - 1));
+            } else if (!reserved)
+                // Reserve the parts which the rest of the write needs at once,
+                // right after this part.
+                res_lba = balloc_n((seek + count + FILE_DATA_PER_PART - 1) / FILE_DATA_PER_PART,
+                    lba + 1, &reserved);
+            if (reserved) {
+                part->next_part = (res_lba << addr_shift) | PRESENT | NOT_EMPTY;
+                res_lba++;
+                reserved--;
+                fresh = 1;
+                changed = 1;
+            } else {
+                // The device is full, stop writing.
+                count = 0;
+                seek = 0;
+            }
+        }
+        if ((count || seek) && part->part_size != FILE_DATA_PER_PART) {
+            // The write continues past this part, so it must be full.
+            part->part_size = FILE_DATA_PER_PART;
+            changed = 1;
+        }
+        if (changed) {
+            // Add the part to the run of modified parts.
+            if (!run)
+                run_lba = lba;
+            run++;
+        }
+
+        if (!count && !seek)
+            break;
+        lba = part->next_part >> addr_shift;
+        pos += FILE_DATA_PER_PART;
+    }
+    if (run)
+        write_cache(fs_dev, run_lba, run, (void *) parts);
+    pfree((void *) parts);
+    // Release the clusters which were reserved but not used. The rest of the
+    // cluster of the last part stays with the file.
+    while (reserved && (res_lba & (cluster_blocks - 1))) {
+        res_lba++;
+        reserved--;
+    }
+    while (reserved) {
+        bfree(res_lba);
+        res_lba += cluster_blocks;
+        reserved -= cluster_blocks;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// read_from_extents
+// -----------------
+// 
+// General      :   The function reads data from an open extent-based file.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              count   -   The amount of bytes to read (In)
+//              data    -   A pointer of the buffer to write the data to (Out)
+//
+// Return Value :   The actual amount of bytes read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t read_from_extents(File *f, uint32_t count, char *data) {
+    uint32_t total;
+    uint32_t header_lba;
+    uint32_t size;
+    uint32_t seek;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t in;
+    uint32_t max;
+    void *buff;
+
+    header_lba = get_file_lba(f);
+    if (!header_lba)
+        // If the file is empty or does not exist, return 0 (no bytes read).
+        return 0;
+    if (is_compressed(header_lba))
+        return read_from_frames(f, header_lba, count, data);
+    size = get_file_size(header_lba);
+    seek = f->r_seek;
+    if (seek >= size)
+        return 0;
+    if (count > size - seek)
+        count = size - seek;
+
+    buff = 0;
+    total = 0;
+    while (count) {
+        // Find the block of the seek, and how many blocks follow it on the
+        // device.
+        lba = map_file_block(f, header_lba, seek / BLOCK_SIZE, &run);
+        if (!lba)
+            break;
+        in = seek % BLOCK_SIZE;
+        if (in || count < BLOCK_SIZE) {
+            // A block which is only partly read goes through a bounce buffer.
+            if (!buff)
+                buff = malloc(BLOCK_SIZE);
+            read_cache(fs_dev, lba, 1, buff);
+            max = BLOCK_SIZE - in;
+            if (count < max)
+                max = count;
+            memcpy(data, buff + in, max);
+        } else {
+            // Whole blocks are read with a single command straight to the
+            // buffer of the caller.
+            max = count / BLOCK_SIZE;
+            if (run > max)
+                run = max;
+            read_cache(fs_dev, lba, run, (void *) data);
+            max = run * BLOCK_SIZE;
+        }
+        total += max;
+        data += max;
+        seek += max;
+        count -= max;
+    }
+    if (buff)
+        free(buff);
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// write_to_extents
+// ----------------
+// 
+// General      :   The function writes data to an open extent-based file.
+//
+// Parameters   :
+//              f       -   A pointer to an open file descriptor (In)
+//              data    -   A pointer of the buffer to read the data from (In)
+//              count   -   The amount of bytes to write (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_to_extents(File *f, char *data, uint32_t count) {
+    uint32_t header_lba;
+    uint32_t seek;
+    uint32_t end;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t in;
+    uint32_t max;
+    int status;
+    DirPart *dir;
+    ExtentPart *header;
+    void *buff;
+
+    header_lba = get_file_lba(f);
+    if (!header_lba) {
+        // Create the header of the file next to its directory.
+        header_lba = balloc(f->base_lba);
+        if (!header_lba)
+            return;
+        dir = (DirPart *) malloc(sizeof (DirPart));
+        read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+        dir->entry[f->offset].addr = (header_lba << addr_shift) | PRESENT | NOT_EMPTY;
+        write_cache(fs_dev, f->base_lba, 1, (void *) dir);
+        free((void *) dir);
+    } else if (is_compressed(header_lba)) {
+        write_to_frames(f, header_lba, data, count);
+        return;
+    }
+
+    seek = f->w_seek;
+    end = seek + count;
+    // Allocate the blocks which the file is missing. The blocks which the
+    // data covers entirely are not zeroed.
+    if (extend_file(header_lba, (end + BLOCK_SIZE - 1) / BLOCK_SIZE,
+            (seek + BLOCK_SIZE - 1) / BLOCK_SIZE, end / BLOCK_SIZE))
+        return;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    if (header->flags & EXTENT_SHARED) {
+        // Blocks shared with clones of the file are copied before they are
+        // written, which changes the extents of the file.
+        status = unshare_blocks(header_lba, seek, end);
+        f->m_run = 0;
+        if (status) {
+            free((void *) header);
+            return;
+        }
+    }
+
+    buff = 0;
+    while (count) {
+        lba = map_file_block(f, header_lba, seek / BLOCK_SIZE, &run);
+        if (!lba)
+            break;
+        in = seek % BLOCK_SIZE;
+        if (in || count < BLOCK_SIZE) {
+            // A block which is only partly written must be read first.
+            if (!buff)
+                buff = malloc(BLOCK_SIZE);
+            read_cache(fs_dev, lba, 1, buff);
+            max = BLOCK_SIZE - in;
+            if (count < max)
+                max = count;
+            memcpy(buff + in, data, max);
+            write_cache(fs_dev, lba, 1, buff);
+        } else {
+            // Whole blocks are written with a single command straight from
+            // the buffer of the caller.
+            max = count / BLOCK_SIZE;
+            if (run > max)
+                run = max;
+            write_cache(fs_dev, lba, run, (void *) data);
+            max = run * BLOCK_SIZE;
+        }
+        data += max;
+        seek += max;
+        count -= max;
+    }
+    if (buff)
+        free(buff);
+
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    if (end > header->size) {
+        // Update the size of the file.
+        header->size = end;
+        write_cache(fs_dev, header_lba, 1, (void *) header);
+    }
+    free((void *) header);
+}
+
+// -----------------------------------------------------------------------------
+// get_file_lba
+// ------------
+// 
+// General      :   The function returns the LBA of the first part of an open
+//                  file.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   The LBA of the first part, or 0 if the file is empty
+//
+// -----------------------------------------------------------------------------
+
+uint32_t get_file_lba(File *f) {
+    uint32_t addr;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    addr = dir->entry[f->offset].addr;
+    free((void *) dir);
+    if (!(addr & PRESENT) || !(addr & NOT_EMPTY))
+        return 0;
+    return addr >> addr_shift;
+}
+
+// -----------------------------------------------------------------------------
+// map_file_block
+// --------------
+// 
+// General      :   The function finds the LBA of a block of an open extent-based
+//                  file. The last mapped extent is kept in the file descriptor,
+//                  so sequential accesses do not read the header again.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              block       -   The index of the block in the file (In)
+//              run         -   A pointer to an unsigned int, which will contain
+//                              the amount of blocks from the block to the end
+//                              of its extent (Out)
+//
+// Return Value :   The LBA of the block, or 0 if the file has no such block
+//
+// -----------------------------------------------------------------------------
+
+uint32_t map_file_block(File *f, uint32_t header_lba, uint32_t block, uint32_t *run) {
+    uint32_t lba;
+
+    if (f->m_run && block >= f->m_block && block < f->m_block + f->m_run) {
+        // The block is in the last mapped extent.
+        *run = f->m_run - (block - f->m_block);
+        return f->m_lba + (block - f->m_block);
+    }
+
+    lba = map_block(header_lba, block, run);
+    if (lba) {
+        f->m_block = block;
+        f->m_lba = lba;
+        f->m_run = *run;
+    }
+    return lba;
+}
+
+// -----------------------------------------------------------------------------
+// check_cursors
+// -------------
+// 
+// General      :   The function drops the block cursors which an open file
+//                  descriptor keeps, if blocks of any file were moved or freed
+//                  since they were found, so the descriptor does not use
+//                  blocks which no longer belong to its file.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void check_cursors(File *f) {
+    if (f->m_gen == map_generation)
+        return;
+    f->r_lba = 0;
+    f->r_pos = 0;
+    f->w_lba = 0;
+    f->w_pos = 0;
+    f->m_run = 0;
+    f->ra_end = 0;
+    f->m_gen = map_generation;
+}
+
+// -----------------------------------------------------------------------------
+// map_block
+// ---------
+// 
+// General      :   The function finds the LBA of a block of an extent-based
+//                  file. The extents of every header part are sorted, so the
+//                  extent is found with a binary search.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              block       -   The index of the block in the file (In)
+//              run         -   A pointer to an unsigned int, which will contain
+//                              the amount of blocks from the block to the end
+//                              of its extent (Out)
+//
+// Return Value :   The LBA of the block, or 0 if the file has no such block
+//
+// -----------------------------------------------------------------------------
+
+uint32_t map_block(uint32_t header_lba, uint32_t block, uint32_t *run) {
+    uint32_t low;
+    uint32_t high;
+    uint32_t mid;
+    uint32_t lba;
+    Extent *extent;
+    ExtentPart *part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    lba = header_lba;
+    while (1) {
+        read_cache(fs_dev, lba, 1, (void *) part);
+        if (part->part_size) {
+            extent = &part->extent[part->part_size - 1];
+            if (block < extent->logical + extent->length)
+                // The block is mapped by this part.
+                break;
+        }
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
+            free((void *) part);
+            return 0;
+        }
+        lba = part->next_part >> addr_shift;
+    }
+
+    low = 0;
+    high = part->part_size - 1;
+    while (low < high) {
+        mid = (low + high) / 2;
+        extent = &part->extent[mid];
+        if (block >= extent->logical + extent->length)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    extent = &part->extent[low];
+    if (block < extent->logical) {
+        free((void *) part);
+        return 0;
+    }
+    *run = extent->logical + extent->length - block;
+    lba = extent->start + (block - extent->logical);
+    free((void *) part);
+    return lba;
+}
+
+// -----------------------------------------------------------------------------
+// extend_file
+// -----------
+// 
+// General      :   The function allocates blocks at the end of an extent-based
+//                  file. The blocks are allocated in runs which start where the
+//                  last extent ends on the device; a run which follows the last
+//                  extent extends it, otherwise a new extent is added.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              blocks      -   The amount of blocks the file should have (In)
+//              keep_from   -   The index of the first block which the caller
+//                              is about to overwrite entirely (In)
+//              keep_to     -   The index of the block after the last block
+//                              which the caller is about to overwrite entirely
+//                              (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int extend_file(uint32_t header_lba, uint32_t blocks, uint32_t keep_from, uint32_t keep_to) {
+    uint32_t i;
+    uint32_t lba;
+    uint32_t hint;
+    uint32_t got;
+    uint32_t part_lba;
+    uint32_t allocated;
+    uint32_t new_lba;
+    int changed;
+    Extent *extent;
+    ExtentPart *part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    // Find the last part of the header.
+    part_lba = header_lba;
+    while (1) {
+        read_cache(fs_dev, part_lba, 1, (void *) part);
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        part_lba = part->next_part >> addr_shift;
+    }
+    extent = part->part_size ? &part->extent[part->part_size - 1] : 0;
+    allocated = extent ? extent->logical + extent->length : 0;
+
+    changed = 0;
+    while (allocated < blocks) {
+        // Try to continue the file where it ends on the device.
+        hint = extent ? extent->start + extent->length : header_lba + 1;
+        lba = balloc_n(blocks - allocated, hint, &got);
+        if (!got) {
+            if (changed)
+                write_cache(fs_dev, part_lba, 1, (void *) part);
+            free((void *) part);
+            return 1;
+        }
+        changed = 1;
+        zero_blocks(lba, allocated, got, keep_from, keep_to);
+        if (extent && extent->start + extent->length == lba) {
+            // The run continues the last extent.
+            extent->length += got;
+        } else {
+            if (part->part_size == EXTENTS_PER_PART) {
+                // The part is full, link a new one.
+                new_lba = balloc_after(part_lba);
+                if (!new_lba) {
+                    for (i = 0; i < got; i += cluster_blocks)
+                        bfree(lba + i);
+                    write_cache(fs_dev, part_lba, 1, (void *) part);
+                    free((void *) part);
+                    return 1;
+                }
+                part->next_part = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+                write_cache(fs_dev, part_lba, 1, (void *) part);
+                part_lba = new_lba;
+                read_cache(fs_dev, part_lba, 1, (void *) part);
+            }
+            extent = &part->extent[part->part_size++];
+            extent->logical = allocated;
+            extent->start = lba;
+            extent->length = got;
+        }
+        allocated += got;
+    }
+    if (changed)
+        write_cache(fs_dev, part_lba, 1, (void *) part);
+    free((void *) part);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// zero_blocks
+// -----------
+// 
+// General      :   The function zeroes newly allocated blocks of a file,
+//                  except for the ones which the caller is about to overwrite
+//                  entirely.
+//
+// Parameters   :
+//              lba         -   The LBA of the first block (In)
+//              logical     -   The index of the first block in the file (In)
+//              count       -   The amount of blocks (In)
+//              keep_from   -   The index of the first block not to zero (In)
+//              keep_to     -   The index of the block after the last block not
+//                              to zero (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void zero_blocks(uint32_t lba, uint32_t logical, uint32_t count, uint32_t keep_from,
+        uint32_t keep_to) {
+    uint32_t i;
+    uint32_t run;
+    void *zero;
+
+    zero = 0;
+    i = 0;
+    while (i < count) {
+        if (logical + i >= keep_from && logical + i < keep_to) {
+            i++;
+            continue;
+        }
+        // Collect the run of blocks to zero, and write it at once.
+        run = 1;
+        while (i + run < count && run < FS_RUN_BLOCKS
+                && !(logical + i + run >= keep_from && logical + i + run < keep_to))
+            run++;
+        if (!zero) {
+            zero = palloc();
+            memset(zero, 0, PAGE_SIZE);
+        }
+        write_cache(fs_dev, lba + i, run, zero);
+        i += run;
+    }
+    if (zero)
+        pfree(zero);
+}
+
+// -----------------------------------------------------------------------------
+// unshare_blocks
+// --------------
+// 
+// General      :   The function gives an extent-based file copies of its
+//                  shared blocks in a range which is about to be written. The
+//                  range is widened to whole clusters. Only the blocks which
+//                  the write does not cover entirely are copied; the rest of
+//                  the new blocks are about to be overwritten.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              seek        -   The position of the first byte of the write (In)
+//              end         -   The position after the last byte of the write
+//                              (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int unshare_blocks(uint32_t header_lba, uint32_t seek, uint32_t end) {
+    uint32_t block;
+    uint32_t last;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t got;
+    uint32_t new_lba;
+    uint32_t pos;
+    uint32_t i;
+    int shared;
+    void *buff;
+
+    // Whole clusters are copied, so the blocks of a cluster always have the
+    // same owners.
+    block = (seek / BLOCK_SIZE) & ~(cluster_blocks - 1);
+    last = ((end + BLOCK_SIZE - 1) / BLOCK_SIZE + cluster_blocks - 1) & ~(cluster_blocks - 1);
+    buff = 0;
+    // The owners of a block must not change between checking and copying it.
+    write_lock(&alloc_lock);
+    while (block < last) {
+        lba = map_block(header_lba, block, &run);
+        if (!lba)
+            break;
+        if (run > last - block)
+            run = last - block;
+        run = refcount_run(lba, run, &shared);
+        if (!shared) {
+            block += run;
+            continue;
+        }
+
+        new_lba = balloc_n(run, lba, &got);
+        if (!got)
+            break;
+        for (i = 0; i < got; i++) {
+            pos = (block + i) * BLOCK_SIZE;
+            if (pos >= seek && pos + BLOCK_SIZE <= end)
+                continue;
+            if (!buff)
+                buff = malloc(BLOCK_SIZE);
+            read_cache(fs_dev, lba + i, 1, buff);
+            write_cache(fs_dev, new_lba + i, 1, buff);
+        }
+        if (remap_extent(header_lba, block, got, new_lba)) {
+            for (i = 0; i < got; i += cluster_blocks)
+                bfree(new_lba + i);
+            break;
+        }
+        // The file is no longer an owner of the old blocks.
+        add_refcount(lba, got, -1);
+        block += got;
+    }
+    write_unlock(&alloc_lock);
+    if (buff)
+        free(buff);
+
+    return block < last;
+}
+
+// -----------------------------------------------------------------------------
+// remap_extent
+// ------------
+// 
+// General      :   The function moves a range of blocks of an extent-based
+//                  file to other blocks on the device. The extent of the range
+//                  is split around it; a part which has no room for the new
+//                  extents moves half of its extents to a new part after it.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              block       -   The index of the first block of the range in
+//                              the file, which must be in a single extent (In)
+//              count       -   The amount of blocks in the range (In)
+//              lba         -   The LBA of the new location of the range (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int remap_extent(uint32_t header_lba, uint32_t block, uint32_t count, uint32_t lba) {
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+    uint32_t half;
+    uint32_t part_lba;
+    uint32_t new_lba;
+    Extent old;
+    Extent piece[3];
+    Extent *prev;
+    ExtentPart *part;
+    ExtentPart *new_part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    // Find the part which maps the block.
+    part_lba = header_lba;
+    while (1) {
+        read_cache(fs_dev, part_lba, 1, (void *) part);
+        if (part->part_size && block < part->extent[part->part_size - 1].logical
+                + part->extent[part->part_size - 1].length)
+            break;
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
+            free((void *) part);
+            return 1;
+        }
+        part_lba = part->next_part >> addr_shift;
+    }
+    for (i = 0; block >= part->extent[i].logical + part->extent[i].length; i++);
+    old = part->extent[i];
+    if (block < old.logical || block + count > old.logical + old.length) {
+        free((void *) part);
+        return 1;
+    }
+
+    // Split the extent into the blocks before the range, the range, and the
+    // blocks after it.
+    n = 0;
+    if (block > old.logical) {
+        piece[n].logical = old.logical;
+        piece[n].start = old.start;
+        piece[n].length = block - old.logical;
+        n++;
+    }
+    piece[n].logical = block;
+    piece[n].start = lba;
+    piece[n].length = count;
+    n++;
+    if (block + count < old.logical + old.length) {
+        piece[n].logical = block + count;
+        piece[n].start = old.start + (block - old.logical) + count;
+        piece[n].length = old.logical + old.length - block - count;
+        n++;
+    }
+
+    if (part->part_size + n - 1 > EXTENTS_PER_PART) {
+        new_lba = balloc(part_lba);
+        if (!new_lba) {
+            free((void *) part);
+            return 1;
+        }
+        new_part = (ExtentPart *) malloc(sizeof (ExtentPart));
+        memset((void *) new_part, 0, sizeof (ExtentPart));
+        half = part->part_size / 2;
+        new_part->part_size = part->part_size - half;
+        memcpy((void *) new_part->extent, (void *) &part->extent[half],
+                new_part->part_size * sizeof (Extent));
+        new_part->next_part = part->next_part;
+        part->part_size = half;
+        part->next_part = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+        if (i >= half) {
+            // The extent moved to the new part.
+            write_cache(fs_dev, part_lba, 1, (void *) part);
+            memcpy((void *) part, (void *) new_part, sizeof (ExtentPart));
+            part_lba = new_lba;
+            i -= half;
+        } else
+            write_cache(fs_dev, new_lba, 1, (void *) new_part);
+        free((void *) new_part);
+    }
+
+    if (piece[0].logical == block && i) {
+        prev = &part->extent[i - 1];
+        if (prev->logical + prev->length == block && prev->start + prev->length == lba) {
+            // The new blocks continue the previous extent.
+            prev->length += count;
+            for (j = 1; j < n; j++)
+                piece[j - 1] = piece[j];
+            n--;
+        }
+    }
+
+    // Replace the extent with the pieces.
+    if (n > 1) {
+        for (j = part->part_size - 1; j > i; j--)
+            part->extent[j + n - 1] = part->extent[j];
+    } else if (!n) {
+        for (j = i + 1; j < part->part_size; j++)
+            part->extent[j - 1] = part->extent[j];
+    }
+    for (j = 0; j < n; j++)
+        part->extent[i + j] = piece[j];
+    part->part_size += n - 1;
+    write_cache(fs_dev, part_lba, 1, (void *) part);
+    free((void *) part);
+    // The old blocks of the range may be kept by the cursors of open files.
+    map_generation++;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// make_compressed
+// ---------------
+// 
+// General      :   The function gives an empty file of an open descriptor a
+//                  header which marks its data as compressed. The data of a
+//                  compressed file is kept in frames of FRAME_SIZE bytes,
+//                  every one compressed on its own, and a frame index maps
+//                  every frame to the blocks which hold it.
+//
+// Parameters   :
+//              f   -   A pointer to an open file descriptor (In)
+//
+// Return Value :   0 if successful, otherwise error specifier (the file
+//                  already has data, or the file-system has no headers)
+//
+// -----------------------------------------------------------------------------
+
+int make_compressed(File *f) {
+    uint32_t header_lba;
+    DirPart *dir;
+    ExtentPart *header;
+
+    if (fs_version < FS_VERSION_EXTENTS)
+        return 1;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    if (dir->entry[f->offset].addr & (NOT_EMPTY | INLINE)) {
+        // The file keeps the layout of its data.
+        free((void *) dir);
+        return 1;
+    }
+
+    journal_begin();
+    header_lba = balloc(f->base_lba);
+    if (!header_lba) {
+        journal_end();
+        free((void *) dir);
+        return 1;
+    }
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    header->flags = EXTENT_COMPRESSED;
+    write_cache(fs_dev, header_lba, 1, (void *) header);
+    free((void *) header);
+    dir->entry[f->offset].addr = (header_lba << addr_shift) | PRESENT | NOT_EMPTY;
+    write_cache(fs_dev, f->base_lba, 1, (void *) dir);
+    journal_end();
+    free((void *) dir);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// is_compressed
+// -------------
+// 
+// General      :   The function checks whether the data of an extent-based file
+//                  is compressed.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//
+// Return Value :   1 if the file is compressed, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int is_compressed(uint32_t header_lba) {
+    uint16_t flags;
+    ExtentPart *header;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    flags = header->flags;
+    free((void *) header);
+    return (flags & EXTENT_COMPRESSED) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// read_from_frames
+// ----------------
+// 
+// General      :   The function reads data from an open compressed file. Every
+//                  frame the read covers is decompressed, straight to the
+//                  buffer of the caller when the read covers it entirely.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              count       -   The amount of bytes to read (In)
+//              data        -   A pointer of the buffer to write the data to
+//                              (Out)
+//
+// Return Value :   The actual amount of bytes read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t read_from_frames(File *f, uint32_t header_lba, uint32_t count, char *data) {
+    uint32_t total;
+    uint32_t size;
+    uint32_t seek;
+    uint32_t in;
+    uint32_t max;
+    char *buff;
+
+    size = get_file_size(header_lba);
+    seek = f->r_seek;
+    if (seek >= size)
+        return 0;
+    if (count > size - seek)
+        count = size - seek;
+
+    buff = 0;
+    total = 0;
+    while (count) {
+        in = seek % FRAME_SIZE;
+        max = FRAME_SIZE - in;
+        if (count < max)
+            max = count;
+        if (max == FRAME_SIZE) {
+            if (load_frame(f, header_lba, seek / FRAME_SIZE, data))
+                break;
+        } else {
+            // A frame which is only partly read goes through a bounce buffer.
+            if (!buff)
+                buff = (char *) palloc();
+            if (load_frame(f, header_lba, seek / FRAME_SIZE, buff))
+                break;
+            memcpy(data, buff + in, max);
+        }
+        total += max;
+        data += max;
+        seek += max;
+        count -= max;
+    }
+    if (buff)
+        pfree((void *) buff);
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// write_to_frames
+// ---------------
+// 
+// General      :   The function writes data to an open compressed file. Every
+//                  frame the write covers is compressed again; a frame which
+//                  is only partly written is decompressed first. Each frame is
+//                  a step of its own in the journal, with the size of the file
+//                  up to it, so a long write does not fill the cache with
+//                  blocks which may not be written yet.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              data        -   A pointer of the buffer to read the data from
+//                              (In)
+//              count       -   The amount of bytes to write (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_to_frames(File *f, uint32_t header_lba, char *data, uint32_t count) {
+    uint32_t size;
+    uint32_t seek;
+    uint32_t end;
+    uint32_t in;
+    uint32_t max;
+    uint32_t len;
+    char *buff;
+    ExtentPart *header;
+
+    size = get_file_size(header_lba);
+    seek = f->w_seek;
+    end = seek + count;
+    buff = (char *) palloc();
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    while (count) {
+        in = seek % FRAME_SIZE;
+        max = FRAME_SIZE - in;
+        if (count < max)
+            max = count;
+        if (max < FRAME_SIZE && seek - in < size) {
+            if (load_frame(f, header_lba, seek / FRAME_SIZE, buff))
+                break;
+        } else
+            memset((void *) buff, 0, FRAME_SIZE);
+        memcpy(buff + in, data, max);
+
+        // The frame holds the data up to the end of the file.
+        len = (end > size ? end : size) - (seek - in);
+        if (len > FRAME_SIZE)
+            len = FRAME_SIZE;
+        if (store_frame(header_lba, seek / FRAME_SIZE, buff, len))
+            break;
+        // The blocks of the file may have moved.
+        f->m_run = 0;
+        data += max;
+        seek += max;
+        count -= max;
+
+        if (seek > size) {
+            // Update the size of the file.
+            size = seek;
+            read_cache(fs_dev, header_lba, 1, (void *) header);
+            header->size = size;
+            write_cache(fs_dev, header_lba, 1, (void *) header);
+        }
+        // Let the frames written so far be committed.
+        journal_end();
+        journal_begin();
+    }
+    free((void *) header);
+    pfree((void *) buff);
+}
+
+// -----------------------------------------------------------------------------
+// load_frame
+// ----------
+// 
+// General      :   The function reads a frame of a compressed file, and
+//                  decompresses it. A frame which was never written is all
+//                  zeroes.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the frame in the file (In)
+//              buff        -   A pointer to a buffer of FRAME_SIZE bytes, which
+//                              will contain the frame (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int load_frame(File *f, uint32_t header_lba, uint32_t frame, char *buff) {
+    uint32_t entry;
+    uint32_t start;
+    uint32_t blocks;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t i;
+    uint32_t len;
+    int status;
+    char *payload;
+
+    entry = get_frame(header_lba, frame);
+    blocks = entry & FRAME_BLOCKS_MASK;
+    if (!blocks) {
+        memset((void *) buff, 0, FRAME_SIZE);
+        return 0;
+    }
+    start = entry >> FRAME_START_SHIFT;
+
+    // A frame which did not compress is read straight to the buffer.
+    payload = entry & FRAME_STORED ? buff : (char *) palloc();
+    status = 0;
+    for (i = 0; i < blocks; i += run) {
+        lba = map_file_block(f, header_lba, start + i, &run);
+        if (!lba) {
+            status = 1;
+            break;
+        }
+        if (run > blocks - i)
+            run = blocks - i;
+        read_cache(fs_dev, lba, run, (void *) (payload + i * BLOCK_SIZE));
+    }
+    if (entry & FRAME_STORED) {
+        memset((void *) (buff + blocks * BLOCK_SIZE), 0, FRAME_SIZE - blocks * BLOCK_SIZE);
+        return status;
+    }
+
+    // The size of the data of the frame comes before the compressed data.
+    len = *(uint16_t *) payload;
+    if (!status && len <= FRAME_SIZE)
+        status = lz4_decompress((uint8_t *) payload + FRAME_HEADER_SIZE,
+                blocks * BLOCK_SIZE - FRAME_HEADER_SIZE, (uint8_t *) buff, len);
+    else
+        status = 1;
+    pfree((void *) payload);
+    if (!status)
+        memset((void *) (buff + len), 0, FRAME_SIZE - len);
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// store_frame
+// -----------
+// 
+// General      :   The function compresses a frame of a compressed file, and
+//                  writes it. The frames are packed one after the other in the
+//                  blocks of the file: a frame which still fits in its blocks
+//                  is written in place, and so is the last frame of the blocks,
+//                  which may grow or shrink; any other frame moves to a hole
+//                  left by other frames, or to the end if there is none.
+//                  A frame which does not compress is written as is.
+//                  The blocks of the frame go through the cache one by one, so
+//                  the journal commits them with the new entry of the frame.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the frame in the file (In)
+//              buff        -   A pointer to the frame, zeroed past its data
+//                              (In)
+//              len         -   The size of the data of the frame (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int store_frame(uint32_t header_lba, uint32_t frame, char *buff, uint32_t len) {
+    uint32_t entry;
+    uint32_t old_start;
+    uint32_t old_blocks;
+    uint32_t start;
+    uint32_t blocks;
+    uint32_t flags;
+    uint32_t end;
+    uint32_t new_end;
+    uint32_t clen;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t i;
+    uint32_t j;
+    char *payload;
+    char *src;
+    ExtentPart *header;
+
+    // Compressing pays off only if it saves a block.
+    payload = (char *) palloc();
+    blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    clen = 0;
+    if (blocks > 1)
+        clen = lz4_compress((uint8_t *) buff, len, (uint8_t *) payload + FRAME_HEADER_SIZE,
+                (blocks - 1) * BLOCK_SIZE - FRAME_HEADER_SIZE);
+    if (clen) {
+        *(uint16_t *) payload = len;
+        clen += FRAME_HEADER_SIZE;
+        blocks = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset((void *) (payload + clen), 0, blocks * BLOCK_SIZE - clen);
+        src = payload;
+        flags = 0;
+    } else {
+        src = buff;
+        flags = FRAME_STORED;
+    }
+
+    // Find the blocks of the frame.
+    entry = get_frame(header_lba, frame);
+    old_start = entry >> FRAME_START_SHIFT;
+    old_blocks = entry & FRAME_BLOCKS_MASK;
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    end = header->frame_end;
+    if (old_blocks && old_start + old_blocks == end) {
+        start = old_start;
+        new_end = start + blocks;
+    } else if (old_blocks >= blocks) {
+        start = old_start;
+        new_end = end;
+    } else {
+        // Look for a hole only if the frames left enough blocks unused.
+        start = 0xFFFFFFFF;
+        if (get_dead_blocks(header_lba) + old_blocks >= blocks)
+            start = find_frame_hole(header_lba, frame, blocks, end);
+        new_end = end;
+        if (start == 0xFFFFFFFF) {
+            start = end;
+            new_end = end + blocks;
+        }
+    }
+    // The frame is written entirely, so the new blocks are not zeroed.
+    if (extend_file(header_lba, new_end, 0, 0xFFFFFFFF)) {
+        free((void *) header);
+        pfree((void *) payload);
+        return 1;
+    }
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    if (header->frame_end != new_end) {
+        header->frame_end = new_end;
+        write_cache(fs_dev, header_lba, 1, (void *) header);
+    }
+    if ((header->flags & EXTENT_SHARED)
+            && unshare_blocks(header_lba, start * BLOCK_SIZE, (start + blocks) * BLOCK_SIZE)) {
+        free((void *) header);
+        pfree((void *) payload);
+        return 1;
+    }
+    free((void *) header);
+
+    for (i = 0; i < blocks; i += run) {
+        lba = map_block(header_lba, start + i, &run);
+        if (!lba) {
+            pfree((void *) payload);
+            return 1;
+        }
+        if (run > blocks - i)
+            run = blocks - i;
+        // Writing the blocks past the cache would let a crash leave the data
+        // of the frame out of step with its entry.
+        for (j = 0; j < run; j++)
+            if (write_cache(fs_dev, lba + j, 1, (void *) (src + (i + j) * BLOCK_SIZE))) {
+                pfree((void *) payload);
+                return 1;
+            }
+    }
+    pfree((void *) payload);
+
+    if (set_frame(header_lba, frame, (start << FRAME_START_SHIFT) | flags | blocks))
+        return 1;
+    // The last frame of the blocks only moves the end.
+    if (!(old_blocks && old_start + old_blocks == end))
+        add_dead_blocks(header_lba, old_blocks, start == end ? 0 : blocks);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// get_frame
+// ---------
+// 
+// General      :   The function finds the entry of a frame of a compressed file
+//                  in its frame index.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the frame in the file (In)
+//
+// Return Value :   The entry of the frame - the index of its first block in
+//                  the file, whether it is compressed and the amount of its
+//                  blocks, or 0 if the frame was never written
+//
+// -----------------------------------------------------------------------------
+
+uint32_t get_frame(uint32_t header_lba, uint32_t frame) {
+    uint32_t entry;
+    uint32_t index;
+    ExtentPart *header;
+    FramePart *part;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    index = header->frame_index;
+    free((void *) header);
+
+    part = (FramePart *) malloc(sizeof (FramePart));
+    while (1) {
+        if (!(index & PRESENT) || !(index & NOT_EMPTY)) {
+            free((void *) part);
+            return 0;
+        }
+        read_cache(fs_dev, index >> addr_shift, 1, (void *) part);
+        if (frame < FRAMES_PER_PART)
+            break;
+        frame -= FRAMES_PER_PART;
+        index = part->next_part;
+    }
+    entry = frame < part->part_size ? part->frame[frame] : 0;
+    free((void *) part);
+
+    return entry;
+}
+
+// -----------------------------------------------------------------------------
+// set_frame
+// ---------
+// 
+// General      :   The function changes the entry of a frame of a compressed
+//                  file in its frame index. The parts of the index are added
+//                  as the file grows; every part but the last one is full.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the frame in the file (In)
+//              entry       -   The new entry of the frame (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int set_frame(uint32_t header_lba, uint32_t frame, uint32_t entry) {
+    uint32_t lba;
+    uint32_t new_lba;
+    ExtentPart *header;
+    FramePart *part;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    if (!(header->frame_index & PRESENT) || !(header->frame_index & NOT_EMPTY)) {
+        // The first frame of the file is written, create its index.
+        lba = balloc(header_lba);
+        if (!lba) {
+            free((void *) header);
+            return 1;
+        }
+        header->frame_index = (lba << addr_shift) | PRESENT | NOT_EMPTY;
+        write_cache(fs_dev, header_lba, 1, (void *) header);
+    } else
+        lba = header->frame_index >> addr_shift;
+    free((void *) header);
+
+    part = (FramePart *) malloc(sizeof (FramePart));
+    read_cache(fs_dev, lba, 1, (void *) part);
+    while (frame >= FRAMES_PER_PART) {
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
+            new_lba = balloc_after(lba);
+            if (!new_lba) {
+                free((void *) part);
+                return 1;
+            }
+            part->part_size = FRAMES_PER_PART;
+            part->next_part = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+            write_cache(fs_dev, lba, 1, (void *) part);
+        }
+        lba = part->next_part >> addr_shift;
+        frame -= FRAMES_PER_PART;
+        read_cache(fs_dev, lba, 1, (void *) part);
+    }
+    part->frame[frame] = entry;
+    if (frame >= part->part_size)
+        part->part_size = frame + 1;
+    write_cache(fs_dev, lba, 1, (void *) part);
+    free((void *) part);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// get_dead_blocks
+// ---------------
+// 
+// General      :   The function returns the amount of blocks of a compressed
+//                  file below the end of its frames which no frame uses. The
+//                  amount is kept in the first part of the frame index.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//
+// Return Value :   The amount of unused blocks, or FRAME_DEAD_MAX if there may
+//                  be more
+//
+// -----------------------------------------------------------------------------
+
+uint32_t get_dead_blocks(uint32_t header_lba) {
+    uint32_t index;
+    uint32_t dead;
+    ExtentPart *header;
+    FramePart *part;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    index = header->frame_index;
+    free((void *) header);
+    if (!(index & PRESENT) || !(index & NOT_EMPTY))
+        return 0;
+
+    part = (FramePart *) malloc(sizeof (FramePart));
+    read_cache(fs_dev, index >> addr_shift, 1, (void *) part);
+    dead = part->dead_blocks;
+    free((void *) part);
+
+    return dead;
+}
+
+// -----------------------------------------------------------------------------
+// add_dead_blocks
+// ---------------
+// 
+// General      :   The function updates the amount of unused blocks of a
+//                  compressed file after a frame left some blocks and took
+//                  others. Once the amount is too large to keep, it stays at
+//                  FRAME_DEAD_MAX.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              freed       -   The amount of blocks the frame left (In)
+//              used        -   The amount of unused blocks the frame took (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void add_dead_blocks(uint32_t header_lba, uint32_t freed, uint32_t used) {
+    uint32_t index;
+    uint32_t dead;
+    ExtentPart *header;
+    FramePart *part;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    index = header->frame_index;
+    free((void *) header);
+    if (!(index & PRESENT) || !(index & NOT_EMPTY))
+        return;
+
+    part = (FramePart *) malloc(sizeof (FramePart));
+    read_cache(fs_dev, index >> addr_shift, 1, (void *) part);
+    dead = part->dead_blocks;
+    if (dead != FRAME_DEAD_MAX) {
+        dead += freed;
+        dead = dead > used ? dead - used : 0;
+        if (dead > FRAME_DEAD_MAX)
+            dead = FRAME_DEAD_MAX;
+    }
+    if (dead != part->dead_blocks) {
+        part->dead_blocks = dead;
+        write_cache(fs_dev, index >> addr_shift, 1, (void *) part);
+    }
+    free((void *) part);
+}
+
+// -----------------------------------------------------------------------------
+// find_frame_hole
+// ---------------
+// 
+// General      :   The function looks for blocks of a compressed file below the
+//                  end of its frames which no other frame uses. The blocks are
+//                  marked in a bitmap, one window of the file at a time.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the frame which needs the blocks,
+//                              whose own blocks count as unused (In)
+//              blocks      -   The amount of blocks needed (In)
+//              end         -   The end of the frames of the file (In)
+//
+// Return Value :   The index of the first block of the hole in the file, or
+//                  0xFFFFFFFF if there is none
+//
+// -----------------------------------------------------------------------------
+
+uint32_t find_frame_hole(uint32_t header_lba, uint32_t frame, uint32_t blocks, uint32_t end) {
+    uint32_t base;
+    uint32_t limit;
+    uint32_t index;
+    uint32_t entry;
+    uint32_t first;
+    uint32_t last;
+    uint32_t hole;
+    uint32_t found;
+    uint32_t i;
+    uint32_t n;
+    uint8_t *used;
+    ExtentPart *header;
+    FramePart *part;
+
+    header = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, header_lba, 1, (void *) header);
+    index = header->frame_index;
+    free((void *) header);
+    if (!(index & PRESENT) || !(index & NOT_EMPTY))
+        return 0xFFFFFFFF;
+
+    used = (uint8_t *) palloc();
+    part = (FramePart *) malloc(sizeof (FramePart));
+    hole = 0;
+    found = 0;
+    for (base = 0; base < end; base += FRAME_HOLE_WINDOW) {
+        limit = end - base < FRAME_HOLE_WINDOW ? end - base : FRAME_HOLE_WINDOW;
+        memset((void *) used, 0, PAGE_SIZE);
+
+        // Mark the blocks of the other frames in the window.
+        entry = index;
+        n = 0;
+        while ((entry & PRESENT) && (entry & NOT_EMPTY)) {
+            read_cache(fs_dev, entry >> addr_shift, 1, (void *) part);
+            for (i = 0; i < part->part_size; i++, n++) {
+                if (n == frame || !(part->frame[i] & FRAME_BLOCKS_MASK))
+                    continue;
+                first = part->frame[i] >> FRAME_START_SHIFT;
+                last = first + (part->frame[i] & FRAME_BLOCKS_MASK);
+                if (last <= base || first >= base + limit)
+                    continue;
+                first = first > base ? first - base : 0;
+                last = last - base < limit ? last - base : limit;
+                for (; first < last; first++)
+                    used[first / 8] |= 1 << (first % 8);
+            }
+            entry = part->next_part;
+        }
+
+        // A hole may go on from the previous window.
+        for (i = 0; i < limit; i++) {
+            if (used[i / 8] & (1 << (i % 8))) {
+                found = 0;
+                continue;
+            }
+            if (!found)
+                hole = base + i;
+            if (++found == blocks) {
+                free((void *) part);
+                pfree((void *) used);
+                return hole;
+            }
+        }
+    }
+    free((void *) part);
+    pfree((void *) used);
+
+    return 0xFFFFFFFF;
+}
+
+// -----------------------------------------------------------------------------
+// copy_frame_index
+// ----------------
+// 
+// General      :   The function copies the frame index of a compressed file.
+//
+// Parameters   :
+//              lba     -   The LBA of the first part of the index (In)
+//              goal    -   The LBA of a block the copy is related to (In)
+//
+// Return Value :   The LBA of the first part of the copy, or 0 if the device
+//                  is full
+//
+// -----------------------------------------------------------------------------
+
+uint32_t copy_frame_index(uint32_t lba, uint32_t goal) {
+    uint32_t copy_lba;
+    uint32_t prev_lba;
+    uint32_t new_lba;
+    uint32_t next_lba;
+    FreeBatch *batch;
+    FramePart *part;
+
+    part = (FramePart *) malloc(sizeof (FramePart));
+    copy_lba = 0;
+    prev_lba = 0;
+    while (1) {
+        new_lba = prev_lba ? balloc_after(prev_lba) : balloc(goal);
+        if (!new_lba) {
+            free((void *) part);
+            if (copy_lba) {
+                // Free the parts copied so far.
+                batch = (FreeBatch *) palloc();
+                batch->count = 0;
+                collect_chain_blocks(batch, copy_lba);
+                apply_frees(batch);
+                pfree((void *) batch);
+            }
+            return 0;
+        }
+        read_cache(fs_dev, lba, 1, (void *) part);
+        next_lba = part->next_part;
+        part->next_part = 0;
+        write_cache(fs_dev, new_lba, 1, (void *) part);
+        if (prev_lba) {
+            read_cache(fs_dev, prev_lba, 1, (void *) part);
+            part->next_part = (new_lba << addr_shift) | PRESENT | NOT_EMPTY;
+            write_cache(fs_dev, prev_lba, 1, (void *) part);
+        } else
+            copy_lba = new_lba;
+        prev_lba = new_lba;
+
+        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY))
+            break;
+        lba = next_lba >> addr_shift;
+    }
+    free((void *) part);
+
+    return copy_lba;
+}
+
+// -----------------------------------------------------------------------------
+// prefetch_frames
+// ---------------
+// 
+// General      :   The function reads the blocks of frames of a compressed file
+//                  into the cache. The blocks of frames which follow each other
+//                  in the file are read together.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              frame       -   The index of the first frame (In)
+//              count       -   The amount of frames (In)
+//
+// Return Value :   The index of the frame after the last one read
+//
+// -----------------------------------------------------------------------------
+
+uint32_t prefetch_frames(File *f, uint32_t header_lba, uint32_t frame, uint32_t count) {
+    uint32_t entry;
+    uint32_t start;
+    uint32_t blocks;
+    uint32_t first;
+    uint32_t next;
+
+    first = 0;
+    next = 0;
+    while (count--) {
+        entry = get_frame(header_lba, frame++);
+        start = entry >> FRAME_START_SHIFT;
+        blocks = entry & FRAME_BLOCKS_MASK;
+        if (!blocks)
+            continue;
+        if (start != next) {
+            // The frame does not continue the blocks gathered so far.
+            prefetch_blocks(f, header_lba, first, next - first);
+            first = start;
+        }
+        next = start + blocks;
+    }
+    prefetch_blocks(f, header_lba, first, next - first);
+
+    return frame;
+}
+
+// -----------------------------------------------------------------------------
+// prefetch_blocks
+// ---------------
+// 
+// General      :   The function reads a range of blocks of an extent-based file
+//                  into the cache.
+//
+// Parameters   :
+//              f           -   A pointer to an open file descriptor (In)
+//              header_lba  -   The LBA of the header of the file (In)
+//              block       -   The index of the first block in the file (In)
+//              count       -   The amount of blocks (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void prefetch_blocks(File *f, uint32_t header_lba, uint32_t block, uint32_t count) {
+    uint32_t lba;
+    uint32_t run;
+
+    while (count) {
+        lba = map_file_block(f, header_lba, block, &run);
+        if (!lba)
+            return;
+        if (run > count)
+            run = count;
+        prefetch_cache(fs_dev, lba, run);
+        block += run;
+        count -= run;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// begin_fs_op
+// -----------
+// 
+// General      :   The function marks the start of a foreground operation on
+//                  the file-system. The operation waits while the defragmenter
+//                  holds the file-system, and the defragmenter lets go of it as
+//                  soon as it sees an operation waiting.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void begin_fs_op(void) {
+    CLEAR_INTS();
+    if (fs_held) {
+        fs_waiters++;
+        while (fs_held) {
+            SET_INTS();
+            wait_ticks(1);
+            CLEAR_INTS();
+        }
+        fs_waiters--;
+    }
+    fs_ops++;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// end_fs_op
+// ---------
+// 
+// General      :   The function marks the end of a foreground operation on the
+//                  file-system.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void end_fs_op(void) {
+    CLEAR_INTS();
+    fs_ops--;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// mark_fs_changed
+// ---------------
+// 
+// General      :   The function tells the defragmenter that an operation
+//                  changes directories or the blocks of files, so a walk which
+//                  let the operation run has to start over. Operations which
+//                  only read do not call it, so they do not hold the
+//                  defragmenter back.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void mark_fs_changed(void) {
+    CLEAR_INTS();
+    fs_generation++;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// hold_fs
+// -------
+// 
+// General      :   The function waits until no foreground operation is running
+//                  or waiting and no file is open, and keeps new operations
+//                  from starting until release_fs is called.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void hold_fs(void) {
+    CLEAR_INTS();
+    while (fs_held || fs_ops || fs_waiters || open_count) {
+        SET_INTS();
+        wait_ticks(DEFRAG_WAIT_TICKS);
+        CLEAR_INTS();
+    }
+    fs_held = 1;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// release_fs
+// ----------
+// 
+// General      :   The function lets the foreground operations run again.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void release_fs(void) {
+    fs_held = 0;
+}
+
+// -----------------------------------------------------------------------------
+// begin_excl_fs_op
+// ----------------
+// 
+// General      :   The function marks the start of a foreground operation which
+//                  needs the file-system to itself, such as freeing a directory
+//                  that other operations may be walking through. It waits as
+//                  the other operations do, so the defragmenter lets go, and
+//                  then holds the file-system as the defragmenter does. The
+//                  operation is ended with release_fs. The calling thread must
+//                  not be in another operation. Files stay open, so the
+//                  operation checks that none of them is inside what it frees.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void begin_excl_fs_op(void) {
+    CLEAR_INTS();
+    fs_waiters++;
+    while (fs_held || fs_ops) {
+        SET_INTS();
+        wait_ticks(1);
+        CLEAR_INTS();
+    }
+    fs_waiters--;
+    fs_held = 1;
+    SET_INTS();
+    mark_fs_changed();
+}
+
+// -----------------------------------------------------------------------------
+// lock_dir
+// --------
+// 
+// General      :   The function locks a directory. The lock of a directory
+//                  protects the entries of all of its parts. Lookups which
+//                  only pass through a directory do not lock it.
+//
+// Parameters   :
+//              dir_lba -   The LBA of the first part of the directory (In)
+//              write   -   Whether to lock the directory for changing it
+//                          (LOCK_WRITE) or for reading it (LOCK_READ) (In)
+//
+// Return Value :   A pointer to the slot of the lock
+//
+// -----------------------------------------------------------------------------
+
+LockSlot *lock_dir(uint32_t dir_lba, int write) {
+    LockSlot *slot;
+
+    slot = pin_lock(dir_locks, DIR_LOCKS, dir_lba);
+    if (write)
+        write_lock(&slot->lock);
+    else
+        read_lock(&slot->lock);
+    return slot;
+}
+
+// -----------------------------------------------------------------------------
+// unlock_dir
+// ----------
+// 
+// General      :   The function unlocks a directory.
+//
+// Parameters   :
+//              slot    -   A pointer to the slot of the lock (In)
+//              write   -   Whether the directory was locked for changing it
+//                          (boolean) (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void unlock_dir(LockSlot *slot, int write) {
+    if (write)
+        write_unlock(&slot->lock);
+    else
+        read_unlock(&slot->lock);
+    unpin_lock(slot);
+}
+
+// -----------------------------------------------------------------------------
+// lock_parent_dir
+// ---------------
+// 
+// General      :   The function locks the directory which contains a file or a
+//                  directory. The path is looked up again once the directory
+//                  is locked, since the directory may have been moved.
+//
+// Parameters   :
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
+//              write   -   Whether to lock the directory for changing it
+//                          (boolean) (In)
+//              dir_lba -   A pointer to an unsigned int, which will contain the
+//                          LBA of the first part of the directory (Out)
+//              slot    -   A pointer to the slot of the lock (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier (the directory
+//                  does not exist, or has no parts)
+//
+// -----------------------------------------------------------------------------
+
+int lock_parent_dir(char *path, uint32_t len, int write, uint32_t *dir_lba, LockSlot **slot) {
+    uint32_t lba;
+
+    while (1) {
+        if (find_parent_dir(path, len, dir_lba))
+            return 1;
+        *slot = lock_dir(*dir_lba, write);
+        if (!find_parent_dir(path, len, &lba) && lba == *dir_lba)
+            return 0;
+        unlock_dir(*slot, write);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// lock_dir_pair
+// -------------
+// 
+// General      :   The function locks two directories in the order of their
+//                  LBAs, so two threads which lock the same pair can not wait
+//                  for each other. A directory which is both is locked once.
+//
+// Parameters   :
+//              first_lba       -   The LBA of the first part of the first
+//                                  directory (In)
+//              first_write     -   Whether to lock the first directory for
+//                                  changing it (boolean) (In)
+//              second_lba      -   The LBA of the first part of the second
+//                                  directory (In)
+//              second_write    -   Whether to lock the second directory for
+//                                  changing it (boolean) (In)
+//              first           -   A pointer to the slot of the lock of the
+//                                  first directory (Out)
+//              second          -   A pointer to the slot of the lock of the
+//                                  second directory, or 0 if it is the first
+//                                  one (Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void lock_dir_pair(uint32_t first_lba, int first_write, uint32_t second_lba, int second_write,
+        LockSlot **first, LockSlot **second) {
+    if (first_lba == second_lba) {
+        *first = lock_dir(first_lba, first_write || second_write);
+        *second = 0;
+    } else if (first_lba < second_lba) {
+        *first = lock_dir(first_lba, first_write);
+        *second = lock_dir(second_lba, second_write);
+    } else {
+        *second = lock_dir(second_lba, second_write);
+        *first = lock_dir(first_lba, first_write);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// unlock_dir_pair
+// ---------------
+// 
+// General      :   The function unlocks two directories locked together.
+//
+// Parameters   :
+//              first           -   A pointer to the slot of the lock of the
+//                                  first directory (In)
+//              first_write     -   Whether the first directory was locked for
+//                                  changing it (boolean) (In)
+//              second          -   A pointer to the slot of the lock of the
+//                                  second directory, or 0 (In)
+//              second_write    -   Whether the second directory was locked for
+//                                  changing it (boolean) (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void unlock_dir_pair(LockSlot *first, int first_write, LockSlot *second, int second_write) {
+    if (!second) {
+        unlock_dir(first, first_write || second_write);
+        return;
+    }
+    unlock_dir(second, second_write);
+    unlock_dir(first, first_write);
+}
+
+// -----------------------------------------------------------------------------
+// try_lock_file
+// -------------
+// 
+// General      :   The function locks a file if it can be done without
+//                  waiting, for the file or for a free slot of the table. A
+//                  file is known by the position of its entry.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The offset of the entry in the part (In)
+//              write       -   Whether to lock the file for writing it
+//                              (LOCK_WRITE) or for reading it (LOCK_READ) (In)
+//
+// Return Value :   A pointer to the slot of the lock, or 0 if the file is
+//                  locked by another thread or the table is full
+//
+// -----------------------------------------------------------------------------
+
+LockSlot *try_lock_file(uint32_t base_lba, uint32_t offset, int write) {
+    int status;
+    LockSlot *slot;
+
+    slot = try_pin_lock(file_locks, FILE_LOCKS, FILE_LOCK_KEY(base_lba, offset));
+    if (!slot)
+        return 0;
+    if (write)
+        status = try_write_lock(&slot->lock);
+    else
+        status = try_read_lock(&slot->lock);
+    if (status) {
+        unpin_lock(slot);
+        return 0;
+    }
+    return slot;
+}
+
+// -----------------------------------------------------------------------------
+// wait_file
+// ---------
+// 
+// General      :   The function waits until a file can be locked, without
+//                  keeping it locked. It is called inside a single operation
+//                  with no directory locked, since the thread which has the
+//                  file locked may have to lock its directory to write it. The
+//                  operation is left while the file is waited for, since an
+//                  exclusive operation of that thread waits for every
+//                  operation to end; the caller looks everything up again.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The offset of the entry in the part (In)
+//              write       -   Whether the file is to be locked for writing it
+//                              (boolean) (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void wait_file(uint32_t base_lba, uint32_t offset, int write) {
+    LockSlot *slot;
+
+    end_fs_op();
+    slot = pin_lock(file_locks, FILE_LOCKS, FILE_LOCK_KEY(base_lba, offset));
+    if (write) {
+        write_lock(&slot->lock);
+        write_unlock(&slot->lock);
+    } else {
+        read_lock(&slot->lock);
+        read_unlock(&slot->lock);
+    }
+    unpin_lock(slot);
+    begin_fs_op();
+    // The defragmenter may have held the file-system in between, and the
+    // operation goes on to change it.
+    mark_fs_changed();
+}
+
+// -----------------------------------------------------------------------------
+// is_file_open
+// ------------
+// 
+// General      :   The function checks whether a file is locked by an open
+//                  file descriptor.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The offset of the entry in the part (In)
+//
+// Return Value :   1 if the file is open, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int is_file_open(uint32_t base_lba, uint32_t offset) {
+    uint32_t i;
+    int open;
+
+    open = 0;
+    CLEAR_INTS();
+    for (i = 0; i < FILE_LOCKS; i++)
+        if (file_locks[i].users && file_locks[i].key == FILE_LOCK_KEY(base_lba, offset)
+                && (file_locks[i].lock.readers || file_locks[i].lock.depth))
+            open = 1;
+    SET_INTS();
+
+    return open;
+}
+
+// -----------------------------------------------------------------------------
+// is_tree_open
+// ------------
+// 
+// General      :   The function checks whether a file inside a directory, at
+//                  any depth, is open.
+//
+// Parameters   :
+//              lba -   The LBA of the first part of the directory (In)
+//
+// Return Value :   1 if a file is open, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int is_tree_open(uint32_t lba) {
+    int open;
+    Dir *d;
+    DirItem *item;
+
+    d = open_dir_at(lba, 1);
+    item = (DirItem *) malloc(sizeof (DirItem));
+    open = 0;
+    while (!open && readdir(d, item)) {
+        if (!(item->addr & IS_DIR))
+            open = is_file_open(item->part_lba, item->offset);
+        else if ((item->addr & NOT_EMPTY) && item->level >= DIR_WALK_DEPTH)
+            // The iterator does not walk this deep.
+            open = is_tree_open(item->addr >> addr_shift);
+    }
+    free((void *) item);
+    closedir(d);
+
+    return open;
+}
+
+// -----------------------------------------------------------------------------
+// is_path_open
+// ------------
+// 
+// General      :   The function checks whether a directory which is about to
+//                  be freed has an open file inside it.
+//
+// Parameters   :
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
+//
+// Return Value :   1 if a file inside the target is open, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int is_path_open(char *path, uint32_t len) {
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t addr;
+    DirPart *dir;
+
+    if (find_path(path, len, TYPE_DIR, 1, &base_lba, &offset))
+        return 0;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    addr = dir->entry[offset].addr;
+    free((void *) dir);
+
+    return is_tree_open(addr >> addr_shift);
+}
+
+// -----------------------------------------------------------------------------
+// unlock_file
+// -----------
+// 
+// General      :   The function unlocks a file.
+//
+// Parameters   :
+//              slot    -   A pointer to the slot of the lock (In)
+//              write   -   Whether the file was locked for writing it
+//                          (boolean) (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void unlock_file(LockSlot *slot, int write) {
+    if (write)
+        write_unlock(&slot->lock);
+    else
+        read_unlock(&slot->lock);
+    unpin_lock(slot);
+}
+
+// -----------------------------------------------------------------------------
+// defrag
+// ------
+// 
+// General      :   The function moves the parts of every file under a path to
+//                  consecutive blocks, and prints how fragmented the files
+//                  were before and after. It is meant to run in a thread of
+//                  its own: the file-system is held for one file at a time,
+//                  and is let go whenever a foreground operation waits for it.
+//
+// Parameters   :
+//              path    -   The path to a file or a directory in the
+//                          file-system (In)
+//              len     -   The length of the path string (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int defrag(char *path, uint32_t len) {
+    FragStats *before;
+    FragStats *after;
+    int status;
+
+    before = (FragStats *) malloc(sizeof (FragStats));
+    after = (FragStats *) malloc(sizeof (FragStats));
+
+    hold_fs();
+    status = defrag_path(path, len, before, 0);
+    if (!status) {
+        // The walk starts over when the file-system changed while it was let
+        // go, since the directories it was in may be gone. The files which
+        // were moved already are skipped quickly.
+        do
+            status = defrag_path(path, len, after, 1);
+        while (status == DEFRAG_AGAIN);
+    }
+    if (!status)
+        status = defrag_path(path, len, after, 0);
+    release_fs();
+
+    if (!status) {
+        puts("Before: ");
+        print_frag_stats(before);
+        puts("After: ");
+        print_frag_stats(after);
+    }
+    free((void *) after);
+    free((void *) before);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// defrag_path
+// -----------
+// 
+// General      :   The function counts the fragments of the files under a
+//                  path, and moves the files which are fragmented. The path is
+//                  looked up again every time, since it may have been deleted
+//                  while the file-system was let go.
+//
+// Parameters   :
+//              path    -   The path to a file or a directory in the
+//                          file-system (In)
+//              len     -   The length of the path string (In)
+//              stats   -   A pointer to the statistics to fill (Out)
+//              move    -   Whether to move the fragmented files (boolean) (In)
+//
+// Return Value :   0 if successful, DEFRAG_AGAIN if the walk has to start
+//                  over, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int defrag_path(char *path, uint32_t len, FragStats *stats, int move) {
+    uint32_t base_lba;
+    uint32_t offset;
+    uint32_t addr;
+    DirPart *dir;
+
+    memset((void *) stats, 0, sizeof (FragStats));
+    if ((len == 1 && path[0] == '/') || len == 0)
+        return defrag_tree(root_lba, stats, move);
+    if (find_path(path, len, TYPE_UNDEFINED, 0, &base_lba, &offset))
+        return 1;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    addr = dir->entry[offset].addr;
+    free((void *) dir);
+    if (!(addr & NOT_EMPTY))
+        return 0;
+    if (addr & IS_DIR)
+        return defrag_tree(addr >> addr_shift, stats, move);
+    defrag_entry(base_lba, offset, stats, move);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// defrag_tree
+// -----------
+// 
+// General      :   The function counts the fragments of the files inside a
+//                  directory, and moves the files which are fragmented. After
+//                  every entry, the file-system is let go if a foreground
+//                  operation waits for it.
+//
+// Parameters   :
+//              lba     -   The LBA of the first part of the directory (In)
+//              stats   -   A pointer to the statistics to add to (In/Out)
+//              move    -   Whether to move the fragmented files (boolean) (In)
+//
+// Return Value :   0 if successful, DEFRAG_AGAIN if the file-system changed
+//                  while it was let go
+//
+// -----------------------------------------------------------------------------
+
+int defrag_tree(uint32_t lba, FragStats *stats, int move) {
+    uint32_t generation;
+    int status;
+    Dir *d;
+    DirItem *item;
+
+    d = open_dir_at(lba, 1);
+    item = (DirItem *) malloc(sizeof (DirItem));
+    status = 0;
+    while (!status && readdir(d, item)) {
+        if ((item->addr & NOT_EMPTY) && !(item->addr & IS_DIR))
+            defrag_entry(item->part_lba, item->offset, stats, move);
+        else if ((item->addr & NOT_EMPTY) && item->level >= DIR_WALK_DEPTH)
+            // The iterator does not walk this deep.
+            status = defrag_tree(item->addr >> addr_shift, stats, move);
+        if (status || !fs_waiters)
+            continue;
+
+        // Let the waiting operations run.
+        generation = fs_generation;
+        release_fs();
+        hold_fs();
+        if (generation != fs_generation)
+            status = DEFRAG_AGAIN;
+    }
+    free((void *) item);
+    closedir(d);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// defrag_entry
+// ------------
+// 
+// General      :   The function counts the fragments of a file, and moves its
+//                  parts to consecutive blocks if it is fragmented.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The index of the entry in the part (In)
+//              stats       -   A pointer to the statistics to add to (In/Out)
+//              move        -   Whether to move the file (boolean) (In)
+//
+// Return Value :   1 if the file was moved, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int defrag_entry(uint32_t base_lba, uint32_t offset, FragStats *stats, int move) {
+    uint32_t addr;
+    uint32_t fragments;
+    uint32_t blocks;
+    int moved;
+    DirPart *dir;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    addr = dir->entry[offset].addr;
+    free((void *) dir);
+
+    if (fs_version >= FS_VERSION_EXTENTS)
+        fragments = count_extent_fragments(addr >> addr_shift, &blocks);
+    else
+        fragments = count_chain_fragments(addr >> addr_shift, &blocks);
+
+    moved = 0;
+    // A run is allocated from a single bitmap block, so a longer file can not
+    // be moved to one.
+    if (move && fragments > 1 && blocks <= (BITMAP_SIZE << cluster_shift)) {
+        journal_begin();
+        if (fs_version >= FS_VERSION_EXTENTS)
+            moved = !move_extents(addr >> addr_shift, blocks);
+        else
+            moved = !move_chain(base_lba, offset, blocks);
+        journal_end();
+        if (moved)
+            fragments = 1;
+    }
+
+    stats->files++;
+    stats->fragments += fragments;
+    if (fragments > 1)
+        stats->fragmented++;
+    return moved;
+}
+
+// -----------------------------------------------------------------------------
+// count_chain_fragments
+// ---------------------
+// 
+// General      :   The function counts the runs of consecutive blocks that the
+//                  parts of a chained file are stored in.
+//
+// Parameters   :
+//              lba     -   The LBA of the first part of the file (In)
+//              parts   -   A pointer to an unsigned int, which will contain
+//                          the amount of parts of the file (Out)
+//
+// Return Value :   The amount of runs
+//
+// -----------------------------------------------------------------------------
+
+uint32_t count_chain_fragments(uint32_t lba, uint32_t *parts) {
+    uint32_t fragments;
+    uint32_t next_lba;
+    FilePart *part;
+
+    part = (FilePart *) malloc(sizeof (FilePart));
+    fragments = 1;
+    *parts = 1;
+    while (1) {
+        read_cache(fs_dev, lba, 1, (void *) part);
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        next_lba = part->next_part >> addr_shift;
+        if (next_lba != lba + 1)
+            fragments++;
+        (*parts)++;
+        lba = next_lba;
+    }
+    free((void *) part);
+
+    return fragments;
+}
+
+// -----------------------------------------------------------------------------
+// count_extent_fragments
+// ----------------------
+// 
+// General      :   The function counts the runs of consecutive blocks that the
+//                  data of an extent-based file is stored in. Files which
+//                  share blocks with clones are not counted as fragmented,
+//                  since they are not moved.
+//
+// Parameters   :
+//              lba     -   The LBA of the header of the file (In)
+//              blocks  -   A pointer to an unsigned int, which will contain
+//                          the amount of data blocks of the file, or 0 if
+//                          the file may not be moved (Out)
+//
+// Return Value :   The amount of runs
+//
+// -----------------------------------------------------------------------------
+
+uint32_t count_extent_fragments(uint32_t lba, uint32_t *blocks) {
+    uint32_t fragments;
+    uint32_t end;
+    uint32_t i;
+    ExtentPart *part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    fragments = 0;
+    end = 0;
+    *blocks = 0;
+    read_cache(fs_dev, lba, 1, (void *) part);
+    if (part->flags & EXTENT_SHARED) {
+        free((void *) part);
+        return 1;
+    }
+    while (1) {
+        read_cache(fs_dev, lba, 1, (void *) part);
+        for (i = 0; i < part->part_size; i++) {
+            if (!fragments || part->extent[i].start != end)
+                fragments++;
+            end = part->extent[i].start + part->extent[i].length;
+            if (part->extent[i].logical != *blocks) {
+                // The file has a hole, and keeps its layout.
+                free((void *) part);
+                *blocks = 0;
+                return 1;
+            }
+            *blocks += part->extent[i].length;
+        }
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        lba = part->next_part >> addr_shift;
+    }
+    free((void *) part);
+
+    return fragments ? fragments : 1;
+}
+
+// -----------------------------------------------------------------------------
+// move_chain
+// ----------
+// 
+// General      :   The function moves the parts of a chained file to a run of
+//                  consecutive blocks near its directory, and links the run to
+//                  the entry of the file. The old parts are freed.
+//
+// Parameters   :
+//              base_lba    -   The LBA of the directory part of the entry (In)
+//              offset      -   The index of the entry in the part (In)
+//              parts       -   The amount of parts of the file (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int move_chain(uint32_t base_lba, uint32_t offset, uint32_t parts) {
+    uint32_t old_lba;
+    uint32_t lba;
+    uint32_t new_lba;
+    uint32_t got;
+    uint32_t next_lba;
+    uint32_t i;
+    FreeBatch *batch;
+    FilePart *part;
+    FilePart *buff;
+    DirPart *dir;
+
+    new_lba = balloc_n(parts, base_lba, &got);
+    if (got < parts) {
+        // There is no run long enough for the file.
+        for (i = 0; i < got; i += cluster_blocks)
+            bfree(new_lba + i);
+        return 1;
+    }
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    read_cache(fs_dev, base_lba, 1, (void *) dir);
+    old_lba = dir->entry[offset].addr >> addr_shift;
+
+    // Copy the parts, each linked to the block after it. The new blocks are
+    // not linked to the file yet, so they are written in runs past the cache.
+    buff = (FilePart *) palloc();
+    lba = old_lba;
+    for (i = 0; i < parts; i++) {
+        part = &buff[i % FS_RUN_BLOCKS];
+        read_cache(fs_dev, lba, 1, (void *) part);
+        next_lba = part->next_part >> addr_shift;
+        if (i < parts - 1)
+            part->next_part = ((new_lba + i + 1) << addr_shift)
+                    | (part->next_part & ((1 << addr_shift) - 1));
+        if (i % FS_RUN_BLOCKS == FS_RUN_BLOCKS - 1 || i == parts - 1)
+            write_cache(fs_dev, new_lba + i - i % FS_RUN_BLOCKS, i % FS_RUN_BLOCKS + 1,
+                    (void *) buff);
+        lba = next_lba;
+    }
+    pfree((void *) buff);
+
+    // Link the new parts to the entry, and free the old ones.
+    dir->entry[offset].addr = (new_lba << addr_shift)
+            | (dir->entry[offset].addr & ((1 << addr_shift) - 1));
+    write_cache(fs_dev, base_lba, 1, (void *) dir);
+    free((void *) dir);
+    batch = (FreeBatch *) palloc();
+    batch->count = 0;
+    collect_chain_blocks(batch, old_lba);
+    apply_frees(batch);
+    pfree((void *) batch);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// move_extents
+// ------------
+// 
+// General      :   The function moves the data of an extent-based file to a run
+//                  of consecutive blocks after its header, and maps the run
+//                  with a single extent. The old blocks are freed, and so are
+//                  the parts of the header which are not needed anymore,
+//                  unless they share the cluster of the header.
+//
+// Parameters   :
+//              header_lba  -   The LBA of the header of the file (In)
+//              blocks      -   The amount of data blocks of the file (In)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int move_extents(uint32_t header_lba, uint32_t blocks) {
+    uint32_t lba;
+    uint32_t new_lba;
+    uint32_t got;
+    uint32_t run;
+    uint32_t i;
+    uint32_t j;
+    void *buff;
+    FreeBatch *batch;
+    Extent *extent;
+    ExtentPart *part;
+
+    new_lba = balloc_n(blocks, header_lba + 1, &got);
+    if (got < blocks) {
+        // There is no run long enough for the file.
+        for (i = 0; i < got; i += cluster_blocks)
+            bfree(new_lba + i);
+        return 1;
+    }
+
+    // Copy the data, and collect the old blocks and parts.
+    buff = palloc();
+    batch = (FreeBatch *) palloc();
+    batch->count = 0;
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    lba = header_lba;
+    while (1) {
+        read_cache(fs_dev, lba, 1, (void *) part);
+        for (i = 0; i < part->part_size; i++) {
+            extent = &part->extent[i];
+            for (j = 0; j < extent->length; j += run) {
+                run = extent->length - j;
+                if (run > FS_RUN_BLOCKS)
+                    run = FS_RUN_BLOCKS;
+                read_cache(fs_dev, extent->start + j, run, buff);
+                write_cache(fs_dev, new_lba + extent->logical + j, run, buff);
+            }
+            add_free_range(batch, extent->start, extent->length);
+        }
+        if (lba != header_lba && (lba >> cluster_shift) != (header_lba >> cluster_shift))
+            add_free_range(batch, lba, 1);
+        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY))
+            break;
+        lba = part->next_part >> addr_shift;
+    }
+    pfree(buff);
+    // The run is rounded up to whole clusters, the blocks after the data
+    // become part of the file as well.
+    zero_blocks(new_lba + blocks, blocks, got - blocks, 0, 0);
+
+    // Map the new run with the header alone.
+    read_cache(fs_dev, header_lba, 1, (void *) part);
+    part->part_size = 1;
+    part->extent[0].logical = 0;
+    part->extent[0].start = new_lba;
+    part->extent[0].length = got;
+    part->next_part = 0;
+    write_cache(fs_dev, header_lba, 1, (void *) part);
+    free((void *) part);
+
+    apply_frees(batch);
+    pfree((void *) batch);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// print_frag_stats
+// ----------------
+// 
+// General      :   The function prints how fragmented a set of files is.
+//
+// Parameters   :
+//              stats   -   A pointer to the statistics (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void print_frag_stats(FragStats *stats) {
+    char *buff;
+
+    buff = (char *) malloc(16);
+    puts(uitoa(stats->files, buff, BASE10));
+    puts(" files, ");
+    puts(uitoa(stats->fragmented, buff, BASE10));
+    puts(" fragmented, ");
+    puts(uitoa(stats->fragments, buff, BASE10));
+    puts(" fragments\n");
+    free((void *) buff);
+}
+
+// -----------------------------------------------------------------------------
+// is_path
+// -------
+// 
+// General      :   The function deletes a file or a directory.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
+//
+// Return Value :   True (non-zero) if found, otherwise False (zero)
+//
+// -----------------------------------------------------------------------------
+
+int is_path(char *path, uint32_t len, int target_type, int not_empty) {
+    uint32_t base_lba;
+    uint32_t offset;
+    int status;
+
+    // The directories on the way are not freed while they are walked.
+    begin_fs_op();
+    status = find_path(path, len, target_type, not_empty, &base_lba, &offset);
+    end_fs_op();
+
+    return !status;
+}
+
+// -----------------------------------------------------------------------------
+// sync_fs
+// -------
+// 
+// General      :   The function writes all the cached changes of the
+//                  file-system to the device, between operations, so a move of
+//                  the defragmenter is never written half done.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int sync_fs(void) {
+    int status;
+
+    begin_fs_op();
+    status = sync_cache();
+    end_fs_op();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// find_path
+// ---------
+// 
+// General      :   The function finds the entry of a file or a directory.
+//
+// Parameters   :
+//              path        -   The path to the target in the file-system (In)
+//              len         -   The length of the path string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
+//              base_lba    -   A pointer to an unsigned int, which will contain
+//                              the base LBA of the entry of the target (Out)
+//              offset      -   A pointer to an unsigned int, which will contain
+//                              the offset of the entry of the target (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int find_path(char *path, uint32_t len, int target_type, int not_empty,
+        uint32_t *base_lba, uint32_t *offset) {
+    char name[NAME_LEN + 1];
+    char next[NAME_LEN + 1];
+    int status;
+    uint32_t pos;
+    uint32_t lba;
+    uint32_t entry_offset;
+    uint32_t dir_lba;
+    DirPart *dir;
+
+    pos = 0;
+    if (!next_path_part(path, len, &pos, name))
+        // A path without any part has no entry.
+        return 1;
+    dir_lba = root_lba;
+    dir = (DirPart *) malloc(sizeof (DirPart));
+
+    // Every part but the last one is a directory on the way to the target.
+    while (next_path_part(path, len, &pos, next)) {
+        status = find_in_dir(dir_lba, name, NAME_LEN, TYPE_DIR, 1,
+                &lba, &entry_offset);
+
+        if (status) {
+            free((void *) dir);
+            return status;
+        }
+
+        read_cache(fs_dev, lba, 1, (void *) dir);
+        dir_lba = dir->entry[entry_offset].addr >> addr_shift;
+        memcpy((void *) name, (void *) next, NAME_LEN + 1);
+    }
+    free((void *) dir);
+
+    status = find_in_dir(dir_lba, name, NAME_LEN, target_type, not_empty,
+            &lba, &entry_offset);
+    if (status)
+        return status;
+
+    *base_lba = lba;
+    *offset = entry_offset;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// find_in_dir
+// -----------
+// 
+// General      :   The function finds the entry of a file or a directory inside
+//                  a directory-parts chain. The directory entry cache is
+//                  checked first, and the result of a scan is added to it.
+//
+// Parameters   :
+//              cur_lba     -   The LBA of the first part of the directory
+//                              chain (In)
+//              name        -   The name of the target (In)
+//              len         -   The length of the name string (In)
+//              target_type -   The type of the target as int (see the DEFINEs
+//                              for values) (In)
+//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
+//              base_lba    -   A pointer to an unsigned int, which will contain
+//                              the base LBA of the entry of the target (Out)
+//              offset      -   A pointer to an unsigned int, which will contain
+//                              the offset of the entry of the target (Out)
+//
+// Return Value :   0 if successful, otherwise error specifier
+//
+// -----------------------------------------------------------------------------
+
+int find_in_dir(uint32_t cur_lba, const char *name, uint32_t len,
+        int target_type, int not_empty, uint32_t *base_lba, uint32_t *offset) {
+    char f_name[NAME_LEN + 1];
+    uint32_t c;
+    uint32_t entry_offset;
+    uint32_t next_lba;
+    uint32_t dir_lba;
+    uint32_t hash;
+    uint32_t stamp;
+    int found;
+    Dentry dentry;
+    DirPart *dir;
+
+    if (len > NAME_LEN)
+        len = NAME_LEN;
+    memcpy((void *) f_name, (void *) name, len);
+    memset((void *) (f_name + len), 0, NAME_LEN - len + 1);
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    dir_lba = cur_lba;
+
+    found = 0;
+    if (find_dentry(dir_lba, f_name, &dentry)) {
+        if (dentry.flags & DENTRY_NEGATIVE) {
+            // The directory is known not to contain the name.
+            free((void *) dir);
+            return 1;
+        }
+        cur_lba = dentry.base_lba;
+        entry_offset = dentry.offset;
+        read_cache(fs_dev, cur_lba, 1, (void *) dir);
+        // Another thread may have cached the entry just before it was
+        // deleted, in which case the directory is scanned.
+        found = (dir->entry[entry_offset].addr & PRESENT)
+            && !memcmp(f_name, dir->entry[entry_offset].name, NAME_LEN);
+        if (!found) {
+            drop_dentry_at(cur_lba, entry_offset);
+            cur_lba = dir_lba;
+        }
+    }
+    if (!found) {
+        stamp = dcache_stamp();
+        hash = name_hash(f_name);
+        while (1) {
+            read_cache(fs_dev, cur_lba, 1, (void *) dir);
+            c = 0;
+            // Scan the entries only if the filter of the part does not rule
+            // the name out.
+            if (may_contain_name(dir, hash)) {
+                for (entry_offset = 0; entry_offset < DIR_ENTRIES_PER_PART; entry_offset++) {
+                    if (c >= dir->part_size)
+                        break;
+                    if (dir->entry[entry_offset].addr & PRESENT) {
+                        c++;
+                        if (!memcmp(f_name, dir->entry[entry_offset].name, NAME_LEN)) {
+                            found = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (found)
+                break;
+
+            next_lba = dir->next_part;
+            if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY)) {
+                // Remember that the name is missing.
+                add_negative_dentry(dir_lba, f_name, stamp);
+                free((void *) dir);
+                return 1;
+            }
+            cur_lba = next_lba >> addr_shift;
+        }
+        add_dentry(dir_lba, f_name, cur_lba, entry_offset);
+    }
+
+    // Names are unique in a directory, so an entry of another type means the
+    // target does not exist.
+    if ((target_type == TYPE_DIR && !(dir->entry[entry_offset].addr & IS_DIR))
+            || (target_type == TYPE_FILE && (dir->entry[entry_offset].addr & IS_DIR))
+            || (not_empty && !(dir->entry[entry_offset].addr & NOT_EMPTY))) {
+        free((void *) dir);
+        return 1;
+    }
+
+    *base_lba = cur_lba;
+    *offset = entry_offset;
+    free((void *) dir);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// next_path_part
+// --------------
+// 
+// General      :   The function copies the next part of a path to a name
+//                  buffer, without allocating memory.
+//
+// Parameters   :
+//              path    -   The path to the target in the file-system (In)
+//              len     -   The length of the path string (In)
+//              pos     -   A pointer to the position in the path to continue
+//                          from, which is advanced past the part (In/Out)
+//              name    -   A pointer to a buffer of NAME_LEN + 1 bytes, which
+//                          will contain the part padded with 0's (Out)
+//
+// Return Value :   The length of the part, or 0 if the path has no more parts
+//
+// -----------------------------------------------------------------------------
+
+uint32_t next_path_part(char *path, uint32_t len, uint32_t *pos, char *name) {
+    uint32_t start;
+    uint32_t part_len;
+
+    // Skip the separators before the part.
+    while (*pos < len && *(path + *pos) == '/')
+        (*pos)++;
+    start = *pos;
+    while (*pos < len && *(path + *pos) != '/')
+        (*pos)++;
+
+    part_len = *pos - start;
+    if (!part_len)
+        return 0;
+    if (part_len > NAME_LEN)
+        part_len = NAME_LEN;
+    memcpy((void *) name, (void *) (path + start), part_len);
+    memset((void *) (name + part_len), 0, NAME_LEN - part_len + 1);
+    return part_len;
+}
+
+// -----------------------------------------------------------------------------
+// name_hash
+// ---------
+// 
+// General      :   The function computes the hash of an entry name (FNV-1a).
+//
+// Parameters   :
+//              name    -   The name, padded with 0's (In)
+//
+// Return Value :   The hash of the name
+//
+// -----------------------------------------------------------------------------
+
+uint32_t name_hash(const char *name) {
+    uint32_t h;
+    uint32_t i;
+
+    h = 2166136261u;
+    for (i = 0; i < NAME_LEN && name[i]; i++) {
+        h ^= (uint8_t) name[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+// -----------------------------------------------------------------------------
+// update_name_filter
+// ------------------
+// 
+// General      :   The function rebuilds the name filter of a directory-part
+//                  from its present entries. Every name sets two bits of the
+//                  filter.
+//
+// Parameters   :
+//              dir -   A pointer to the directory-part (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void update_name_filter(DirPart *dir) {
+    uint32_t i;
+    uint32_t h;
+    uint32_t bit;
+
+    memset((void *) dir->name_filter, 0, NAME_FILTER_LEN);
+    for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
+        if (!(dir->entry[i].addr & PRESENT))
+            continue;
+        h = name_hash(dir->entry[i].name);
+        bit = h % NAME_FILTER_BITS;
+        dir->name_filter[bit / 8] |= 1 << (bit % 8);
+        bit = (h / NAME_FILTER_BITS) % NAME_FILTER_BITS;
+        dir->name_filter[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// may_contain_name
+// ----------------
+// 
+// General      :   The function checks whether a directory-part may contain a
+//                  name, according to its name filter. EDENFS100 is mounted by
+//                  older kernels as well, which leave the filter as it is when
+//                  they change the part, so the filter of that format is not
+//                  trusted. An empty filter may contain any name as well.
+//
+// Parameters   :
+//              dir     -   A pointer to the directory-part (In)
+//              hash    -   The hash of the name (In)
+//
+// Return Value :   False (zero) if the part does not contain the name,
+//                  otherwise True (non-zero)
+//
+// -----------------------------------------------------------------------------
+
+int may_contain_name(DirPart *dir, uint32_t hash) {
+    uint32_t i;
+    uint32_t bit;
+
+    if (fs_version < FS_VERSION_EXTENTS)
+        return 1;
+    for (i = 0; i < NAME_FILTER_LEN; i++)
+        if (dir->name_filter[i])
+            break;
+    if (i == NAME_FILTER_LEN)
+        return 1;
+
+    bit = hash % NAME_FILTER_BITS;
+    if (!(dir->name_filter[bit / 8] & (1 << (bit % 8))))
+        return 0;
+    bit = (hash / NAME_FILTER_BITS) % NAME_FILTER_BITS;
+    return dir->name_filter[bit / 8] & (1 << (bit % 8));
+}
+
+// -----------------------------------------------------------------------------
+// find_empty_entry
+// ----------------
+// 
+// General      :   The function finds an empty entry in a directory, and sets
+//                  it to be present.
+//
+// Parameters   :
+//              dir_lba     -   The LBA of the first directory part
+//              base_lba    -   A pointer to an unsigned int, which will contain
+//                              the base LBA of the entry (Out)
+//              offset      -   A pointer to an unsigned int, which will contain
+//                              the offset of the entry (Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void find_empty_entry(uint32_t dir_lba, uint32_t *base_lba, uint32_t *offset) {
+    DirPart *dir;
+    uint32_t i;
+    uint32_t first_lba;
+
+    dir = (DirPart *) malloc(sizeof (DirPart));
+    first_lba = dir_lba;
+    while (1) {
+        read_cache(fs_dev, dir_lba, 1, (void *) dir);
+        for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
+            // Entries which hold the data of inline files are not empty.
+            if (!(dir->entry[i].addr & (PRESENT | INLINE))) {
+                memset((void *) &dir->entry[i], 0, sizeof (DirEntry));
+                dir->entry[i].addr |= PRESENT;
+                dir->part_size++;
+                update_name_filter(dir);
+                write_cache(fs_dev, dir_lba, 1, (void *) dir);
+                *base_lba = dir_lba;
+                *offset = i;
+
+                free((void *) dir);
+                // The directory has one more entry.
+                update_dir_size(first_lba, 1);
+
+                return;
+            }
+        }
+
+        if (!(dir->next_part & PRESENT)) {
+            dir->next_part = (balloc_after(dir_lba) << addr_shift) | PRESENT | IS_DIR | NOT_EMPTY;
+            write_cache(fs_dev, dir_lba, 1, (void *) dir);
+        }
+        dir_lba = dir->next_part >> addr_shift;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// free_entry_parts
+// ----------------
+// 
+// General      :   The function deletes the parts of a directory entry,
+//                  according to its type and the format of the file-system.
+//                  The whole tree of a directory is deleted. The blocks are
+//                  collected first and freed together, so every bitmap block
+//                  is updated once.
+//
+// Parameters   :
+//              addr    -   The address field of the entry (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void free_entry_parts(uint32_t addr) {
+    FreeBatch *batch;
+
+    batch = (FreeBatch *) palloc();
+    batch->count = 0;
+    // The owners of shared blocks are counted down as the blocks are
+    // collected, so no clone may share them in between.
+    write_lock(&alloc_lock);
+    collect_entry_blocks(batch, addr);
+    apply_frees(batch);
+    write_unlock(&alloc_lock);
+    pfree((void *) batch);
+}
+
+// -----------------------------------------------------------------------------
+// collect_entry_blocks
+// --------------------
+// 
+// General      :   The function adds the blocks of a directory entry to a batch
+//                  of blocks to free, including the whole tree of a directory.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              addr    -   The address field of the entry (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void collect_entry_blocks(FreeBatch *batch, uint32_t addr) {
+    if (!(addr & NOT_EMPTY))
+        return;
+
+    if (addr & IS_DIR) {
+        collect_tree_blocks(batch, addr >> addr_shift);
+        collect_chain_blocks(batch, addr >> addr_shift);
+    } else if (fs_version >= FS_VERSION_EXTENTS)
+        collect_extent_blocks(batch, addr >> addr_shift);
+    else
+        collect_chain_blocks(batch, addr >> addr_shift);
+}
+
+// -----------------------------------------------------------------------------
+// collect_tree_blocks
+// -------------------
+// 
+// General      :   The function adds the blocks of everything inside a
+//                  directory to a batch of blocks to free. The tree is walked
+//                  with a directory iterator; only the directories deeper than
+//                  its stack start a walk of their own.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              lba     -   The LBA of the first part of the directory (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void collect_tree_blocks(FreeBatch *batch, uint32_t lba) {
+    Dir *d;
+    DirItem *item;
+
+    d = open_dir_at(lba, 1);
+    item = (DirItem *) malloc(sizeof (DirItem));
+    while (readdir(d, item)) {
+        if (!(item->addr & NOT_EMPTY))
+            continue;
+        if ((item->addr & IS_DIR) && item->level < DIR_WALK_DEPTH)
+            // The iterator walks into the directory next.
+            collect_chain_blocks(batch, item->addr >> addr_shift);
+        else
+            collect_entry_blocks(batch, item->addr);
+    }
+    free((void *) item);
+    closedir(d);
+}
+
+// -----------------------------------------------------------------------------
+// collect_chain_blocks
+// --------------------
+// 
+// General      :   The function adds a chain of linked parts to a batch of
+//                  blocks to free.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              lba     -   The LBA of the first part (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void collect_chain_blocks(FreeBatch *batch, uint32_t lba) {
+    FilePart *part;
+    uint32_t next_lba;
+
+    part = (FilePart *) malloc(sizeof (FilePart));
+    while (1) {
+        read_cache(fs_dev, lba, 1, part);
+        next_lba = part->next_part;
+        add_free_range(batch, lba, 1);
+        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY)) {
+            free((void *) part);
+            return;
+        }
+        lba = next_lba >> addr_shift;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// collect_extent_blocks
+// ---------------------
+// 
+// General      :   The function adds the blocks of an extent-based file, the
+//                  parts of its header and its frame index, to a batch of
+//                  blocks to free. The blocks a shared file owns with other
+//                  files are kept.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              lba     -   The LBA of the header of the file (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void collect_extent_blocks(FreeBatch *batch, uint32_t lba) {
+    uint32_t i;
+    uint32_t next_lba;
+    int shared;
+    ExtentPart *part;
+
+    part = (ExtentPart *) malloc(sizeof (ExtentPart));
+    read_cache(fs_dev, lba, 1, (void *) part);
+    shared = part->flags & EXTENT_SHARED;
+    if ((part->flags & EXTENT_COMPRESSED) && (part->frame_index & PRESENT)
+            && (part->frame_index & NOT_EMPTY))
+        // The frame index belongs to the file alone.
+        collect_chain_blocks(batch, part->frame_index >> addr_shift);
+    while (1) {
+        read_cache(fs_dev, lba, 1, (void *) part);
+        for (i = 0; i < part->part_size; i++) {
+            if (shared)
+                collect_shared_blocks(batch, part->extent[i].start, part->extent[i].length);
+            else
+                add_free_range(batch, part->extent[i].start, part->extent[i].length);
+        }
+        next_lba = part->next_part;
+        add_free_range(batch, lba, 1);
+        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY)) {
+            free((void *) part);
+            return;
+        }
+        lba = next_lba >> addr_shift;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// collect_shared_blocks
+// ---------------------
+// 
+// General      :   The function releases the blocks of an extent of a shared
+//                  file. Blocks which other files own too lose an owner, and
+//                  the rest are added to a batch of blocks to free.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              start   -   The LBA of the first block of the extent (In)
+//              count   -   The amount of blocks in the extent (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void collect_shared_blocks(FreeBatch *batch, uint32_t start, uint32_t count) {
+    uint32_t run;
+    int shared;
+
+    while (count) {
+        run = refcount_run(start, count, &shared);
+        if (shared)
+            add_refcount(start, run, -1);
+        else
+            add_free_range(batch, start, run);
+        start += run;
+        count -= run;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// add_free_range
+// --------------
+// 
+// General      :   The function adds a run of blocks to a batch of blocks to
+//                  free. A run which continues the last one is merged into it,
+//                  and a full batch is applied before the run is added.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//              start   -   The LBA of the first block of the run (In)
+//              count   -   The amount of blocks in the run (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void add_free_range(FreeBatch *batch, uint32_t start, uint32_t count) {
+    FreeRange *last;
+
+    if (!count)
+        return;
+    if (batch->count) {
+        last = &batch->range[batch->count - 1];
+        if (last->start + last->count == start) {
+            last->count += count;
+            return;
+        }
+    }
+    if (batch->count == FREE_BATCH_RANGES)
+        apply_frees(batch);
+    batch->range[batch->count].start = start;
+    batch->range[batch->count].count = count;
+    batch->count++;
+}
+
+// -----------------------------------------------------------------------------
+// apply_frees
+// -----------
+// 
+// General      :   The function frees the blocks of a batch, and empties it.
+//                  The runs are sorted, so the runs of every leaf bitmap block
+//                  are applied together and the block is written once. Runs
+//                  beyond the bitmaps are reported and skipped.
+//
+// Parameters   :
+//              batch   -   A pointer to the batch (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void apply_frees(FreeBatch *batch) {
+    uint32_t i;
+    uint32_t j;
+    uint32_t leaf;
+    uint32_t pos;
+    uint32_t freed;
+    uint32_t free_count;
+    uint8_t *bitmap;
+    char *buff;
+    FreeRange *range;
+    FreeRange temp;
+
+    // The bitmaps have a bit for every cluster, turn the runs of blocks into
+    // runs of the clusters which contain them.
+    for (i = 0; i < batch->count; i++) {
+        range = &batch->range[i];
+        temp.start = range->start >> cluster_shift;
+        temp.count = ((range->start + range->count + cluster_blocks - 1) >> cluster_shift)
+            - temp.start;
+        *range = temp;
+    }
+
+    // Sort the runs by their first cluster.
+    for (i = 1; i < batch->count; i++) {
+        temp = batch->range[i];
+        for (j = i; j && batch->range[j - 1].start > temp.start; j--)
+            batch->range[j] = batch->range[j - 1];
+        batch->range[j] = temp;
+    }
+
+    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
+    write_lock(&alloc_lock);
+    i = 0;
+    while (i < batch->count) {
+        leaf = batch->range[i].start / BITMAP_SIZE;
+        if (leaf >= leaf_count) {
+            // The run is beyond the bitmaps, skip it and free the rest of
+            // the batch.
+            buff = (char *) malloc(16);
+            puts("Cannot free blocks beyond the device: ");
+            puts(uitoa(batch->range[i].start << cluster_shift, buff, BASE10));
+            puts("\n");
+            free((void *) buff);
+            i++;
+            continue;
+        }
+        // Count the free clusters before the bits change.
+        free_count = get_leaf_free(leaf);
+        read_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
+        freed = 0;
+        while (i < batch->count) {
+            range = &batch->range[i];
+            // Clear the bits of the part of the run in this leaf.
+            while (range->count && range->start / BITMAP_SIZE == leaf) {
+                pos = range->start % BITMAP_SIZE;
+                if (*(bitmap + pos / 8) & (1 << (pos % 8))) {
+                    *(bitmap + pos / 8) &= (~(1 << (pos % 8))) & 0xFF;
+                    freed++;
+                }
+                range->start++;
+                range->count--;
+            }
+            if (range->count)
+                // The rest of the run is in the next leaf.
+                break;
+            i++;
+            if (i < batch->count && batch->range[i].start / BITMAP_SIZE != leaf)
+                break;
+        }
+        if (!freed)
+            continue;
+
+        write_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
+        set_leaf_free(leaf, free_count + freed);
+        // The freed blocks may be kept by the cursors of open files.
+        map_generation++;
+        if (!free_count)
+            // The bitmap block is no longer full.
+            update_upper_levels(leaf * BITMAP_SIZE, 0);
+        if (leaf < first_free_leaf)
+            first_free_leaf = leaf;
+    }
+    write_unlock(&alloc_lock);
+    free((void *) bitmap);
+    batch->count = 0;
+}
+
+// -----------------------------------------------------------------------------
+// balloc
+// ------
+// 
+// General      :   The function allocates a cluster as close as possible to a
+//                  goal, and zeroes its first block. The rest of the cluster
+//                  is taken by balloc_after.
+//
+// Parameters   :
+//              goal    -   The LBA of a block the new one is related to, such
+//                          as the previous part or the parent directory, or 0
+//                          for no preference (In)
+//
+// Return Value :   The LBA of the block, or 0 if the device is full
+//
+// -----------------------------------------------------------------------------
 
-    while (count) {
-        read_bbb(fs_dev, lba, 1, part);
+uint32_t balloc(uint32_t goal) {
+    uint32_t lba;
+    uint32_t allocated;
+    void *zero;
 
-        if (count <= FILE_DATA_PER_PART) {
-            memcpy((char *) part->data, data, count);
-            if (count > part->part_size)
-                part->part_size = count;
-            write_bbb(fs_dev, lba, 1, part);
-            free((void *) part);
-            return;
-        }
-        memcpy((char *) part->data, data, FILE_DATA_PER_PART);
-        data += FILE_DATA_PER_PART;
-        count -= FILE_DATA_PER_PART;
+    lba = balloc_n(1, goal, &allocated);
+    if (!allocated)
+        return 0;
 
-        part->part_size = FILE_DATA_PER_PART;
-        if (!(part->next_part & PRESENT) || !(part->next_part & NOT_EMPTY)) {
-            part->next_part = (balloc() << 9) | PRESENT | NOT_EMPTY;
-            write_bbb(fs_dev, lba, 1, part);
-        }
-        lba = part->next_part >> 9;
-    }
+    // Zero the new block.
+    zero = malloc(BLOCK_SIZE);
+    memset(zero, 0, BLOCK_SIZE);
+    write_cache(fs_dev, lba, 1, zero);
+    free(zero);
+    return lba;
 }
 
 // -----------------------------------------------------------------------------
-// is_path
-// -------
+// balloc_after
+// ------------
 // 
-// General      :   The function deletes a file or a directory.
+// General      :   The function allocates a block to follow the last part of a
+//                  chain, and zeroes it. The parts of a chain fill the cluster
+//                  of the last part before a new cluster is allocated.
 //
 // Parameters   :
-//              path        -   The path to the target in the file-system (In)
-//              len         -   The length of the path string (In)
-//              target_type -   The type of the target as int (see the DEFINEs
-//                              for values) (In)
-//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
+//              lba -   The LBA of the last part of the chain (In)
 //
-// Return Value :   True (non-zero) if found, otherwise False (zero)
+// Return Value :   The LBA of the block, or 0 if the device is full
 //
 // -----------------------------------------------------------------------------
 
-int is_path(char *path, uint32_t len, int target_type, int not_empty) {
-    uint32_t base_lba;
-    uint32_t offset;
+uint32_t balloc_after(uint32_t lba) {
+    void *zero;
 
-    return !find_path(path, len, target_type, not_empty, &base_lba, &offset);
+    lba++;
+    if (!(lba & (cluster_blocks - 1)))
+        // The cluster is used up, continue the chain right after it.
+        return balloc(lba);
+
+    zero = malloc(BLOCK_SIZE);
+    memset(zero, 0, BLOCK_SIZE);
+    write_cache(fs_dev, lba, 1, zero);
+    free(zero);
+    return lba;
 }
 
 // -----------------------------------------------------------------------------
-// find_path
-// ---------
+// balloc_n
+// --------
 // 
-// General      :   The function finds the entry of a file or a directory.
+// General      :   The function allocates a run of consecutive blocks in a
+//                  single pass over the bitmaps, as close as possible to a
+//                  hint. The bitmap block of the hint is searched first, then
+//                  the one before it, then the ones after it, and only then
+//                  the rest of the device. A free run of the full length is
+//                  preferred, otherwise the longest run of the first bitmap
+//                  block with free clusters is taken, and the caller asks
+//                  again for the rest. The blocks are allocated in whole
+//                  clusters, and are not zeroed.
 //
 // Parameters   :
-//              path        -   The path to the target in the file-system (In)
-//              len         -   The length of the path string (In)
-//              target_type -   The type of the target as int (see the DEFINEs
-//                              for values) (In)
-//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
-//              base_lba    -   A pointer to an unsigned int, which will contain
-//                              the base LBA of the entry of the target (Out)
-//              offset      -   A pointer to an unsigned int, which will contain
-//                              the offset of the entry of the target (Out)
+//              count       -   The amount of blocks wanted (In)
+//              hint        -   The LBA to start searching from, or 0 for the
+//                              beginning of the device (In)
+//              allocated   -   A pointer to an unsigned int, which will contain
+//                              the amount of blocks allocated (Out)
 //
-// Return Value :   0 if successful, otherwise error specifier
+// Return Value :   The LBA of the first block of the run, or 0 if the device
+//                  is full
 //
 // -----------------------------------------------------------------------------
 
-int find_path(char *path, uint32_t len, int target_type, int not_empty,
-        uint32_t *base_lba, uint32_t *offset) {
-    PathPart *part;
-    PathPart *first;
-    int status;
-    uint32_t lba;
-    uint32_t entry_offset;
-    uint32_t dir_lba;
-    DirPart *dir;
+uint32_t balloc_n(uint32_t count, uint32_t hint, uint32_t *allocated) {
+    uint32_t leaf;
+    uint32_t start_leaf;
+    uint32_t wrap_leaf;
+    uint32_t n;
+    uint32_t start;
+    uint32_t len;
+    uint8_t *bitmap;
 
-    part = first = to_path_parts(path, len);
-    dir_lba = root_lba;
-    dir = (DirPart *) malloc(sizeof (DirPart));
+    *allocated = 0;
+    if (!count)
+        return 0;
+    // Search for clusters.
+    count = (count + cluster_blocks - 1) >> cluster_shift;
+    hint >>= cluster_shift;
+    if (hint >= cluster_count)
+        hint = 0;
+    write_lock(&alloc_lock);
+    start_leaf = hint / BITMAP_SIZE;
+    if (start_leaf < first_free_leaf || start_leaf >= leaf_count) {
+        // The bitmap blocks before the first free one are full, and the ones
+        // after the last one are not tracked.
+        start_leaf = first_free_leaf;
+        hint = 0;
+    }
+    if (start_leaf >= leaf_count) {
+        // Every bitmap block is full.
+        write_unlock(&alloc_lock);
+        return 0;
+    }
+    wrap_leaf = first_free_leaf;
 
-    while (part->next) {
-        status = find_in_dir(dir_lba, part->name, NAME_LEN, TYPE_DIR, 1,
-                &lba, &entry_offset);
+    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
+    start = alloc_from_leaf(bitmap, start_leaf, hint % BITMAP_SIZE, count, &len);
+    if (!len && hint && start_leaf > wrap_leaf)
+        // The end of the bitmap block before the one of the hint is as close.
+        start = alloc_from_leaf(bitmap, start_leaf - 1, BITMAP_SIZE, count, &len);
+    // Go over the leaves from the one after the hint to the last one, then
+    // from the first free one up to the one of the hint.
+    for (n = 1; !len && n < leaf_count; n++) {
+        leaf = start_leaf + n;
+        if (leaf >= leaf_count)
+            leaf = wrap_leaf + (leaf - leaf_count);
+        if (leaf >= leaf_count || leaf == start_leaf)
+            break;
+        start = alloc_from_leaf(bitmap, leaf, 0, count, &len);
+    }
+    write_unlock(&alloc_lock);
+    free((void *) bitmap);
+    if (!len)
+        return 0;
 
-        if (status) {
-            free((void *) dir);
-            return status;
-        }
+    *allocated = len << cluster_shift;
+    return start << cluster_shift;
+}
 
-        read_bbb(fs_dev, lba, 1, (void *) dir);
-        dir_lba = dir->entry[entry_offset].addr >> 9;
-        part = part->next;
-    }
+// -----------------------------------------------------------------------------
+// alloc_from_leaf
+// ---------------
+// 
+// General      :   The function allocates a run of free clusters from a leaf
+//                  bitmap block, as close as it can to a bit of the block. The
+//                  bits from it onwards are searched first, and then the bits
+//                  before it, backwards.
+//
+// Parameters   :
+//              bitmap  -   A pointer to a buffer of a block for the bitmap (In)
+//              leaf    -   The index of the bitmap block in the leaf level (In)
+//              from    -   The index of the bit to start searching from, or
+//                          BITMAP_SIZE to search back from the end (In)
+//              count   -   The wanted amount of clusters (In)
+//              len     -   A pointer to an unsigned int, which will contain the
+//                          amount of clusters allocated, or 0 if the block has
+//                          no free cluster (Out)
+//
+// Return Value :   The index of the first cluster of the run
+//
+// -----------------------------------------------------------------------------
 
-    status = find_in_dir(dir_lba, part->name, NAME_LEN, target_type, not_empty,
-            &lba, &entry_offset);
+uint32_t alloc_from_leaf(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len) {
+    uint32_t start;
+    uint32_t free_count;
+    uint32_t i;
 
+    *len = 0;
+    // Skip bitmap blocks which the summary knows to be full.
+    free_count = get_leaf_free(leaf);
+    if (!free_count) {
+        if (leaf == first_free_leaf)
+            first_free_leaf++;
+        return 0;
+    }
+    read_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
 
-    if (status) {
-        free((void *) dir);
-        return status;
+    start = find_free_run(bitmap, leaf, from, count, len);
+    if (!*len && from)
+        start = find_free_run_back(bitmap, leaf, from, count, len);
+    if (!*len) {
+        // The summary was wrong (the rest of the block is out of the device).
+        set_leaf_free(leaf, 0);
+        return 0;
     }
 
-    *base_lba = lba;
-    *offset = entry_offset;
-    free((void *) dir);
-    free_path_parts(first);
+    // Mark the clusters as allocated.
+    for (i = start; i < start + *len; i++)
+        *(bitmap + i / 8) |= 1 << (i % 8);
+    write_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
+    free_count -= *len;
+    set_leaf_free(leaf, free_count);
+    if (!free_count)
+        // The bitmap block became full, mark it so in the upper levels.
+        update_upper_levels(leaf * BITMAP_SIZE, 1);
 
-    return 0;
+    return leaf * BITMAP_SIZE + start;
 }
 
 // -----------------------------------------------------------------------------
-// find_in_dir
-// -----------
+// find_free_run
+// -------------
 // 
-// General      :   The function finds the entry of a file or a directory inside
-//                  a directory-parts chain. 
+// General      :   The function finds a run of free clusters in a leaf bitmap
+//                  block. The first run of the wanted length is returned, or
+//                  the longest run if there is no such run.
 //
 // Parameters   :
-//              cur_lba     -   The LBA of the first part of the directory
-//                              chain (In)
-//              name        -   The name of the target (In)
-//              len         -   The length of the name string (In)
-//              target_type -   The type of the target as int (see the DEFINEs
-//                              for values) (In)
-//              not_empty   -   Whether an empty entry is invalid (boolean) (In)
-//              base_lba    -   A pointer to an unsigned int, which will contain
-//                              the base LBA of the entry of the target (Out)
-//              offset      -   A pointer to an unsigned int, which will contain
-//                              the offset of the entry of the target (Out)
+//              bitmap  -   A pointer to the leaf bitmap block (In)
+//              leaf    -   The index of the bitmap block in the leaf level (In)
+//              from    -   The index of the bit to start searching from (In)
+//              count   -   The wanted length of the run (In)
+//              len     -   A pointer to an unsigned int, which will contain the
+//                          length of the run, or 0 if there is no free block
+//                          (Out)
 //
-// Return Value :   0 if successful, otherwise error specifier
+// Return Value :   The index of the bit of the first block of the run
 //
 // -----------------------------------------------------------------------------
 
-int find_in_dir(uint32_t cur_lba, const char *name, uint32_t len,
-        int target_type, int not_empty, uint32_t *base_lba, uint32_t *offset) {
-    char *f_name;
-    uint32_t c;
-    uint32_t entry_offset;
-    uint32_t next_lba;
-    uint32_t f_len;
-    DirPart *dir;
-
-    f_name = (char *) malloc(NAME_LEN);
-    if (len <= NAME_LEN)
-        f_len = len;
-    else
-        f_len = NAME_LEN;
-    memcpy((void *) f_name, (void *) name, f_len);
-    dir = (DirPart *) malloc(sizeof (DirPart));
-
-    while (1) {
-        read_bbb(fs_dev, cur_lba, 1, (void *) dir);
-        c = 0;
-        for (entry_offset = 0; entry_offset < DIR_ENTRIES_PER_PART; entry_offset++) {
-            if (c >= dir->part_size)
-                break;
-            if (dir->entry[entry_offset].addr & PRESENT) {
-                c++;
-
-                if (target_type == TYPE_DIR && !(dir->entry[entry_offset].addr & IS_DIR))
-                    continue;
-                else if (target_type == TYPE_FILE && (dir->entry[entry_offset].addr & IS_DIR))
-                    continue;
-
-                if (not_empty && !(dir->entry[entry_offset].addr & NOT_EMPTY))
-                    continue;
+uint32_t find_free_run(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len) {
+    uint32_t i;
+    uint32_t run;
+    uint32_t run_start;
+    uint32_t best;
+    uint32_t best_start;
 
-                if (!memcmp(f_name, dir->entry[entry_offset].name, f_len)) {
-                    *base_lba = cur_lba;
-                    *offset = entry_offset;
-                    free(dir);
-                    free(f_name);
-                    return 0;
-                }
-            }
+    best = 0;
+    best_start = 0;
+    run = 0;
+    run_start = 0;
+    for (i = from; i < BITMAP_SIZE && leaf * BITMAP_SIZE + i < cluster_count; i++) {
+        if (!run && !(i % 8) && *(bitmap + i / 8) == 0xFF) {
+            // Skip a whole byte of allocated blocks.
+            i += 7;
+            continue;
         }
-        
-        next_lba = dir->next_part;
-        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY)) {
-            free(dir);
-            free(f_name);
-            return 1;
+        if (*(bitmap + i / 8) & (1 << (i % 8))) {
+            run = 0;
+            continue;
+        }
+        if (!run)
+            run_start = i;
+        run++;
+        if (run > best) {
+            best = run;
+            best_start = run_start;
+            if (best == count)
+                break;
         }
-        cur_lba = next_lba >> 9;
     }
+    *len = best;
+    return best_start;
 }
 
 // -----------------------------------------------------------------------------
-// to_path_parts
-// -------------
+// find_free_run_back
+// ------------------
 // 
-// General      :   The function creates a linked list of path-parts.
+// General      :   The function finds a run of free clusters in a leaf bitmap
+//                  block, searching backwards from a bit. The run closest to
+//                  the bit of the wanted length is returned, or the longest
+//                  run if there is no such run. A longer run gives its last
+//                  clusters, which are the closest ones.
 //
 // Parameters   :
-//              path        -   The path to the target in the file-system (In)
-//              len         -   The length of the path string (In)
+//              bitmap  -   A pointer to the leaf bitmap block (In)
+//              leaf    -   The index of the bitmap block in the leaf level (In)
+//              from    -   The index of the bit after the last one to search
+//                          (In)
+//              count   -   The wanted length of the run (In)
+//              len     -   A pointer to an unsigned int, which will contain the
+//                          length of the run, or 0 if there is no free block
+//                          (Out)
 //
-// Return Value :   A pointer to the fisrt path-part
+// Return Value :   The index of the bit of the first block of the run
 //
 // -----------------------------------------------------------------------------
 
-PathPart *to_path_parts(char *path, uint32_t len) {
-    PathPart *first;
-    PathPart *cur;
+uint32_t find_free_run_back(uint8_t *bitmap, uint32_t leaf, uint32_t from, uint32_t count,
+        uint32_t *len) {
     uint32_t i;
-    uint32_t cur_len;
-    uint32_t start;
+    uint32_t run;
+    uint32_t best;
+    uint32_t best_start;
 
-    first = (PathPart *) malloc(sizeof (PathPart));
-    cur = first;
-    cur_len = 0;
-    start = 0;
-    for (i = 0; i < len; i++) {
-        if (*(path + i) == '/') {
-            if (cur_len) {
-                if (cur_len > NAME_LEN)
-                    cur_len = NAME_LEN;
-                memcpy((void *) cur->name, (void *) (path + start), cur_len);
-                memset((void *) (cur->name + cur_len), 0, NAME_LEN - cur_len + 1);
-                cur->next = (PathPart *) malloc(sizeof (PathPart));
-                cur = cur->next;
-            }
-            start = i + 1;
-            cur_len = 0;
-        } else {
-            cur_len++;
+    if (leaf * BITMAP_SIZE + from > cluster_count)
+        // The rest of the block is out of the device.
+        from = cluster_count - leaf * BITMAP_SIZE;
+    best = 0;
+    best_start = 0;
+    run = 0;
+    for (i = from; i > 0; i--) {
+        if (!run && !(i % 8) && *(bitmap + (i - 1) / 8) == 0xFF) {
+            // Skip a whole byte of allocated blocks.
+            i -= 7;
+            continue;
+        }
+        if (*(bitmap + (i - 1) / 8) & (1 << ((i - 1) % 8))) {
+            run = 0;
+            continue;
+        }
+        run++;
+        if (run > best) {
+            best = run;
+            best_start = i - 1;
+            if (best == count)
+                break;
         }
     }
-
-    if (cur_len > NAME_LEN)
-        cur_len = NAME_LEN;
-    if (cur_len)
-        memcpy((void *) cur->name, (void *) (path + start), cur_len);
-    memset((void *) (cur->name + cur_len), 0, NAME_LEN - cur_len + 1);
-    cur->next = 0;
-    return first;
+    *len = best;
+    return best_start;
 }
 
 // -----------------------------------------------------------------------------
-// free_path_parts
-// ---------------
+// bfree
+// -----
 // 
-// General      :   The function frees the memory that is occupied by a
-//                  path-part linked list.
+// General      :   The function deallocates the cluster of a block.
 //
 // Parameters   :
-//              first   -   A pointer to the first path-part (In)
+//              lba -  The LBA of the block (In)
 //
 // Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-void free_path_parts(PathPart *first) {
-    PathPart *next;
+void bfree(uint32_t lba) {
+    uint32_t leaf;
+    uint32_t byte;
+    uint32_t bit;
+    uint32_t free_count;
+    uint8_t *bitmap;
+
+    lba >>= cluster_shift;
+    leaf = lba / BITMAP_SIZE;
+    if (leaf >= leaf_count)
+        return;
+    byte = (lba % BITMAP_SIZE) / 8;
+    bit = (lba % BITMAP_SIZE) % 8;
+
+    write_lock(&alloc_lock);
+    // Count the free clusters before the bit changes.
+    free_count = get_leaf_free(leaf);
+    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
+    read_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
+    if (*(bitmap + byte) & (1 << bit)) {
+        *(bitmap + byte) &= (~(1 << bit)) & 0xFF;
+        write_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
 
-    while (first) {
-        next = first->next;
-        free((void *) first);
-        first = next;
+        set_leaf_free(leaf, free_count + 1);
+        // The freed block may be kept by the cursors of open files.
+        map_generation++;
+        if (!free_count)
+            // The bitmap block is no longer full.
+            update_upper_levels(lba, 0);
+        if (leaf < first_free_leaf)
+            first_free_leaf = leaf;
     }
+    write_unlock(&alloc_lock);
+    free((void *) bitmap);
 }
 
 // -----------------------------------------------------------------------------
-// find_empty_entry
-// ----------------
+// load_bitmap_summary
+// -------------------
 // 
-// General      :   The function finds an empty entry in a directory, and sets
-//                  it to be present.
+// General      :   The function builds the in-memory summary of the bitmap
+//                  hierarchy. The summary keeps the amount of free clusters of
+//                  every leaf bitmap block. Leaves which their parent marks as
+//                  full are known to have no free clusters, the rest are
+//                  counted the first time they are needed.
 //
-// Parameters   :
-//              dir_lba     -   The LBA of the first directory part
-//              base_lba    -   A pointer to an unsigned int, which will contain
-//                              the base LBA of the entry (Out)
-//              offset      -   A pointer to an unsigned int, which will contain
-//                              the offset of the entry (Out)
+// Parameters   :   None
 //
 // Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-void find_empty_entry(uint32_t dir_lba, uint32_t *base_lba, uint32_t *offset) {
-    DirPart *dir;
+void load_bitmap_summary(void) {
     uint32_t i;
+    uint32_t pages;
+    uint32_t parent_lba;
+    uint32_t parent_size;
+    uint8_t *bitmap;
+    LevelNode *level_node;
 
-    dir = (DirPart *) malloc(sizeof (DirPart));
-    while (1) {
-        read_bbb(fs_dev, dir_lba, 1, (void *) dir);
-        for (i = 0; i < DIR_ENTRIES_PER_PART; i++) {
-            if (!(dir->entry[i].addr & PRESENT)) {
-                memset((void *) &dir->entry[i], 0, sizeof (DirEntry));
-                dir->entry[i].addr |= PRESENT;
-                dir->part_size++;
-                write_bbb(fs_dev, dir_lba, 1, (void *) dir);
-                *base_lba = dir_lba;
-                *offset = i;
+    leaf_count = 0;
+    leaf_base_lba = first_bitmap_lba;
+    parent_lba = 0;
+    parent_size = 0;
+    // Find the leaf level of the hierarchy, and the level above it.
+    for (level_node = first_level; level_node; level_node = level_node->next) {
+        if (!level_node->next) {
+            leaf_count = level_node->level_size;
+            break;
+        }
+        parent_lba = leaf_base_lba;
+        parent_size = level_node->level_size;
+        leaf_base_lba += level_node->level_size;
+    }
+    first_free_leaf = 0;
 
-                free((void *) dir);
+    // Allocate the pages of the summary and mark every leaf as unknown.
+    pages = (leaf_count + COUNTS_PER_PAGE - 1) / COUNTS_PER_PAGE;
+    leaf_free = (uint16_t **) malloc(pages * sizeof (uint16_t *));
+    for (i = 0; i < pages; i++) {
+        leaf_free[i] = (uint16_t *) palloc();
+        memset((void *) leaf_free[i], 0xFF, PAGE_SIZE);
+    }
 
-                return;
-            }
-        }
+    if (!parent_size)
+        return;
 
-        if (!(dir->next_part & PRESENT)) {
-            dir->next_part = (balloc() << 9) | PRESENT | IS_DIR | NOT_EMPTY;
-            write_bbb(fs_dev, dir_lba, 1, (void *) dir);
-        }
-        dir_lba = dir->next_part;
+    // Leaves which are marked as full in the parent level have no free clusters.
+    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
+    for (i = 0; i < leaf_count && i / BITMAP_SIZE < parent_size; i++) {
+        if (!(i % BITMAP_SIZE))
+            read_cache(fs_dev, parent_lba + i / BITMAP_SIZE, 1, (void *) bitmap);
+        if (*(bitmap + (i % BITMAP_SIZE) / 8) & (1 << (i % 8)))
+            set_leaf_free(i, 0);
     }
+    free((void *) bitmap);
 }
 
 // -----------------------------------------------------------------------------
-// delete_chain_parts
-// ------------------
+// get_leaf_free
+// -------------
 // 
-// General      :   The function deletes a chain of linked parts.
+// General      :   The function returns the amount of free clusters in a leaf
+//                  bitmap block, counting it if the summary does not know it
+//                  yet.
 //
 // Parameters   :
-//              lba -   The LBA of the first part
+//              leaf    -   The index of the bitmap block in the leaf level (In)
 //
-// Return Value :   None
+// Return Value :   The amount of free clusters
 //
 // -----------------------------------------------------------------------------
 
-void delete_chain_parts(uint32_t lba) {
-    FilePart *part;
-    uint32_t next_lba;
+uint32_t get_leaf_free(uint32_t leaf) {
+    uint32_t count;
+    uint32_t i;
+    uint32_t cluster;
+    uint8_t *bitmap;
 
-    part = (FilePart *) malloc(sizeof (FilePart));
-    while (1) {
-        read_bbb(fs_dev, lba, 1, part);
-        next_lba = part->next_part;
-        bfree(lba);
-        if (!(next_lba & PRESENT) || !(next_lba & NOT_EMPTY)) {
-            free((void *) part);
-            return;
-        }
-        lba = next_lba >> 9;
+    count = leaf_free[leaf / COUNTS_PER_PAGE][leaf % COUNTS_PER_PAGE];
+    if (count != FREE_UNKNOWN)
+        return count;
+
+    count = 0;
+    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
+    read_cache(fs_dev, leaf_base_lba + leaf, 1, (void *) bitmap);
+    for (i = 0; i < BITMAP_SIZE; i++) {
+        cluster = leaf * BITMAP_SIZE + i;
+        if (cluster >= cluster_count)
+            break;
+        if (!(*(bitmap + i / 8) & (1 << (i % 8))))
+            count++;
     }
+    free((void *) bitmap);
+    set_leaf_free(leaf, count);
+
+    return count;
 }
 
 // -----------------------------------------------------------------------------
-// balloc
-// ------
+// set_leaf_free
+// -------------
 // 
-// General      :   The function allocates a block.
+// General      :   The function sets the amount of free clusters of a leaf
+//                  bitmap block in the summary.
 //
-// Parameters   :   None
+// Parameters   :
+//              leaf    -   The index of the bitmap block in the leaf level (In)
+//              count   -   The amount of free clusters (In)
 //
-// Return Value :   The LBA of the block
+// Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-uint32_t balloc(void) {
-    uint32_t lba;
-    void *block;
-
-    lba = find_in_level(0, first_bitmap_lba, 0, first_level);
-    if (lba) {
-        block = malloc(BLOCK_SIZE);
-        memset(block, 0, BLOCK_SIZE);
-        write_bbb(fs_dev, lba, 1, block);
-        free(block);
-    }
-    return lba;
+void set_leaf_free(uint32_t leaf, uint32_t count) {
+    leaf_free[leaf / COUNTS_PER_PAGE][leaf % COUNTS_PER_PAGE] = count;
 }
 
 // -----------------------------------------------------------------------------
-// bfree
-// -----
+// update_upper_levels
+// -------------------
 // 
-// General      :   The function deallocates a block.
+// General      :   The function updates the bitmap levels above the leaves
+//                  when a leaf bitmap block becomes full or stops being full.
+//                  A bitmap block is marked full in its parent once all of its
+//                  children are full, so a full leaf may fill its ancestors up
+//                  to the root. A leaf which stops being full clears the bits
+//                  of all of its ancestors. Only bitmap blocks whose bits
+//                  actually change are written.
 //
 // Parameters   :
-//              lba -  The LBA of the block (In)
+//              cluster -   The index of the cluster that changed (In)
+//              full    -   Whether its leaf bitmap block became full (boolean)
+//                          (In)
 //
 // Return Value :   None
 //
 // -----------------------------------------------------------------------------
 
-void bfree(uint32_t lba) {
-    uint32_t base_lba;
+void update_upper_levels(uint32_t cluster, int full) {
+    uint32_t lba;
     uint32_t pos;
     uint32_t offset;
     uint32_t byte;
     uint32_t bit;
     uint32_t i;
+    uint32_t children;
+    uint32_t *level_lba;
+    uint32_t *level_size;
     uint8_t level;
     uint8_t *bitmap;
     LevelNode *level_node;
 
-    base_lba = first_bitmap_lba;
-    level_node = first_level;
+    // Find the first LBA and the size of every level, the leaves being level
+    // 1 and the root being the top one.
+    level_lba = (uint32_t *) malloc((levels + 1) * sizeof (uint32_t));
+    level_size = (uint32_t *) malloc((levels + 1) * sizeof (uint32_t));
+    lba = first_bitmap_lba;
     level = levels;
-    bitmap = (uint8_t *) malloc(BLOCK_SIZE);
-    while (level) {
-        pos = lba;
-        for (i = 1; i < level; i++)
-            pos /= BITMAP_SIZE;
-        offset = pos / BITMAP_SIZE;
-        byte = (pos % BITMAP_SIZE) / 8;
-        bit = (pos % BITMAP_SIZE) % 8;
-        read_bbb(fs_dev, base_lba + offset, 1, (void *) bitmap);
-        *(bitmap + byte) &= (~(1 << bit)) & 0xFF;
-        write_bbb(fs_dev, base_lba + offset, 1, (void *) bitmap);
-
-        base_lba += level_node->level_size;
-        level_node = level_node->next;
+    for (level_node = first_level; level_node && level; level_node = level_node->next) {
+        level_lba[level] = lba;
+        level_size[level] = level_node->level_size;
+        lba += level_node->level_size;
         level--;
     }
-    free((void *) bitmap);
-}
-
-// -----------------------------------------------------------------------------
-// find_in_level
-// -------------
-// 
-// General      :   The function finds a free block in the bitmap hierarchy.
-//
-// Parameters   :
-//              level       -   The level of the bitmap in the hierarchy (for
-//                              recursion) (In)
-//              base_lba    -   The base LBA of the bitmap level (In)
-//              offset      -   The offset of the bitmap (In)
-//              level_node  -   A pointer to a level-node which contains the
-//                              amount of bitmap in the current level (In)
-//
-// Return Value :   The LBA of the block
-//
-// -----------------------------------------------------------------------------
-
-uint32_t find_in_level(uint8_t level, uint32_t base_lba, uint32_t offset,
-        LevelNode *level_node) {
-    uint32_t lba;
-    uint32_t i;
-    uint32_t next_offset;
-    uint32_t val;
-    uint8_t *bitmap;
-    uint8_t n;
-    uint8_t b;
 
-    lba = base_lba + offset;
     bitmap = (uint8_t *) malloc(BLOCK_SIZE);
-    read_bbb(fs_dev, lba, 1, (void *) bitmap);
-    for (i = 0; i < BLOCK_SIZE; i++) {
-        if (*(bitmap + i) != 0xFF) {
-            n = *(bitmap + i);
-            for (b = 0; b < 8; b++)
-                if (!(n & (1 << b))) {
-                    next_offset = i * 8 + b;
-                    if (level == levels - 1) {
-                        n |= 1 << b;
-                        *(bitmap + i) = n;
-                        write_bbb(fs_dev, lba, 1, (void *) bitmap);
-                        free((void *) bitmap);
-                        return offset * BITMAP_SIZE + next_offset;
-                    }
-                    val = find_in_level(level + 1, base_lba + level_node->level_size, next_offset, level_node->next);
-                    if (val) {
-                        free((void *) bitmap);
-                        return val;
-                    }
-                    n |= 1 << b;
-                    *(bitmap + i) = n;
-                    write_bbb(fs_dev, lba, 1, (void *) bitmap);
-                }
+    // Go over the levels from the parents of the leaves up to the root. pos is
+    // the index of the changed bitmap block of the level below.
+    pos = cluster / BITMAP_SIZE;
+    for (level = 2; level <= levels; level++) {
+        offset = pos / BITMAP_SIZE;
+        byte = (pos % BITMAP_SIZE) / 8;
+        bit = (pos % BITMAP_SIZE) % 8;
+        if (offset >= level_size[level])
+            break;
+        read_cache(fs_dev, level_lba[level] + offset, 1, (void *) bitmap);
+        if (full) {
+            if (!(*(bitmap + byte) & (1 << bit))) {
+                *(bitmap + byte) |= 1 << bit;
+                write_cache(fs_dev, level_lba[level] + offset, 1, (void *) bitmap);
+            }
+            // The block is full only once all of its children are.
+            children = level_size[level - 1] - offset * BITMAP_SIZE;
+            if (children > BITMAP_SIZE)
+                children = BITMAP_SIZE;
+            for (i = 0; i < children; i++)
+                if (!(*(bitmap + i / 8) & (1 << (i % 8))))
+                    break;
+            if (i < children)
+                break;
+        } else if (*(bitmap + byte) & (1 << bit)) {
+            *(bitmap + byte) &= (~(1 << bit)) & 0xFF;
+            write_cache(fs_dev, level_lba[level] + offset, 1, (void *) bitmap);
         }
+        pos = offset;
     }
+
     free((void *) bitmap);
-    return 0;
+    free((void *) level_size);
+    free((void *) level_lba);
 }
 
 // -----------------------------------------------------------------------------
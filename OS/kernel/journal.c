@@ -0,0 +1,519 @@
+// -----------------------------------------------------------------------------
+// Metadata Journal Module
+// -----------------------
+//
+// General      :   The module keeps a write-ahead log of the file-system
+//                  metadata, so the changes of an operation reach the device
+//                  all together, with one sequential write, or not at all.
+//
+// Input        :   None
+//
+// Process      :   Appends the dirty blocks of the block cache to the log as
+//                  a transaction of a descriptor block followed by the images
+//                  of the blocks, replays the complete transactions of the log
+//                  when the file-system is initialized, and empties the log
+//                  once the blocks are written to their home locations. The
+//                  dirty blocks are committed only while no operation is open,
+//                  all of them in one transaction, so the log never holds
+//                  half of an operation.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <journal.h>
+
+
+static UHCIDevice *journal_dev;
+static uint32_t journal_lba;
+static uint32_t log_blocks;
+static uint32_t head;
+static uint32_t seq;
+static uint32_t depth;
+static int committing;
+static uint32_t logged[JOURNAL_MAX_LOG];
+
+
+// -----------------------------------------------------------------------------
+// init_journal
+// ------------
+//
+// General      :   The function replays the complete transactions of the
+//                  journal of a device, and starts logging the metadata of the
+//                  device to it. A device without a journal is written in
+//                  place, as before, and so is a device whose log can not hold
+//                  every block of the cache in one transaction.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              lba     -   The LBA of the journal header, or 0 if the device
+//                          has no journal (In)
+//              blocks  -   The amount of blocks of the journal, including the
+//                          header (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int init_journal(UHCIDevice *dev, uint32_t lba, uint32_t blocks) {
+    JournalHeader *header;
+    uint32_t first_seq;
+    int status;
+
+    journal_dev = 0;
+    head = 0;
+    depth = 0;
+    committing = 0;
+    if (!lba || blocks < JOURNAL_MIN_BLOCKS)
+        return 0;
+
+    journal_lba = lba;
+    log_blocks = blocks - 1;
+    if (log_blocks > JOURNAL_MAX_LOG)
+        log_blocks = JOURNAL_MAX_LOG;
+
+    header = (JournalHeader *) malloc(sizeof (JournalHeader));
+    status = read_bbb(dev, journal_lba, 1, header);
+    if (!status) {
+        if (memcmp(header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN)) {
+            // The journal was never used, start an empty one.
+            memset((void *) header, 0, sizeof (JournalHeader));
+            memcpy(header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+            header->seq = 1;
+            status = write_bbb(dev, journal_lba, 1, header);
+        } else {
+            first_seq = header->seq;
+            status = replay_journal(dev, header);
+            if (!status && header->seq != first_seq)
+                // The replayed transactions are not needed anymore.
+                status = write_bbb(dev, journal_lba, 1, header);
+        }
+    }
+    if (!status && log_blocks >= JOURNAL_MIN_LOG) {
+        journal_dev = dev;
+        seq = header->seq;
+    }
+    free((void *) header);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// journal_active
+// --------------
+//
+// General      :   The function checks whether the metadata of a device is
+//                  logged to a journal.
+//
+// Parameters   :
+//              dev -   A pointer to the USB device descriptor (In)
+//
+// Return Value :   1 if the device is journaled, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int journal_active(UHCIDevice *dev) {
+    return journal_dev && dev == journal_dev;
+}
+
+// -----------------------------------------------------------------------------
+// journal_room
+// ------------
+//
+// General      :   The function calculates how many blocks the next
+//                  transaction may contain before the log is full.
+//
+// Parameters   :   None
+//
+// Return Value :   The amount of blocks (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t journal_room(void) {
+    uint32_t room;
+
+    if (head + 1 >= log_blocks)
+        return 0;
+    room = log_blocks - head - 1;
+    return room < JOURNAL_DESC_LBAS ? room : JOURNAL_DESC_LBAS;
+}
+
+// -----------------------------------------------------------------------------
+// journal_commit
+// --------------
+//
+// General      :   The function appends a transaction to the log. The
+//                  descriptor and the images are written sequentially, one
+//                  page at a time, and the transaction counts only once all of
+//                  them match its checksum.
+//
+// Parameters   :
+//              count   -   The amount of blocks in the transaction (In)
+//              lbas    -   A pointer to the home LBAs of the blocks (In)
+//              images  -   A pointer to pointers to the data of the blocks (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int journal_commit(uint32_t count, uint32_t *lbas, void **images) {
+    JournalDesc *desc;
+    void *buff;
+    uint32_t lba;
+    uint32_t run;
+    uint32_t i;
+    int status;
+
+    if (!journal_dev || !count || count > journal_room())
+        return 1;
+
+    // The descriptor is the first block of the first page written.
+    buff = palloc();
+    desc = (JournalDesc *) buff;
+    memcpy(desc->magic, JOURNAL_DESC_MAGIC, JOURNAL_MAGIC_LEN);
+    desc->seq = seq;
+    desc->count = count;
+    desc->checksum = FNV_OFFSET_BASIS;
+    for (i = 0; i < count; i++) {
+        desc->lba[i] = lbas[i];
+        desc->checksum = journal_checksum(desc->checksum, images[i]);
+    }
+
+    lba = journal_lba + 1 + head;
+    run = 1;
+    for (i = 0; i < count; i++) {
+        memcpy(buff + run * JOURNAL_BLOCK_SIZE, images[i], JOURNAL_BLOCK_SIZE);
+        run++;
+        if (run == JOURNAL_PAGE_BLOCKS || i == count - 1) {
+            status = write_bbb(journal_dev, lba, run, buff);
+            if (status) {
+                pfree(buff);
+                return status;
+            }
+            lba += run;
+            run = 0;
+        }
+    }
+    pfree(buff);
+
+    // Remember which blocks the log holds images of.
+    logged[head] = journal_lba + 1 + head;
+    for (i = 0; i < count; i++)
+        logged[head + 1 + i] = lbas[i];
+    head += 1 + count;
+    seq++;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// journal_reset
+// -------------
+//
+// General      :   The function empties the log, after all the logged blocks
+//                  were written to their home locations.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int journal_reset(void) {
+    JournalHeader *header;
+    int status;
+
+    if (!journal_dev || !head)
+        return 0;
+
+    // Transactions older than the sequence in the header are not replayed.
+    header = (JournalHeader *) malloc(sizeof (JournalHeader));
+    memset((void *) header, 0, sizeof (JournalHeader));
+    memcpy(header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    header->seq = seq;
+    status = write_bbb(journal_dev, journal_lba, 1, header);
+    free((void *) header);
+    if (!status)
+        head = 0;
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// journal_logged
+// --------------
+//
+// General      :   The function checks whether the log holds an image of any
+//                  block of a range. Such blocks may not be written in place
+//                  before the log is emptied, since replaying it would bring
+//                  the old images back.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              block   -   The LBA of the first block of the range (In)
+//              count   -   The amount of blocks in the range (In)
+//
+// Return Value :   1 if the log holds such an image, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int journal_logged(UHCIDevice *dev, uint32_t block, uint32_t count) {
+    uint32_t i;
+
+    if (!journal_active(dev))
+        return 0;
+
+    for (i = 0; i < head; i++)
+        if (logged[i] >= block && logged[i] - block < count)
+            return 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// journal_image
+// -------------
+//
+// General      :   The function finds the newest image of a block in the log.
+//
+// Parameters   :
+//              block   -   The LBA of the block (In)
+//
+// Return Value :   The LBA of the image in the log, or 0 if the log holds no
+//                  image of the block
+//
+// -----------------------------------------------------------------------------
+
+uint32_t journal_image(uint32_t block) {
+    uint32_t i;
+
+    // The descriptors hold LBAs of the log, which are never logged.
+    for (i = head; i; i--)
+        if (logged[i - 1] == block)
+            return journal_lba + i;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// journal_begin
+// -------------
+//
+// General      :   The function marks the start of a file-system operation.
+//                  Operations may nest, and may run in several threads. A new
+//                  operation waits while the changes of the last ones are
+//                  being committed, so it does not slip into their transaction.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void journal_begin(void) {
+    CLEAR_INTS();
+    while (committing) {
+        SET_INTS();
+        wait_ticks(1);
+        CLEAR_INTS();
+    }
+    depth++;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// journal_end
+// -----------
+//
+// General      :   The function marks the end of a file-system operation. The
+//                  changes of the operations done since the last commit are
+//                  committed together once enough of them are waiting.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void journal_end(void) {
+    int commit;
+
+    CLEAR_INTS();
+    if (depth)
+        depth--;
+    // Only the last operation to end commits, while no other one runs.
+    commit = !depth && !committing && journal_dev;
+    if (commit)
+        committing = 1;
+    SET_INTS();
+
+    if (commit) {
+        if (count_dirty_cache() >= JOURNAL_COMMIT_DIRTY)
+            commit_cache();
+        committing = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// journal_hold
+// ------------
+//
+// General      :   The function waits until no operation is open and no
+//                  commit runs, and keeps new operations from starting until
+//                  journal_release is called, so the dirty blocks can be
+//                  committed as a whole. It is not called inside an operation.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void journal_hold(void) {
+    CLEAR_INTS();
+    while (depth || committing) {
+        SET_INTS();
+        wait_ticks(1);
+        CLEAR_INTS();
+    }
+    committing = 1;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// journal_try_hold
+// ----------------
+//
+// General      :   The function holds the journal as journal_hold does, if it
+//                  can be done without waiting.
+//
+// Parameters   :   None
+//
+// Return Value :   0 if the journal is held, otherwise 1 (an operation is
+//                  open or a commit runs)
+//
+// -----------------------------------------------------------------------------
+
+int journal_try_hold(void) {
+    int status;
+
+    CLEAR_INTS();
+    status = depth || committing;
+    if (!status)
+        committing = 1;
+    SET_INTS();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// journal_release
+// ---------------
+//
+// General      :   The function lets new operations start again.
+//
+// Parameters   :   None
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void journal_release(void) {
+    committing = 0;
+}
+
+// -----------------------------------------------------------------------------
+// replay_journal
+// --------------
+//
+// General      :   The function writes the images of the complete transactions
+//                  of the log to their home locations. The replay stops at the
+//                  first transaction which is out of sequence or torn.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              header  -   A pointer to the journal header, whose sequence is
+//                          advanced past the replayed transactions (In/Out)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int replay_journal(UHCIDevice *dev, JournalHeader *header) {
+    JournalDesc *desc;
+    void *image;
+    uint32_t pos;
+    uint32_t hash;
+    uint32_t i;
+    int status;
+
+    desc = (JournalDesc *) malloc(sizeof (JournalDesc));
+    image = malloc(JOURNAL_BLOCK_SIZE);
+
+    pos = 0;
+    status = 0;
+    while (pos + 1 < log_blocks) {
+        status = read_bbb(dev, journal_lba + 1 + pos, 1, desc);
+        if (status)
+            break;
+        if (memcmp(desc->magic, JOURNAL_DESC_MAGIC, JOURNAL_MAGIC_LEN) ||
+                desc->seq != header->seq || !desc->count ||
+                desc->count > JOURNAL_DESC_LBAS || pos + 1 + desc->count > log_blocks)
+            break;
+
+        // Check that the whole transaction reached the device.
+        hash = FNV_OFFSET_BASIS;
+        for (i = 0; i < desc->count && !status; i++) {
+            status = read_bbb(dev, journal_lba + 2 + pos + i, 1, image);
+            hash = journal_checksum(hash, image);
+        }
+        if (status || hash != desc->checksum)
+            break;
+
+        // Write the images through the cache, which keeps cached copies of the
+        // blocks up to date.
+        for (i = 0; i < desc->count && !status; i++) {
+            status = read_bbb(dev, journal_lba + 2 + pos + i, 1, image);
+            if (!status)
+                status = write_cache(dev, desc->lba[i], 1, image);
+        }
+        if (status)
+            break;
+
+        pos += 1 + desc->count;
+        header->seq++;
+    }
+    if (!status && pos)
+        status = sync_cache();
+
+    free(image);
+    free((void *) desc);
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// journal_checksum
+// ----------------
+//
+// General      :   The function adds the image of a block to the checksum of
+//                  a transaction, using 32-bit FNV-1a over its words.
+//
+// Parameters   :
+//              hash    -   The checksum of the previous images (In)
+//              image   -   A pointer to the data of the block (In)
+//
+// Return Value :   The updated checksum (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t journal_checksum(uint32_t hash, void *image) {
+    uint32_t *word;
+    uint32_t i;
+
+    word = (uint32_t *) image;
+    for (i = 0; i < JOURNAL_BLOCK_SIZE / sizeof (uint32_t); i++)
+        hash = (hash ^ word[i]) * FNV_PRIME;
+    return hash;
+}
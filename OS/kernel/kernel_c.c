@@ -19,6 +19,8 @@ void kernel_main(void)
 	init_time();
 	puts("INITIATING PROCESSING...\n");
 	init_processing();
+	puts("INITIATING BLOCK CACHE...\n");
+	init_cache();
 	puts("INITIATING UHCI SUPPORTED DEVICES...\n");
 	init_uhci();
 	puts("INITIATING KEYBOARD...\n");
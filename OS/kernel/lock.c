@@ -0,0 +1,304 @@
+// -----------------------------------------------------------------------------
+// Lock Module
+// -----------
+//
+// General      :   The module provides reader-writer locks for the threads of
+//                  the kernel.
+//
+// Input        :   None
+//
+// Process      :   A lock is held by any amount of readers, or by a single
+//                  writer. The state of a lock is changed with interrupts
+//                  cleared, and a thread which has to wait gives up the
+//                  processor until the next tick. Waiting writers keep new
+//                  readers out, so a stream of readers does not starve them.
+//                  The writer of a lock may lock it again, for reading or
+//                  writing. Locks of objects which come and go are taken from
+//                  tables of slots, by the key of the object.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <lock.h>
+
+
+// -----------------------------------------------------------------------------
+// init_rwlock
+// -----------
+//
+// General      :   The function initializes a lock as free.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void init_rwlock(RWLock *l) {
+    l->readers = 0;
+    l->writers = 0;
+    l->owner = 0;
+    l->depth = 0;
+}
+
+// -----------------------------------------------------------------------------
+// read_lock
+// ---------
+//
+// General      :   The function locks a lock for reading, waiting while it is
+//                  held or wanted by a writer. A reader must not lock the
+//                  same lock for reading again, since a writer may be waiting
+//                  in between.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void read_lock(RWLock *l) {
+    while (try_read_lock(l))
+        wait_ticks(LOCK_WAIT_TICKS);
+}
+
+// -----------------------------------------------------------------------------
+// read_unlock
+// -----------
+//
+// General      :   The function unlocks a lock locked for reading.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void read_unlock(RWLock *l) {
+    CLEAR_INTS();
+    if (l->depth && l->owner == get_current_thread()) {
+        // The writer locked it for reading as well.
+        l->depth--;
+    } else
+        l->readers--;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// write_lock
+// ----------
+//
+// General      :   The function locks a lock for writing, waiting until no
+//                  other thread holds it.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_lock(RWLock *l) {
+    ThreadNode *self;
+
+    self = get_current_thread();
+    CLEAR_INTS();
+    if (l->depth && l->owner == self) {
+        l->depth++;
+        SET_INTS();
+        return;
+    }
+    // Keep new readers out until the lock is taken.
+    l->writers++;
+    while (l->depth || l->readers) {
+        SET_INTS();
+        wait_ticks(LOCK_WAIT_TICKS);
+        CLEAR_INTS();
+    }
+    l->writers--;
+    l->owner = self;
+    l->depth = 1;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// write_unlock
+// ------------
+//
+// General      :   The function unlocks a lock locked for writing.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void write_unlock(RWLock *l) {
+    CLEAR_INTS();
+    l->depth--;
+    SET_INTS();
+}
+
+// -----------------------------------------------------------------------------
+// try_read_lock
+// -------------
+//
+// General      :   The function locks a lock for reading if it can be done
+//                  without waiting.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   0 if the lock was locked, otherwise 1
+//
+// -----------------------------------------------------------------------------
+
+int try_read_lock(RWLock *l) {
+    ThreadNode *self;
+    int status;
+
+    self = get_current_thread();
+    status = 0;
+    CLEAR_INTS();
+    if (l->depth && l->owner == self)
+        l->depth++;
+    else if (l->depth || l->writers)
+        status = 1;
+    else
+        l->readers++;
+    SET_INTS();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// try_write_lock
+// --------------
+//
+// General      :   The function locks a lock for writing if it can be done
+//                  without waiting.
+//
+// Parameters   :
+//              l   -   A pointer to the lock (In/Out)
+//
+// Return Value :   0 if the lock was locked, otherwise 1
+//
+// -----------------------------------------------------------------------------
+
+int try_write_lock(RWLock *l) {
+    ThreadNode *self;
+    int status;
+
+    self = get_current_thread();
+    status = 0;
+    CLEAR_INTS();
+    if (l->depth && l->owner == self)
+        l->depth++;
+    else if (l->depth || l->readers)
+        status = 1;
+    else {
+        l->owner = self;
+        l->depth = 1;
+    }
+    SET_INTS();
+
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// pin_lock
+// --------
+//
+// General      :   The function finds the slot of the lock of an object in a
+//                  table of slots, and pins it, so the slot keeps the lock of
+//                  the object until it is unpinned. A free slot is taken if
+//                  the object has none, and the function waits while the
+//                  table is full.
+//
+// Parameters   :
+//              table   -   A pointer to the table of slots (In/Out)
+//              count   -   The amount of slots in the table (In)
+//              key     -   The key of the object (In)
+//
+// Return Value :   A pointer to the slot
+//
+// -----------------------------------------------------------------------------
+
+LockSlot *pin_lock(LockSlot *table, uint32_t count, uint32_t key) {
+    LockSlot *slot;
+
+    // Every slot is pinned by other objects.
+    while (!(slot = try_pin_lock(table, count, key)))
+        wait_ticks(LOCK_WAIT_TICKS);
+
+    return slot;
+}
+
+// -----------------------------------------------------------------------------
+// try_pin_lock
+// ------------
+//
+// General      :   The function pins the slot of the lock of an object if it
+//                  can be done without waiting for a free slot.
+//
+// Parameters   :
+//              table   -   A pointer to the table of slots (In/Out)
+//              count   -   The amount of slots in the table (In)
+//              key     -   The key of the object (In)
+//
+// Return Value :   A pointer to the slot, or 0 if the table is full
+//
+// -----------------------------------------------------------------------------
+
+LockSlot *try_pin_lock(LockSlot *table, uint32_t count, uint32_t key) {
+    uint32_t i;
+    LockSlot *slot;
+
+    CLEAR_INTS();
+    slot = 0;
+    for (i = 0; i < count; i++) {
+        if (table[i].users && table[i].key == key) {
+            slot = &table[i];
+            break;
+        }
+        if (!table[i].users && !slot)
+            slot = &table[i];
+    }
+    if (slot) {
+        if (!slot->users) {
+            slot->key = key;
+            init_rwlock(&slot->lock);
+        }
+        slot->users++;
+    }
+    SET_INTS();
+
+    return slot;
+}
+
+// -----------------------------------------------------------------------------
+// unpin_lock
+// ----------
+//
+// General      :   The function unpins the slot of a lock. The slot is free
+//                  once no thread pins it.
+//
+// Parameters   :
+//              slot    -   A pointer to the slot (In/Out)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void unpin_lock(LockSlot *slot) {
+    CLEAR_INTS();
+    slot->users--;
+    SET_INTS();
+}
@@ -0,0 +1,268 @@
+// -----------------------------------------------------------------------------
+// LZ4 Module
+// ----------
+//
+// General      :   The module compresses and decompresses buffers in the LZ4
+//                  block format.
+//
+// Input        :   None
+//
+// Process      :   Compresses a buffer of up to 64 KB with a single greedy
+//                  pass, which looks up every position in a table of the last
+//                  positions of hashed 4-byte sequences. The output is a run of
+//                  sequences, each made of literals copied as is and a match
+//                  which repeats earlier output.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <lz4.h>
+
+
+// -----------------------------------------------------------------------------
+// lz4_compress
+// ------------
+//
+// General      :   The function compresses a buffer.
+//
+// Parameters   :
+//              src     -   A pointer to the data to compress (In)
+//              len     -   The size of the data, up to 64 KB (In)
+//              dst     -   A pointer to the buffer of the compressed data (Out)
+//              max     -   The size of the buffer of the compressed data (In)
+//
+// Return Value :   The size of the compressed data, or 0 if it does not fit in
+//                  the buffer
+//
+// -----------------------------------------------------------------------------
+
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max) {
+    uint32_t ip;
+    uint32_t anchor;
+    uint32_t op;
+    uint32_t ref;
+    uint32_t seq;
+    uint32_t hash;
+    uint32_t lit;
+    uint32_t match;
+    uint32_t token;
+    uint32_t limit;
+    uint16_t *table;
+
+    table = (uint16_t *) palloc();
+    memset((void *) table, 0, LZ4_TABLE_SIZE);
+    ip = 0;
+    anchor = 0;
+    op = 0;
+    // The last match must start 12 bytes before the end, and end 5 bytes
+    // before it.
+    limit = len > LZ4_MATCH_LIMIT ? len - LZ4_MATCH_LIMIT : 0;
+    while (ip < limit) {
+        seq = lz4_read32(src + ip);
+        hash = lz4_hash(seq);
+        ref = table[hash];
+        table[hash] = ip;
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        match = LZ4_MIN_MATCH;
+        while (ip + match < len - LZ4_LAST_LITERALS && src[ref + match] == src[ip + match])
+            match++;
+
+        // Write the literals since the last match, and the match.
+        lit = ip - anchor;
+        if (op >= max) {
+            pfree((void *) table);
+            return 0;
+        }
+        token = op++;
+        dst[token] = (lit < LZ4_RUN_MASK ? lit : LZ4_RUN_MASK) << 4;
+        if (lit >= LZ4_RUN_MASK)
+            op = lz4_put_length(dst, op, max, lit - LZ4_RUN_MASK);
+        if (!op || op + lit + 2 > max) {
+            pfree((void *) table);
+            return 0;
+        }
+        memcpy(dst + op, (void *) (src + anchor), lit);
+        op += lit;
+        dst[op++] = (ip - ref) & 0xFF;
+        dst[op++] = (ip - ref) >> 8;
+        match -= LZ4_MIN_MATCH;
+        dst[token] |= match < LZ4_RUN_MASK ? match : LZ4_RUN_MASK;
+        if (match >= LZ4_RUN_MASK) {
+            op = lz4_put_length(dst, op, max, match - LZ4_RUN_MASK);
+            if (!op) {
+                pfree((void *) table);
+                return 0;
+            }
+        }
+        ip += match + LZ4_MIN_MATCH;
+        anchor = ip;
+    }
+    pfree((void *) table);
+
+    // The last sequence has literals alone.
+    lit = len - anchor;
+    if (op >= max)
+        return 0;
+    token = op++;
+    dst[token] = (lit < LZ4_RUN_MASK ? lit : LZ4_RUN_MASK) << 4;
+    if (lit >= LZ4_RUN_MASK)
+        op = lz4_put_length(dst, op, max, lit - LZ4_RUN_MASK);
+    if (!op || op + lit > max)
+        return 0;
+    memcpy(dst + op, (void *) (src + anchor), lit);
+
+    return op + lit;
+}
+
+// -----------------------------------------------------------------------------
+// lz4_decompress
+// --------------
+//
+// General      :   The function decompresses a buffer. Decompression stops as
+//                  soon as the wanted amount of data is produced, so the
+//                  compressed data may be followed by padding.
+//
+// Parameters   :
+//              src     -   A pointer to the compressed data (In)
+//              len     -   The size of the compressed data (In)
+//              dst     -   A pointer to the buffer of the data (Out)
+//              out_len -   The size of the data (In)
+//
+// Return Value :   0 if successful, otherwise error specifier (the compressed
+//                  data is corrupted)
+//
+// -----------------------------------------------------------------------------
+
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len) {
+    uint32_t ip;
+    uint32_t op;
+    uint32_t token;
+    uint32_t lit;
+    uint32_t match;
+    uint32_t offset;
+    uint8_t b;
+
+    ip = 0;
+    op = 0;
+    while (ip < len) {
+        token = src[ip++];
+        lit = token >> 4;
+        if (lit == LZ4_RUN_MASK) {
+            do {
+                if (ip >= len)
+                    return 1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 0xFF);
+        }
+        if (lit > len - ip || lit > out_len - op)
+            return 1;
+        memcpy(dst + op, (void *) (src + ip), lit);
+        ip += lit;
+        op += lit;
+        if (op == out_len)
+            // The last sequence has no match.
+            return 0;
+
+        if (len - ip < 2)
+            return 1;
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (!offset || offset > op)
+            return 1;
+        match = token & LZ4_RUN_MASK;
+        if (match == LZ4_RUN_MASK) {
+            do {
+                if (ip >= len)
+                    return 1;
+                b = src[ip++];
+                match += b;
+            } while (b == 0xFF);
+        }
+        match += LZ4_MIN_MATCH;
+        if (match > out_len - op)
+            return 1;
+        // The match may overlap the output it repeats, so it is copied one
+        // byte at a time.
+        while (match--) {
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+
+    return op != out_len;
+}
+
+// -----------------------------------------------------------------------------
+// lz4_put_length
+// --------------
+//
+// General      :   The function writes the part of a literals or match length
+//                  which does not fit in the token of a sequence.
+//
+// Parameters   :
+//              dst     -   A pointer to the buffer of the compressed data (Out)
+//              pos     -   The position to write the length at (In)
+//              max     -   The size of the buffer of the compressed data (In)
+//              len     -   The length (In)
+//
+// Return Value :   The position after the length, or 0 if it does not fit in
+//                  the buffer
+//
+// -----------------------------------------------------------------------------
+
+uint32_t lz4_put_length(uint8_t *dst, uint32_t pos, uint32_t max, uint32_t len) {
+    while (len >= 0xFF) {
+        if (pos >= max)
+            return 0;
+        dst[pos++] = 0xFF;
+        len -= 0xFF;
+    }
+    if (pos >= max)
+        return 0;
+    dst[pos++] = len;
+
+    return pos;
+}
+
+// -----------------------------------------------------------------------------
+// lz4_read32
+// ----------
+//
+// General      :   The function reads a little-endian 4-byte sequence.
+//
+// Parameters   :
+//              p   -   A pointer to the sequence (In)
+//
+// Return Value :   The sequence (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t lz4_read32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// -----------------------------------------------------------------------------
+// lz4_hash
+// --------
+//
+// General      :   The function hashes a 4-byte sequence into an index of the
+//                  table of positions.
+//
+// Parameters   :
+//              seq -   The sequence (In)
+//
+// Return Value :   The index (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
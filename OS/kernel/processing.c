@@ -323,6 +323,22 @@ void set_active(void) {
     current_node->status = ACTIVE;
 }
 
+// -----------------------------------------------------------------------------
+// get_current_thread
+// ------------------
+// 
+// General      :   The function returns the node of the running thread.
+//
+// Parameters   :   None
+//
+// Return Value :   A pointer to the node of the thread
+//
+// -----------------------------------------------------------------------------
+
+ThreadNode *get_current_thread(void) {
+    return current_node;
+}
+
 // -----------------------------------------------------------------------------
 // kill_th
 // -------
@@ -0,0 +1,205 @@
+// -----------------------------------------------------------------------------
+// Reference Count Module
+// ----------------------
+//
+// General      :   The module keeps the on-disk map of the blocks which are
+//                  shared by cloned files.
+//
+// Input        :   None
+//
+// Process      :   Holds one byte for every block of the device, which counts
+//                  the owners of the block beyond the first one. A block with
+//                  a count of 0 belongs to a single file and may be written
+//                  in place or freed; otherwise it is copied before it is
+//                  written, and released instead of freed.
+//
+// Output       :   None
+//
+// -----------------------------------------------------------------------------
+// Programmer   :   Eden Frenkel
+// -----------------------------------------------------------------------------
+
+
+#include <refcount.h>
+
+
+static UHCIDevice *refcount_dev;
+static uint32_t map_lba;
+static uint32_t map_blocks;
+
+
+// -----------------------------------------------------------------------------
+// init_refcount
+// -------------
+//
+// General      :   The function starts using the reference count map of a
+//                  device. A device without a map can not share blocks.
+//
+// Parameters   :
+//              dev     -   A pointer to the USB device descriptor (In)
+//              lba     -   The LBA of the map, or 0 if the device has no map
+//                          (In)
+//              blocks  -   The amount of blocks of the map (In)
+//
+// Return Value :   None
+//
+// -----------------------------------------------------------------------------
+
+void init_refcount(UHCIDevice *dev, uint32_t lba, uint32_t blocks) {
+    refcount_dev = lba && blocks ? dev : 0;
+    map_lba = lba;
+    map_blocks = blocks;
+}
+
+// -----------------------------------------------------------------------------
+// refcount_active
+// ---------------
+//
+// General      :   The function checks whether blocks of the file-system may
+//                  be shared.
+//
+// Parameters   :   None
+//
+// Return Value :   1 if the device has a reference count map, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int refcount_active(void) {
+    return refcount_dev != 0;
+}
+
+// -----------------------------------------------------------------------------
+// refcount_run
+// ------------
+//
+// General      :   The function finds how many blocks at the start of a range
+//                  are all shared, or all owned by a single file.
+//
+// Parameters   :
+//              lba     -   The LBA of the first block of the range (In)
+//              count   -   The amount of blocks in the range (In)
+//              shared  -   A pointer to an int, which will be set to whether
+//                          the blocks are shared (Out)
+//
+// Return Value :   The amount of blocks (uint32_t)
+//
+// -----------------------------------------------------------------------------
+
+uint32_t refcount_run(uint32_t lba, uint32_t count, int *shared) {
+    uint8_t *map;
+    uint32_t block;
+    uint32_t run;
+
+    *shared = 0;
+    if (!refcount_dev || lba / REFCOUNT_BLOCK_SIZE >= map_blocks)
+        return count;
+
+    map = (uint8_t *) malloc(REFCOUNT_BLOCK_SIZE);
+    block = lba / REFCOUNT_BLOCK_SIZE;
+    read_cache(refcount_dev, map_lba + block, 1, (void *) map);
+    *shared = map[lba % REFCOUNT_BLOCK_SIZE] != 0;
+
+    run = 0;
+    while (run < count) {
+        if ((lba + run) / REFCOUNT_BLOCK_SIZE != block) {
+            // The run goes on in the next block of the map.
+            block = (lba + run) / REFCOUNT_BLOCK_SIZE;
+            if (block >= map_blocks)
+                break;
+            read_cache(refcount_dev, map_lba + block, 1, (void *) map);
+        }
+        if ((map[(lba + run) % REFCOUNT_BLOCK_SIZE] != 0) != *shared)
+            break;
+        run++;
+    }
+    free((void *) map);
+
+    return run;
+}
+
+// -----------------------------------------------------------------------------
+// refcount_full
+// -------------
+//
+// General      :   The function checks whether a block of a range can not get
+//                  another owner.
+//
+// Parameters   :
+//              lba     -   The LBA of the first block of the range (In)
+//              count   -   The amount of blocks in the range (In)
+//
+// Return Value :   1 if such a block exists, otherwise 0
+//
+// -----------------------------------------------------------------------------
+
+int refcount_full(uint32_t lba, uint32_t count) {
+    uint8_t *map;
+    uint32_t block;
+    uint32_t i;
+    int full;
+
+    if (!refcount_dev || (lba + count - 1) / REFCOUNT_BLOCK_SIZE >= map_blocks)
+        return 1;
+
+    map = (uint8_t *) malloc(REFCOUNT_BLOCK_SIZE);
+    block = map_blocks;
+    full = 0;
+    for (i = 0; i < count && !full; i++) {
+        if ((lba + i) / REFCOUNT_BLOCK_SIZE != block) {
+            block = (lba + i) / REFCOUNT_BLOCK_SIZE;
+            read_cache(refcount_dev, map_lba + block, 1, (void *) map);
+        }
+        full = map[(lba + i) % REFCOUNT_BLOCK_SIZE] == REFCOUNT_MAX;
+    }
+    free((void *) map);
+
+    return full;
+}
+
+// -----------------------------------------------------------------------------
+// add_refcount
+// ------------
+//
+// General      :   The function adds an owner to every block of a range, or
+//                  removes one. Every block of the map is written once.
+//
+// Parameters   :
+//              lba     -   The LBA of the first block of the range (In)
+//              count   -   The amount of blocks in the range (In)
+//              delta   -   1 to add an owner, -1 to remove one (In)
+//
+// Return Value :   0 if successful, otherwise an error specifier (int)
+//
+// -----------------------------------------------------------------------------
+
+int add_refcount(uint32_t lba, uint32_t count, int delta) {
+    uint8_t *map;
+    uint32_t block;
+    uint32_t pos;
+    uint32_t i;
+
+    if (!count)
+        return 0;
+    if (!refcount_dev || (lba + count - 1) / REFCOUNT_BLOCK_SIZE >= map_blocks)
+        return 1;
+
+    map = (uint8_t *) malloc(REFCOUNT_BLOCK_SIZE);
+    i = 0;
+    while (i < count) {
+        block = (lba + i) / REFCOUNT_BLOCK_SIZE;
+        read_cache(refcount_dev, map_lba + block, 1, (void *) map);
+        // Update all of the range which this block of the map covers.
+        do {
+            pos = (lba + i) % REFCOUNT_BLOCK_SIZE;
+            if (delta > 0 && map[pos] < REFCOUNT_MAX)
+                map[pos]++;
+            else if (delta < 0 && map[pos])
+                map[pos]--;
+            i++;
+        } while (i < count && (lba + i) % REFCOUNT_BLOCK_SIZE);
+        write_cache(refcount_dev, map_lba + block, 1, (void *) map);
+    }
+    free((void *) map);
+
+    return 0;
+}
@@ -121,11 +121,12 @@ int strcmp(const char *s1, const char *s2) {
 }
 
 int memcmp(const char *s1, const char *s2, uint32_t n) {
-    while (*s1 == *s2 && n--) {
+    while (n && *s1 == *s2) {
         s1++;
         s2++;
+        n--;
     }
-    if (*s1 == *s2)
+    if (!n)
         return 0;
     if (*s1 > *s2)
         return 1;